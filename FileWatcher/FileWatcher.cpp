@@ -0,0 +1,720 @@
+#include "FileWatcher.hpp"
+#include "FileWatcherEventQueue.hpp"
+#include "FileWatcherFilter.hpp"
+#include "FileWatcherFingerprints.hpp"
+#include "FileWatcherMetrics.hpp"
+
+/* Platform independent parts of the file watcher, the backends only decode the events. */
+
+// Watcher whose callback the thread is running, whose directories are resolved from the batch being delivered
+static thread_local const FileWatcher* s_DeliveringWatcher{ nullptr };
+
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, FileWatcherCallback&& callback, const bool returnAbsolutePath, std::error_code& error) noexcept
+	:
+	FileWatcher(observedPath, AdaptCallback(std::move(callback)), FileWatcherOptions{ .ReturnAbsolutePath{ returnAbsolutePath } }, error)
+{
+}
+
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, const FileWatcherCallback& callback, const bool returnAbsolutePath, std::error_code& error) noexcept
+	:
+	FileWatcher(observedPath, AdaptCallback(FileWatcherCallback(callback)), FileWatcherOptions{ .ReturnAbsolutePath{ returnAbsolutePath } }, error)
+{
+}
+
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, FileWatcherCallback&& callback, const FileWatcherOptions& options, std::error_code& error) noexcept
+	:
+	FileWatcher(observedPath, AdaptCallback(std::move(callback)), options, error)
+{
+}
+
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, const FileWatcherCallback& callback, const FileWatcherOptions& options, std::error_code& error) noexcept
+	:
+	FileWatcher(observedPath, AdaptCallback(FileWatcherCallback(callback)), options, error)
+{
+}
+
+bool FileWatcher::IsReady() const noexcept
+{
+	return m_IsReady.load();
+}
+
+FileWatcherBatchCallback FileWatcher::AdaptCallback(FileWatcherCallback&& callback) noexcept
+{
+	assert(callback != nullptr);
+
+	return [callback{ std::move(callback) }](const FileWatcher& watcher, const std::span<const FileWatcherEvent> events)
+	{
+		for (const FileWatcherEvent& event : events)
+		{
+			if (event.Action == EFileAction::Renamed)
+				callback(watcher.ResolvePath(event.OldDirectoryId, event.OldName), watcher.ResolvePath(event.DirectoryId, event.Name), event.Action, event.Error);
+			else
+				callback(watcher.ResolvePath(event.DirectoryId, event.Name), std::nullopt, event.Action, event.Error);
+		}
+	};
+}
+
+void FileWatcher::QueueEvent(const EFileAction action, const uint32_t directoryId, const FileWatcherStringView name, const std::error_code& error, const bool isDirectory) noexcept
+{
+	// Closing the file ends the modifications held back to compare it's content, whether the close is reported or not
+	if (action == EFileAction::CloseWrite && m_Fingerprints && m_Options.CoalescingPeriod == std::chrono::milliseconds::zero())
+		ReleaseCoalescedEvent(directoryId, name);
+
+	if (!IsSubscribed(action))
+		return;
+
+	// Errors concerning an entry are reported even if it's filtered out
+	if (m_Filter && directoryId != FileWatcherEvent::s_NoDirectory && !error && action != EFileAction::Error && !IsReported(directoryId, name, isDirectory))
+		return;
+
+	if (m_Options.CoalescingPeriod > std::chrono::milliseconds::zero() || m_Fingerprints)
+	{
+		if (directoryId != FileWatcherEvent::s_NoDirectory && !error && IsCoalesced(action))
+		{
+			CoalesceEvent(action, directoryId, name, isDirectory);
+			return;
+		}
+
+		// Errors and overflows concern everything reported before them
+		if (directoryId == FileWatcherEvent::s_NoDirectory)
+			ExpireCoalescedEvents(std::chrono::steady_clock::time_point::max());
+		else
+			ReleaseCoalescedEvent(directoryId, name);
+	}
+
+	AppendEvent(action, directoryId, name, error, isDirectory);
+}
+
+void FileWatcher::QueueRename(const uint32_t oldDirectoryId, const FileWatcherStringView oldName, const uint32_t directoryId, const FileWatcherStringView name, const bool isDirectory) noexcept
+{
+	// A rename across the filter's boundary is seen from one side only, one not subscribed to as the deletion and creation it amounts to
+	const bool isRenameSubscribed{ IsSubscribed(EFileAction::Renamed) };
+	if (m_Filter || !isRenameSubscribed)
+	{
+		const bool isOldReported{ !m_Filter || IsReported(oldDirectoryId, oldName, isDirectory) };
+		const bool isReported{ !m_Filter || IsReported(directoryId, name, isDirectory) };
+		if (!isOldReported || !isReported || !isRenameSubscribed)
+		{
+			if (isOldReported)
+				QueueEvent(EFileAction::Deleted, oldDirectoryId, oldName, {}, isDirectory);
+
+			if (isReported)
+				QueueEvent(EFileAction::Created, directoryId, name, {}, isDirectory);
+
+			return;
+		}
+	}
+
+	if (m_Options.CoalescingPeriod > std::chrono::milliseconds::zero() || m_Fingerprints)
+	{
+		ReleaseCoalescedEvent(oldDirectoryId, oldName);
+		ReleaseCoalescedEvent(directoryId, name);
+	}
+
+	m_QueuedEvents.push_back(QueuedEvent
+	{
+		.Action{ EFileAction::Renamed },
+		.DirectoryId{ directoryId },
+		.NameOffset{ static_cast<uint32_t>(m_BatchNames.size()) },
+		.NameLength{ static_cast<uint32_t>(name.size()) },
+		.OldDirectoryId{ oldDirectoryId },
+		.OldNameOffset{ static_cast<uint32_t>(m_BatchNames.size() + name.size()) },
+		.OldNameLength{ static_cast<uint32_t>(oldName.size()) },
+		.Error{},
+		.IsDirectory{ isDirectory },
+	});
+
+	m_BatchNames.append(name);
+	m_BatchNames.append(oldName);
+}
+
+void FileWatcher::AppendEvent(const EFileAction action, const uint32_t directoryId, const FileWatcherStringView name, const std::error_code& error, const bool isDirectory) noexcept
+{
+	m_QueuedEvents.push_back(QueuedEvent
+	{
+		.Action{ action },
+		.DirectoryId{ directoryId },
+		.NameOffset{ static_cast<uint32_t>(m_BatchNames.size()) },
+		.NameLength{ static_cast<uint32_t>(name.size()) },
+		.OldDirectoryId{ FileWatcherEvent::s_NoDirectory },
+		.OldNameOffset{ 0U },
+		.OldNameLength{ 0U },
+		.Error{ error },
+		.IsDirectory{ isDirectory },
+	});
+
+	m_BatchNames.append(name);
+}
+
+bool FileWatcher::IsCoalesced(const EFileAction action) const noexcept
+{
+	if (m_Options.CoalescingPeriod > std::chrono::milliseconds::zero())
+		return action == EFileAction::Created || action == EFileAction::Deleted || action == EFileAction::Modified;
+
+	// Modifications are held back until the file is closed or left alone, so they're compared to the content the writer left behind
+	return m_Fingerprints && action == EFileAction::Modified;
+}
+
+void FileWatcher::CoalesceEvent(const EFileAction action, const uint32_t directoryId, const FileWatcherStringView name, const bool isDirectory) noexcept
+{
+	const auto pending{ m_CoalescedEvents.find(CoalescingKeyView{ directoryId, name }) };
+	if (pending == m_CoalescedEvents.end())
+	{
+		const std::chrono::milliseconds period{ m_Options.CoalescingPeriod > std::chrono::milliseconds::zero() ? m_Options.CoalescingPeriod : s_FingerprintQuietPeriod };
+		auto [coalescedEvent, _] { m_CoalescedEvents.emplace(CoalescingKey{ directoryId, FileWatcherPathBuffer(name) }, CoalescedEvent{ .Action{ action }, .Deadline{ std::chrono::steady_clock::now() + period }, .IsDirectory{ isDirectory } }) };
+		m_CoalescingQueue.push_back(&*coalescedEvent);
+		return;
+	}
+
+	// The deadline stays, so an event is never held back longer than the period
+	std::optional<EFileAction>& pendingAction{ pending->second.Action };
+	pending->second.IsDirectory = isDirectory;
+	m_CoalescedEventCount.fetch_add(1U, std::memory_order_relaxed);
+
+	// Still a new file
+	if (pendingAction == EFileAction::Created && action == EFileAction::Modified)
+		return;
+
+	// Never existed as far as the callback is concerned
+	if (pendingAction == EFileAction::Created && action == EFileAction::Deleted)
+	{
+		pendingAction.reset();
+		return;
+	}
+
+	// Replaced
+	if (pendingAction == EFileAction::Deleted && action == EFileAction::Created)
+	{
+		pendingAction = EFileAction::Modified;
+		return;
+	}
+
+	pendingAction = action;
+}
+
+void FileWatcher::ReleaseCoalescedEvent(const uint32_t directoryId, const FileWatcherStringView name) noexcept
+{
+	const auto pending{ m_CoalescedEvents.find(CoalescingKeyView{ directoryId, name }) };
+	if (pending == m_CoalescedEvents.end() || !pending->second.Action)
+		return;
+
+	// The entry itself leaves with it's place in the queue
+	AppendEvent(*pending->second.Action, directoryId, name, std::error_code{}, pending->second.IsDirectory);
+	pending->second.Action.reset();
+}
+
+std::optional<std::chrono::steady_clock::time_point> FileWatcher::ExpireCoalescedEvents(const std::chrono::steady_clock::time_point now) noexcept
+{
+	while (!m_CoalescingQueue.empty())
+	{
+		CoalescedEventMap::value_type& pending{ *m_CoalescingQueue.front() };
+		if (pending.second.Deadline > now)
+			return pending.second.Deadline;
+
+		if (pending.second.Action)
+			AppendEvent(*pending.second.Action, pending.first.DirectoryId, pending.first.Name, std::error_code{}, pending.second.IsDirectory);
+
+		m_CoalescingQueue.pop_front();
+		m_CoalescedEvents.erase(m_CoalescedEvents.find(CoalescingKeyView{ pending.first.DirectoryId, pending.first.Name }));
+	}
+
+	return std::nullopt;
+}
+
+void FileWatcher::FlushEvents() noexcept
+{
+	CollectEvents();
+	DeliverEvents();
+}
+
+void FileWatcher::CollectEvents() noexcept
+{
+	if (m_QueuedEvents.empty())
+		return;
+
+	// Looked up all at once, rather than by the callback one path at a time
+	if (m_Options.CollectFileStatus)
+		CollectFileStatus();
+
+	// The name buffer won't grow anymore, so the offsets can be turned into views.
+	const FileWatcherStringView names{ m_BatchNames };
+	if (m_DeliveryLanes)
+	{
+		for (size_t i{ 0U }; i < m_QueuedEvents.size(); ++i)
+			EnqueueEvent(m_QueuedEvents[i], names, m_BatchStatuses.empty() ? FileWatcherFileStatus{} : m_BatchStatuses[i]);
+
+		m_QueuedEvents.clear();
+		m_BatchNames.clear();
+		m_BatchStatuses.clear();
+		return;
+	}
+
+	// The paths of the directories are copied along with the names, so the callback resolves them while they're free to change
+	const uint32_t namesOffset{ static_cast<uint32_t>(m_DeliveryNames.size()) };
+	m_DeliveryNames.append(names);
+
+	for (size_t i{ 0U }; i < m_QueuedEvents.size(); ++i)
+	{
+		QueuedEvent queuedEvent{ m_QueuedEvents[i] };
+		queuedEvent.NameOffset += namesOffset;
+		queuedEvent.OldNameOffset += namesOffset;
+		m_DeliveryEvents.push_back(queuedEvent);
+		m_DeliveryStatuses.push_back(m_BatchStatuses.empty() ? FileWatcherFileStatus{} : m_BatchStatuses[i]);
+
+		for (const uint32_t directoryId : { queuedEvent.DirectoryId, queuedEvent.OldDirectoryId })
+		{
+			// The events of a batch mostly share few directories, so consecutive duplicates are skipped right away and the rest once sorted
+			if (directoryId >= FileWatcherEvent::s_ResolvedPath || (!m_DeliveryDirectories.empty() && m_DeliveryDirectories.back().DirectoryId == directoryId))
+				continue;
+
+			const FileWatcherStringView directory{ GetDirectoryPath(directoryId) };
+			m_DeliveryDirectories.push_back(DeliveryDirectory{ .DirectoryId{ directoryId }, .PathOffset{ static_cast<uint32_t>(m_DeliveryNames.size()) }, .PathLength{ static_cast<uint32_t>(directory.size()) } });
+			m_DeliveryNames.append(directory);
+		}
+	}
+
+	const auto isLess{ [](const DeliveryDirectory& left, const DeliveryDirectory& right) noexcept { return left.DirectoryId < right.DirectoryId; } };
+	const auto isEqual{ [](const DeliveryDirectory& left, const DeliveryDirectory& right) noexcept { return left.DirectoryId == right.DirectoryId; } };
+	std::sort(m_DeliveryDirectories.begin(), m_DeliveryDirectories.end(), isLess);
+	m_DeliveryDirectories.erase(std::unique(m_DeliveryDirectories.begin(), m_DeliveryDirectories.end(), isEqual), m_DeliveryDirectories.end());
+
+	m_QueuedEvents.clear();
+	m_BatchNames.clear();
+	m_BatchStatuses.clear();
+}
+
+void FileWatcher::DeliverEvents() noexcept
+{
+	if (m_DeliveryEvents.empty())
+		return;
+
+	const FileWatcher* const previousWatcher{ s_DeliveringWatcher };
+	s_DeliveringWatcher = this;
+
+	const FileWatcherStringView names{ m_DeliveryNames };
+	m_BatchEvents.clear();
+	m_BatchEvents.reserve(m_DeliveryEvents.size());
+
+	for (size_t i{ 0U }; i < m_DeliveryEvents.size(); ++i)
+	{
+		const QueuedEvent& deliveryEvent{ m_DeliveryEvents[i] };
+		m_BatchEvents.push_back(FileWatcherEvent
+		{
+			.Action{ deliveryEvent.Action },
+			.DirectoryId{ deliveryEvent.DirectoryId },
+			.Name{ names.substr(deliveryEvent.NameOffset, deliveryEvent.NameLength) },
+			.OldDirectoryId{ deliveryEvent.OldDirectoryId },
+			.OldName{ names.substr(deliveryEvent.OldNameOffset, deliveryEvent.OldNameLength) },
+			.Error{ deliveryEvent.Error },
+			.IsDirectory{ deliveryEvent.IsDirectory },
+			.Status{ m_DeliveryStatuses[i].Type != std::filesystem::file_type::none ? &m_DeliveryStatuses[i] : nullptr },
+		});
+	}
+
+	m_Callbacks.fetch_add(1U, std::memory_order_relaxed);
+	{
+		const FileWatcherScopedTimer timer(m_CallbackDurations[0U]);
+		m_Callback(*this, std::span<const FileWatcherEvent>(m_BatchEvents));
+	}
+
+	s_DeliveringWatcher = previousWatcher;
+	m_DeliveryEvents.clear();
+	m_BatchEvents.clear();
+	m_DeliveryNames.clear();
+	m_DeliveryStatuses.clear();
+	m_DeliveryDirectories.clear();
+}
+
+void FileWatcher::StartDelivery() noexcept
+{
+	if (m_Options.MaxFingerprints > 0U)
+		m_Fingerprints = std::make_unique<FileWatcherFingerprintCache>(m_Options.MaxFingerprints, m_Options.MaxHashedBytesPerSecond);
+
+	// A single thread gains nothing from more lanes. Several threads share more lanes than there are threads, so a busy path holds back few others.
+	// Files are only hashed by the delivery threads, never by the reading thread.
+	const bool isQueued{ m_Options.DeliveryQueueCapacity > 0U || m_Fingerprints };
+	const size_t queueCapacity{ m_Options.DeliveryQueueCapacity > 0U ? m_Options.DeliveryQueueCapacity : s_FingerprintQueueCapacity };
+	const uint32_t deliveryThreads{ m_Options.Executor ? 0U : std::max(m_Options.DeliveryThreads, 1U) };
+	const uint32_t poolSize{ m_Options.Executor ? std::max(std::thread::hardware_concurrency(), 1U) : deliveryThreads };
+	const size_t laneCount{ !isQueued ? 0U : m_Options.DeliveryLanes > 0U ? m_Options.DeliveryLanes : poolSize == 1U && !m_Options.Executor ? 1U : 4U * poolSize };
+
+	// The reading thread's recorder is kept even when it never invokes the callback
+	m_CallbackDurationCount = laneCount + 1U;
+	m_CallbackDurations = std::make_unique<FileWatcherHistogramRecorder[]>(m_CallbackDurationCount);
+
+	if (!isQueued)
+		return;
+
+	m_DeliveryLanes = std::make_unique<FileWatcherDeliveryLanes>(laneCount, queueCapacity);
+	for (uint32_t i{ 0U }; i < deliveryThreads; ++i)
+		m_DeliveryThreads.emplace_back(&FileWatcher::DeliveryThreadWork, this);
+}
+
+void FileWatcher::StopDelivery() noexcept
+{
+	if (!m_DeliveryLanes)
+		return;
+
+	// Also releases the reading thread if it waits for room, the lanes themselves stay until it's stopped reading.
+	m_DeliveryLanes->Close();
+
+	for (std::thread& deliveryThread : m_DeliveryThreads)
+		if (deliveryThread.joinable())
+			deliveryThread.join();
+
+	m_DeliveryThreads.clear();
+
+	// Tasks handed to the executor still refer to the watcher
+	m_DeliveryLanes->WaitForTasks();
+}
+
+void FileWatcher::Wait() const noexcept
+{
+	std::unique_lock lock(m_WaitMutex);
+	m_StoppedWatching.wait(lock, [this]() noexcept { return !m_IsWatching; });
+}
+
+bool FileWatcher::WaitFor(const std::chrono::milliseconds timeout) const noexcept
+{
+	std::unique_lock lock(m_WaitMutex);
+	return m_StoppedWatching.wait_for(lock, timeout, [this]() noexcept { return !m_IsWatching; });
+}
+
+void FileWatcher::SetIsWatching(const bool isWatching) noexcept
+{
+	// Changed under the lock, so a waiter can't check the flag before the change and miss the notification
+	{
+		std::scoped_lock lock(m_WaitMutex);
+		m_IsWatching = isWatching;
+	}
+
+	m_StoppedWatching.notify_all();
+}
+
+void FileWatcher::CompileFilter() noexcept
+{
+	if (m_Options.ExcludePatterns.empty() && m_Options.IncludePatterns.empty())
+		return;
+
+	m_Filter = std::make_unique<FileWatcherFilter>(m_Options);
+	if (m_Filter->IsEmpty())
+		m_Filter.reset();
+}
+
+bool FileWatcher::IsSubscribed(const EFileAction action) const noexcept
+{
+	EFileWatcherEventMask eventMask{ EFileWatcherEventMask::None };
+	switch (action)
+	{
+		case EFileAction::Created:			eventMask = EFileWatcherEventMask::Created; break;
+		case EFileAction::Deleted:			eventMask = EFileWatcherEventMask::Deleted; break;
+		case EFileAction::Modified:			eventMask = EFileWatcherEventMask::Modified; break;
+		case EFileAction::Renamed:			eventMask = EFileWatcherEventMask::Renamed; break;
+		case EFileAction::CloseWrite:		eventMask = EFileWatcherEventMask::CloseWrite; break;
+		case EFileAction::AttributeChanged:	eventMask = EFileWatcherEventMask::AttributeChanged; break;
+		case EFileAction::Opened:			eventMask = EFileWatcherEventMask::Opened; break;
+		case EFileAction::Accessed:			eventMask = EFileWatcherEventMask::Accessed; break;
+
+		case EFileAction::Error:
+		case EFileAction::Overflow:
+		case EFileAction::Ready:
+			return true;
+	}
+
+	return (m_Options.EventMask & eventMask) != EFileWatcherEventMask::None;
+}
+
+bool FileWatcher::IsReported(const uint32_t directoryId, const FileWatcherStringView name, const bool isDirectory) noexcept
+{
+	// The full path is matched as a path relative to the observed directory
+	if (directoryId == FileWatcherEvent::s_ResolvedPath)
+	{
+		FileWatcherStringView relativePath{ name };
+		relativePath.remove_prefix(std::min(relativePath.size(), m_ObservedPath.native().size()));
+		while (!relativePath.empty() && (relativePath.front() == '/' || relativePath.front() == std::filesystem::path::preferred_separator))
+			relativePath.remove_prefix(1U);
+
+		return m_Filter->IsReported({}, relativePath, isDirectory, m_FilterBuffer);
+	}
+
+	// Targets are matched by their name alone
+	FileWatcherStringView directory{ GetDirectoryPath(directoryId) };
+	directory.remove_prefix(m_ObservedPath.empty() ? directory.size() : std::min(directory.size(), m_ObservedPath.native().size()));
+
+	return m_Filter->IsReported(directory, name, isDirectory, m_FilterBuffer);
+}
+
+bool FileWatcher::IsExcludedDirectory(FileWatcherStringView path) const noexcept
+{
+	if (!m_Filter)
+		return false;
+
+	path.remove_prefix(std::min(path.size(), m_ObservedPath.native().size()));
+	while (!path.empty() && (path.front() == '/' || path.front() == std::filesystem::path::preferred_separator))
+		path.remove_prefix(1U);
+
+	return m_Filter->IsExcluded(path, true);
+}
+
+void FileWatcher::EnqueueEvent(const QueuedEvent& queuedEvent, const FileWatcherStringView names, const FileWatcherFileStatus& status) noexcept
+{
+	// Events of a path always go through the same lane, a rename through the lane of it's new path
+	const bool isHashed{ m_DeliveryLanes->GetLaneCount() > 1U };
+	size_t laneIndex{ 0U };
+	if (isHashed)
+	{
+		ResolvePath(queuedEvent.DirectoryId, names.substr(queuedEvent.NameOffset, queuedEvent.NameLength), m_LaneBuffer);
+		laneIndex = m_DeliveryLanes->SelectLane(m_LaneBuffer);
+	}
+
+	const auto fill{ [this, &queuedEvent, names, &status, isHashed](FileWatcherQueuedRecord& record) noexcept
+	{
+		record.Action = queuedEvent.Action;
+		record.HasPath = queuedEvent.DirectoryId != FileWatcherEvent::s_NoDirectory;
+		record.HasOldPath = queuedEvent.OldDirectoryId != FileWatcherEvent::s_NoDirectory;
+		record.IsDirectory = queuedEvent.IsDirectory;
+		record.Error = queuedEvent.Error;
+		record.Status = status;
+
+		// The buffers keep their capacity, so resolving doesn't allocate once the records have seen long enough paths.
+		if (isHashed)
+			record.Path.assign(m_LaneBuffer);
+		else
+			ResolvePath(queuedEvent.DirectoryId, names.substr(queuedEvent.NameOffset, queuedEvent.NameLength), record.Path);
+
+		ResolvePath(queuedEvent.OldDirectoryId, names.substr(queuedEvent.OldNameOffset, queuedEvent.OldNameLength), record.OldPath);
+	} };
+
+	FileWatcherDeliveryLane& lane{ (*m_DeliveryLanes)[laneIndex] };
+	FileWatcherEventQueue& queue{ lane.Queue };
+	while (!queue.TryPush(fill))
+	{
+		if (m_Options.QueueFullPolicy == EFileWatcherQueueFullPolicy::Block)
+		{
+			// Closed, nobody is going to take the event anymore
+			if (!queue.WaitToPush())
+				return;
+
+			continue;
+		}
+
+		m_DroppedEvents.fetch_add(1U, std::memory_order_relaxed);
+		if (m_Options.QueueFullPolicy == EFileWatcherQueueFullPolicy::Coalesce)
+		{
+			// The lane delivers the overflow once it's past the events queued before the first discarded one.
+			// Scheduling covers the lane being drained and released meanwhile.
+			size_t overflowPosition{ FileWatcherDeliveryLane::s_NoOverflow };
+			(void)lane.OverflowPosition.compare_exchange_strong(overflowPosition, queue.GetPushPosition(), std::memory_order_seq_cst);
+			ScheduleLane(laneIndex);
+			return;
+		}
+
+		// Makes room by discarding the oldest event, unless a delivery thread took it meanwhile
+		(void)queue.TryPop([](FileWatcherQueuedRecord&) noexcept {});
+	}
+
+	ScheduleLane(laneIndex);
+
+	const size_t depth{ queue.GetSize() };
+	size_t highWaterMark{ m_QueueHighWaterMark.load(std::memory_order_relaxed) };
+	while (depth > highWaterMark && !m_QueueHighWaterMark.compare_exchange_weak(highWaterMark, depth, std::memory_order_relaxed));
+}
+
+void FileWatcher::ScheduleLane(const size_t laneIndex) noexcept
+{
+	if (m_DeliveryLanes->TrySchedule(laneIndex))
+		RunLane(laneIndex);
+}
+
+void FileWatcher::RunLane(const size_t laneIndex) noexcept
+{
+	if (!m_Options.Executor)
+	{
+		m_DeliveryLanes->PushReady(laneIndex);
+		return;
+	}
+
+	if (m_DeliveryLanes->BeginTask())
+	{
+		m_Options.Executor([this, laneIndex]() noexcept
+		{
+			DrainLane(laneIndex);
+			m_DeliveryLanes->EndTask();
+		});
+	}
+}
+
+void FileWatcher::DeliveryThreadWork() noexcept
+{
+	while (const std::optional<size_t> laneIndex{ m_DeliveryLanes->WaitForReady() })
+		DrainLane(*laneIndex);
+}
+
+void FileWatcher::DrainLane(const size_t laneIndex) noexcept
+{
+	FileWatcherDeliveryLane& lane{ (*m_DeliveryLanes)[laneIndex] };
+	std::vector<FileWatcherQueuedRecord>& records{ lane.Records };
+	std::vector<FileWatcherEvent>& events{ lane.Events };
+
+	// Swapping hands the slot the buffers of a record delivered earlier, so neither side reallocates.
+	size_t recordCount{ 0U };
+	while (recordCount < s_DeliveryBatchSize && lane.Queue.TryPop([&records, &recordCount](FileWatcherQueuedRecord& record) noexcept
+	{
+		if (recordCount == records.size())
+			records.emplace_back();
+
+		std::swap(records[recordCount++], record);
+	}));
+
+	// Only this thread clears the position, so it's still pending after the check
+	const size_t overflowPosition{ lane.OverflowPosition.load(std::memory_order_acquire) };
+	const bool isOverflowPending{ overflowPosition != FileWatcherDeliveryLane::s_NoOverflow && lane.Queue.GetPopPosition() >= overflowPosition };
+	if (isOverflowPending)
+		lane.OverflowPosition.store(FileWatcherDeliveryLane::s_NoOverflow, std::memory_order_release);
+
+	events.clear();
+	for (size_t i{ 0U }; i < recordCount; ++i)
+	{
+		// The delivery threads share hashing the files
+		const FileWatcherQueuedRecord& record{ records[i] };
+		if (m_Fingerprints && record.HasPath && IsUnchangedContent(record.Action, record.Path, record.OldPath, record.IsDirectory))
+		{
+			// Saved through a temporary file without changing the content, which leaves nothing changed but the temporary file gone
+			if (record.Action == EFileAction::Renamed && record.HasOldPath && IsSubscribed(EFileAction::Deleted))
+			{
+				events.push_back(FileWatcherEvent
+				{
+					.Action{ EFileAction::Deleted },
+					.DirectoryId{ FileWatcherEvent::s_ResolvedPath },
+					.Name{ record.OldPath },
+					.OldDirectoryId{ FileWatcherEvent::s_NoDirectory },
+					.OldName{},
+					.Error{},
+					.IsDirectory{ false },
+					.Status{ nullptr },
+				});
+			}
+
+			continue;
+		}
+
+		events.push_back(FileWatcherEvent
+		{
+			.Action{ record.Action },
+			.DirectoryId{ record.HasPath ? FileWatcherEvent::s_ResolvedPath : FileWatcherEvent::s_NoDirectory },
+			.Name{ record.Path },
+			.OldDirectoryId{ record.HasOldPath ? FileWatcherEvent::s_ResolvedPath : FileWatcherEvent::s_NoDirectory },
+			.OldName{ record.OldPath },
+			.Error{ record.Error },
+			.IsDirectory{ record.IsDirectory },
+			.Status{ record.Status.Type != std::filesystem::file_type::none ? &record.Status : nullptr },
+		});
+	}
+
+	// The discarded events came after the ones taken so far, and the ones queued before them were taken by now
+	if (isOverflowPending)
+	{
+		events.push_back(FileWatcherEvent
+		{
+			.Action{ EFileAction::Overflow },
+			.DirectoryId{ FileWatcherEvent::s_NoDirectory },
+			.Name{},
+			.OldDirectoryId{ FileWatcherEvent::s_NoDirectory },
+			.OldName{},
+			.Error{ std::error_code(static_cast<int>(EFileWatcherError::EventQueueOverflow), FileWatcherCategory()) },
+			.IsDirectory{ false },
+			.Status{ nullptr },
+		});
+	}
+
+	// Events still queued once closed are discarded
+	if (!events.empty() && !m_DeliveryLanes->IsClosed())
+	{
+		m_Callbacks.fetch_add(1U, std::memory_order_relaxed);
+		const FileWatcherScopedTimer timer(m_CallbackDurations[laneIndex + 1U]);
+		m_Callback(*this, std::span<const FileWatcherEvent>(events));
+	}
+
+	// A lane with events left goes behind the lanes already waiting, so a busy path doesn't hold back the others
+	if (m_DeliveryLanes->Release(laneIndex))
+		RunLane(laneIndex);
+}
+
+bool FileWatcher::IsUnchangedContent(const EFileAction action, const FileWatcherPathBuffer& path, const FileWatcherPathBuffer& oldPath, const bool isDirectory) noexcept
+{
+	// Neither leaves the content changed, nor does closing the file once it's modifications were compared
+	if (action == EFileAction::AttributeChanged || action == EFileAction::Opened || action == EFileAction::Accessed || (action == EFileAction::CloseWrite && IsSubscribed(EFileAction::Modified)))
+		return false;
+
+	// The fingerprint of the file renamed away is stale, the one it replaced is compared like a modification of it
+	if (action == EFileAction::Renamed)
+		m_Fingerprints->Forget(oldPath);
+
+	const bool isReplaced{ action == EFileAction::Renamed && !isDirectory && m_Fingerprints->Contains(path) };
+	if (action != EFileAction::Modified && action != EFileAction::CloseWrite && !isReplaced)
+	{
+		m_Fingerprints->Forget(path);
+		return false;
+	}
+
+	FileWatcherFingerprint fingerprint{};
+	if (!ReadFingerprint(path, fingerprint))
+	{
+		m_Fingerprints->Forget(path);
+		return false;
+	}
+
+	if (m_Fingerprints->Exchange(path, fingerprint) != fingerprint)
+		return false;
+
+	m_UnchangedModifications.fetch_add(1U, std::memory_order_relaxed);
+	return true;
+}
+
+std::filesystem::path FileWatcher::ResolvePath(const uint32_t directoryId, const FileWatcherStringView name) const noexcept
+{
+	if (directoryId == FileWatcherEvent::s_NoDirectory)
+		return std::filesystem::path{};
+
+	if (directoryId == FileWatcherEvent::s_ResolvedPath)
+		return std::filesystem::path(name);
+
+	return std::filesystem::path(GetEventDirectoryPath(directoryId)) / name;
+}
+
+FileWatcherStringView FileWatcher::ResolvePath(const uint32_t directoryId, const FileWatcherStringView name, FileWatcherPathBuffer& buffer) const noexcept
+{
+	buffer.clear();
+	if (directoryId == FileWatcherEvent::s_NoDirectory)
+		return FileWatcherStringView{};
+
+	if (directoryId == FileWatcherEvent::s_ResolvedPath)
+	{
+		buffer.append(name);
+		return buffer;
+	}
+
+	buffer.append(GetEventDirectoryPath(directoryId));
+	if (!name.empty())
+	{
+		// Same as appending with std::filesystem::path::operator/, minus parsing the components
+		if (!buffer.empty() && buffer.back() != std::filesystem::path::preferred_separator && buffer.back() != '/')
+			buffer.push_back(std::filesystem::path::preferred_separator);
+
+		buffer.append(name);
+	}
+
+	return buffer;
+}
+
+FileWatcherStringView FileWatcher::GetEventDirectoryPath(const uint32_t directoryId) const noexcept
+{
+	if (s_DeliveringWatcher != this)
+		return GetDirectoryPath(directoryId);
+
+	const auto directory{ std::lower_bound(m_DeliveryDirectories.begin(), m_DeliveryDirectories.end(), directoryId, [](const DeliveryDirectory& left, const uint32_t right) noexcept { return left.DirectoryId < right; }) };
+	if (directory == m_DeliveryDirectories.end() || directory->DirectoryId != directoryId)
+		return GetDirectoryPath(directoryId);
+
+	return FileWatcherStringView(m_DeliveryNames).substr(directory->PathOffset, directory->PathLength);
+}
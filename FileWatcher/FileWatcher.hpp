@@ -1,12 +1,34 @@
 #pragma once
 #include <filesystem>
+#include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <memory>
 #include <functional>
 #include <optional>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <span>
+#include <string_view>
+#include <array>
+#include <algorithm>
+#include <bit>
+#include <cmath>
 #include <assert.h>
 #include <system_error>
 
+// Defined as 0 to compile the read counters, histograms and callback timing out. Their statistics are then left at zero.
+#ifndef FILEWATCHER_METRICS
+#define FILEWATCHER_METRICS 1
+#endif
+
+// Defined as 0 to always wait for events with epoll on Linux. Otherwise io_uring is used where the kernel allows it, and epoll where it doesn't.
+#ifndef FILEWATCHER_IO_URING
+#define FILEWATCHER_IO_URING 1
+#endif
+
 enum class EFileWatcherError
 {
 	Unknown = 0,
@@ -16,6 +38,12 @@ enum class EFileWatcherError
 	InternalStateCreationFailed,
 	WatchedDirectoryWasDeleted,
 	FailedWatchingSubdirectory,	
+	EventQueueOverflow,
+	BackendNotSupported,
+	TargetsNotSupported,
+	TargetNotWatched,
+	SnapshotNotSupported,
+	InvalidSnapshot,
 };
 
 class FileWatcherErrorCategory final : public std::error_category
@@ -42,6 +70,12 @@ public:
 			case EFileWatcherError::InternalStateCreationFailed: 		return "Internal state creation failed";
 			case EFileWatcherError::WatchedDirectoryWasDeleted:			return "Watched directory was deleted, moved or unmounted. If the specified target was a regular file, the parent directory is invalid";
 			case EFileWatcherError::FailedWatchingSubdirectory:			return "Failed to watch a subdirectory";
+			case EFileWatcherError::EventQueueOverflow:					return "Event queue overflowed, some events were lost";
+			case EFileWatcherError::BackendNotSupported:				return "Selected backend isn't supported on this platform";
+			case EFileWatcherError::TargetsNotSupported:				return "Targets can only be added to a watcher constructed without an observed path, using the default backend on Linux";
+			case EFileWatcherError::TargetNotWatched:					return "Specified target isn't watched";
+			case EFileWatcherError::SnapshotNotSupported:				return "Snapshots are only kept of an observed directory, using the default backend on Linux";
+			case EFileWatcherError::InvalidSnapshot:					return "Snapshot file is invalid or was written by another version, changes made since it was written aren't reported";
 			[[unlikely]] default: 
 				assert(false); 
 				break;
@@ -67,6 +101,13 @@ enum class EFileAction
 	Deleted,
 	Modified,
 	Renamed,
+	Overflow,
+	Ready,
+	CloseWrite,			// A file opened for writing was closed. Linux only.
+	AttributeChanged,	// Permissions, ownership, timestamps or extended attributes changed.
+	Opened,				// Linux only. Like Accessed, not reported for the watcher's own accesses.
+	Accessed,			// Read from, as is a directory when listed. Not reported when the watcher lists a directory or fingerprints a file itself,
+						// nor when another process accesses the entry meanwhile, as the kernel doesn't tell them apart.
 };
 
 /**
@@ -82,6 +123,12 @@ constexpr const char* FileActionToString(const EFileAction fileAction) noexcept
 		case EFileAction::Deleted:		return "Deleted";
 		case EFileAction::Modified:		return "Modified";
 		case EFileAction::Renamed:		return "Renamed";
+		case EFileAction::Overflow:		return "Overflow";
+		case EFileAction::Ready:		return "Ready";
+		case EFileAction::CloseWrite:	return "CloseWrite";
+		case EFileAction::AttributeChanged:	return "AttributeChanged";
+		case EFileAction::Opened:		return "Opened";
+		case EFileAction::Accessed:		return "Accessed";
 
 		[[unlikely]]
 		default:
@@ -94,16 +141,289 @@ constexpr const char* FileActionToString(const EFileAction fileAction) noexcept
 }
 
 /**
- * @param Full path to file (new value if renamed).
- * @param Full path to file if it was renamed (old value), else is left out.
- * @param Type of file action that had occurred. EFileAction::Error is returned if an error had occurred.
+ * Invoked the same way as FileWatcherBatchCallback.
+ * @param Full path to file (old value if renamed).
+ * @param Full path to file if it was renamed (new value), else is left out.
+ * @param Type of file action that had occurred. EFileAction::Error is returned if an error had occurred, EFileAction::Overflow if events were lost,
+ * EFileAction::Ready once an asynchronous setup watches the whole tree.
  * @param Nonzero populated error code if an error had occurred.
  */
 using FileWatcherCallback = std::function<void(std::filesystem::path, std::optional<std::filesystem::path>, EFileAction, std::error_code)>;
 
+using FileWatcherStringView = std::basic_string_view<std::filesystem::path::value_type>;
+using FileWatcherPathBuffer = std::basic_string<std::filesystem::path::value_type>;
+
+/**
+ * Metadata of the entry an event concerns, looked up once the event was read. See FileWatcherOptions::CollectFileStatus.
+ */
+struct FileWatcherFileStatus
+{
+	std::filesystem::file_type Type{ std::filesystem::file_type::none };	// not_found if the entry was gone by then, unknown if it couldn't be looked up.
+	uint64_t Size{ 0U };
+	int64_t ModificationTime{ 0 };	// nanoseconds since epoch
+	uint64_t Inode{ 0U };			// zero on Windows.
+};
+
+/**
+ * Compact event record delivered to the batch callback.
+ * The names point into a buffer owned by the watcher and are only valid for the duration of the callback.
+ */
+struct FileWatcherEvent
+{
+	constexpr static inline uint32_t s_NoDirectory{ UINT32_MAX };
+	constexpr static inline uint32_t s_ResolvedPath{ UINT32_MAX - 1U };	// The name already is the full path, as with events delivered through the delivery queue.
+
+	EFileAction Action;
+	uint32_t DirectoryId;			// Parent directory of the file, s_NoDirectory for errors not concerning a file. See FileWatcher::ResolvePath.
+	FileWatcherStringView Name;		// Name relative to the parent directory (new value if renamed).
+	uint32_t OldDirectoryId;		// Parent directory before the rename, s_NoDirectory otherwise.
+	FileWatcherStringView OldName;	// Name relative to the parent directory before the rename, empty otherwise.
+	std::error_code Error;			// Nonzero populated error code if an error had occurred.
+	bool IsDirectory;				// The entry is a directory. On Windows only known for entries whose status was collected.
+	const FileWatcherFileStatus* Status;	// Metadata of the entry, null unless collecting it. Valid as long as the names are.
+};
+
+class FileWatcher;
+
+/**
+ * Invoked on the thread reading the events unless they're delivered through the queue, see FileWatcherOptions::DeliveryQueueCapacity.
+ * On Linux that thread reads the events of every watcher of the process, so a slow callback holds back the events of the others,
+ * and one waiting for them never returns. Creating and destroying watchers isn't held back, as no lock is held while it runs.
+ * @param The watcher delivering the events, used to resolve their paths.
+ * @param Events read during a single wakeup, in the order they occurred.
+ */
+using FileWatcherBatchCallback = std::function<void(const FileWatcher&, std::span<const FileWatcherEvent>)>;
+
+/**
+ * Runs a task on some other thread, such as by handing it to the application's thread pool. See FileWatcherOptions::Executor.
+ * Called by the thread reading the events as well as by the tasks, so it must be safe to call concurrently.
+ * Every task has to run eventually, as the watcher waits for the tasks it handed out before it's destroyed.
+ */
+using FileWatcherExecutor = std::function<void(std::function<void()>)>;
+
+/**
+ * Kernel interface the watcher is built on.
+ */
+enum class EFileWatcherBackend
+{
+	Default,	// inotify on Linux, ReadDirectoryChangesW on Windows.
+	Fanotify,	// Linux only. A single filesystem wide mark filtered to the observed tree, instead of a watch per directory.
+};
+
+/**
+ * Kinds of events a watcher reports, combined into FileWatcherOptions::EventMask. Errors, overflows and EFileAction::Ready are always reported.
+ */
+enum class EFileWatcherEventMask : uint32_t
+{
+	None				= 0U,
+	Created				= 1U << 0U,
+	Deleted				= 1U << 1U,
+	Modified			= 1U << 2U,
+	Renamed				= 1U << 3U,
+	CloseWrite			= 1U << 4U,
+	AttributeChanged	= 1U << 5U,
+	Opened				= 1U << 6U,
+	Accessed			= 1U << 7U,
+	Default				= Created | Deleted | Modified | Renamed,
+	All					= Default | CloseWrite | AttributeChanged | Opened | Accessed,
+};
+
+[[nodiscard]] constexpr EFileWatcherEventMask operator|(const EFileWatcherEventMask first, const EFileWatcherEventMask second) noexcept
+{
+	return static_cast<EFileWatcherEventMask>(static_cast<uint32_t>(first) | static_cast<uint32_t>(second));
+}
+
+[[nodiscard]] constexpr EFileWatcherEventMask operator&(const EFileWatcherEventMask first, const EFileWatcherEventMask second) noexcept
+{
+	return static_cast<EFileWatcherEventMask>(static_cast<uint32_t>(first) & static_cast<uint32_t>(second));
+}
+
+/**
+ * What happens to an event that doesn't fit into the full delivery queue.
+ */
+enum class EFileWatcherQueueFullPolicy
+{
+	Block,		// Reading waits for the delivery threads. On Linux one thread reads the events of every watcher of the process,
+				// so a single full queue holds back the events of all of them, and the shared kernel queue may overflow instead.
+	DropOldest,	// The oldest queued event is discarded.
+	Coalesce,	// Events that don't fit are discarded and merged into a single EFileAction::Overflow event, delivered after the events queued before them.
+};
+
+/**
+ * File watcher configuration. Default constructed options match the behaviour of the basic constructors.
+ */
+struct FileWatcherOptions
+{
+	// If true, returns target concatenated directory to absolute path.
+	bool ReturnAbsolutePath{ false };
+	// Linux only. How long a move out of a directory waits for it's pair before it's reported as deleted (or the move in as created).
+	std::chrono::milliseconds RenamePairingTimeout{ 5 };
+	// Initial size of the event buffer in bytes.
+	size_t WatchBufferSize{ 8192U };
+	// Linux only. The event buffer grows up to this size while the event queue is backed up.
+	size_t MaxWatchBufferSize{ 1U << 20U };
+	// Linux inotify backend only. Keeps a snapshot of the tree, which is rescanned in the background after the event queue overflows
+	// to report the lost changes as Created, Deleted and Modified events.
+	bool RescanOnOverflow{ false };
+	// Created, Deleted and Modified events of the same file within this period are merged into their net effect,
+	// which is delivered once the period since the first of them has passed. Zero delivers every event as it's read.
+	std::chrono::milliseconds CoalescingPeriod{ 0 };
+	// The constructor returns once the observed directory itself is watched, the rest of the tree is registered in the background.
+	// Events of the directories registered so far are delivered meanwhile, EFileAction::Ready is delivered once the whole tree is watched.
+	bool AsynchronousSetup{ false };
+	// Linux only. Most threads registering the initial tree, zero uses one per hardware thread. Small trees only use a single one.
+	uint32_t CrawlerThreads{ 0U };
+	// The fanotify backend costs the same no matter how many directories the tree has, as nothing is registered per directory.
+	// It requires CAP_SYS_ADMIN and CAP_DAC_READ_SEARCH, paths are resolved when the events are read rather than when they occurred.
+	EFileWatcherBackend Backend{ EFileWatcherBackend::Default };
+	// Events are handed to delivery threads through lock-free queues holding this many events between them (rounded up to a power of two per lane),
+	// so a slow callback doesn't hold back reading them. Zero invokes the callback on the thread reading the events, on Linux shared by every watcher,
+	// unless fingerprinting, see MaxFingerprints.
+	// The events delivered through the queue carry their full path as the name, with FileWatcherEvent::s_ResolvedPath as the directory.
+	size_t DeliveryQueueCapacity{ 0U };
+	// Threads invoking the callback with the queued events. With more than one, the callback is invoked concurrently,
+	// though the events of a path are still delivered in order.
+	uint32_t DeliveryThreads{ 1U };
+	// The queue is split into lanes the events are hashed to by path, every lane is delivered by one thread at a time.
+	// A rename goes to the lane of it's new path, so the events following it stay behind it. Zero uses a single lane
+	// for a single delivery thread, and four lanes per delivery thread (or hardware thread, with an executor) otherwise.
+	uint32_t DeliveryLanes{ 0U };
+	// If set, the lanes are delivered by tasks handed to this executor rather than by the watcher's own DeliveryThreads.
+	FileWatcherExecutor Executor{};
+	// Blocking loses nothing but lets a slow callback stall every other watcher on Linux, see EFileWatcherQueueFullPolicy::Block.
+	EFileWatcherQueueFullPolicy QueueFullPolicy{ EFileWatcherQueueFullPolicy::Block };
+	// Glob patterns of entries that aren't reported, matched against the path relative to the observed directory.
+	// '*' and '?' don't match separators, '**' does. A pattern without a separator matches the name of the entry or of any directory
+	// above it, so "node_modules" or "*.o" leave out every such entry. A pattern ending in a separator, such as "build/", only matches directories,
+	// and so only leaves out the directory and everything in it. Excluded directories aren't watched at all.
+	std::vector<FileWatcherPathBuffer> ExcludePatterns{};
+	// If not empty, only entries matching one of these patterns are reported. A pattern without a separator matches the entry's own name,
+	// one ending in a separator only matches directories.
+	// Directories are watched regardless, so entries matching the patterns are reported from anywhere in the tree.
+	std::vector<FileWatcherPathBuffer> IncludePatterns{};
+	// Modified events are only reported if the content of the file changed, judged by it's size and a hash of it's content
+	// compared to those at the previous modification. Fingerprints are kept for up to this many files, the least recently modified
+	// are forgotten. A modification of a file without a fingerprint is always reported. Zero reports every modification.
+	// The modifications of a file are held back and merged until it's closed, so the content is compared once it's written. On Windows, and while
+	// the file is kept open, they're held back for 100 ms at most, or for the CoalescingPeriod if coalescing.
+	// Without subscribing to Modified events, CloseWrite events are compared instead.
+	// Renaming a file over a fingerprinted one, as editors save atomically through a temporary file, is compared the same way. If the content is the same,
+	// it's reported as the temporary file being Deleted rather than Renamed.
+	// The files are hashed by the delivery threads, as hashing on the thread reading the events would hold back every other watcher of the process on Linux.
+	// Without a DeliveryQueueCapacity the events are queued for a single delivery thread all the same, so they carry their full path as the name.
+	size_t MaxFingerprints{ 0U };
+	// Most bytes hashed per second while fingerprinting, modifications beyond that are reported without comparing. Zero doesn't limit hashing.
+	uint64_t MaxHashedBytesPerSecond{ 64U << 20U };
+	// Linux inotify backend only. If not empty, a snapshot of the observed directory's tree is written to this path when the watcher
+	// is destroyed and whenever SaveSnapshot is called. A watcher started with an existing snapshot diffs the tree against it by another thread once the tree is watched,
+	// and reports the changes made in between as Created, Deleted, Modified and Renamed events, which may follow EFileAction::Ready. The snapshot is then saved by
+	// the same thread, and kept up to date from the events, so saving again only lists the directories changed since. A watcher destroyed before catching up leaves
+	// the previous snapshot in place, and the changes are reported by the next one.
+	// The events carry their full path as the name, with FileWatcherEvent::s_ResolvedPath as the directory.
+	std::filesystem::path SnapshotPath{};
+	// Events of an entry carry it's metadata, so the callback doesn't have to look it up by path. The entries of a batch are looked up at once before
+	// it's delivered, on Linux by name relative to cached descriptors of their directories. Deleted entries aren't looked up, they're reported as not found.
+	bool CollectFileStatus{ false };
+	// Kinds of events reported. Only the kernel events they need are requested, beyond those tracking the tree itself. A watch shared with another watcher
+	// of the same directory requests the events of both, each watcher only reports it's own. A rename not subscribed to is reported as the deletion and
+	// creation it amounts to, if those are. On Windows, attribute changes and accesses are reported as modifications while those are subscribed to.
+	EFileWatcherEventMask EventMask{ EFileWatcherEventMask::Default };
+};
+
+/**
+ * Distribution of a measured value in power of two buckets. Bucket i counts the values of i significant bits,
+ * that is from 2^(i-1) up to 2^i - 1, with zero alone in the first bucket and the last bucket taking everything above.
+ */
+struct FileWatcherHistogram
+{
+	std::array<uint64_t, 64U> Buckets{};
+	uint64_t Count{ 0U };
+	uint64_t Sum{ 0U };
+
+	[[nodiscard]] static constexpr size_t GetBucket(const uint64_t value) noexcept
+	{
+		return std::min(static_cast<size_t>(std::bit_width(value)), s_BucketCount - 1U);
+	}
+
+	[[nodiscard]] static constexpr uint64_t GetUpperBound(const size_t bucket) noexcept
+	{
+		return bucket + 1U >= s_BucketCount ? UINT64_MAX : (uint64_t{ 1U } << bucket) - 1U;
+	}
+
+	/**
+	 * Returns the upper bound of the bucket holding the value below which the given fraction of the values lies, so it's
+	 * at most twice the exact percentile.
+	 * @param fraction - Between 0 and 1, such as 0.99 for the 99th percentile.
+	 */
+	[[nodiscard]] uint64_t GetPercentile(const double fraction) const noexcept
+	{
+		// Counted from the buckets, as a snapshot taken while recording may not agree with Count
+		uint64_t total{ 0U };
+		for (const uint64_t bucketCount : Buckets)
+			total += bucketCount;
+
+		if (total == 0U)
+			return 0U;
+
+		const uint64_t rank{ std::clamp(static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(total))), uint64_t{ 1U }, total) };
+		uint64_t seen{ 0U };
+		for (size_t bucket{ 0U }; bucket < s_BucketCount; ++bucket)
+			if ((seen += Buckets[bucket]) >= rank)
+				return GetUpperBound(bucket);
+
+		return UINT64_MAX;
+	}
+
+	[[nodiscard]] double GetMean() const noexcept
+	{
+		return Count > 0U ? static_cast<double>(Sum) / static_cast<double>(Count) : 0.0;
+	}
+
+	void Merge(const FileWatcherHistogram& other) noexcept
+	{
+		for (size_t bucket{ 0U }; bucket < s_BucketCount; ++bucket)
+			Buckets[bucket] += other.Buckets[bucket];
+
+		Count += other.Count;
+		Sum += other.Sum;
+	}
+
+	constexpr static inline size_t s_BucketCount{ 64U };
+};
+
+/**
+ * Snapshot of the watcher's event reading statistics.
+ * On Linux the event queue is shared by all watchers of the process, so the read statistics are process wide.
+ */
+struct FileWatcherStats
+{
+	size_t WatchBufferSize{ 0U };	// Current size of the event buffer in bytes.
+	uint64_t Wakeups{ 0U };			// Times the watcher woke up to read events.
+	uint64_t Reads{ 0U };			// Reads performed, a wakeup keeps reading until the queue is drained.
+	uint64_t ReadBytes{ 0U };		// Total bytes read from the event queue.
+	uint64_t LongestDrain{ 0U };	// Most reads performed during a single wakeup. Not measured on Windows, always zero there.
+	uint64_t BufferGrowths{ 0U };	// Times the event buffer was enlarged.
+	uint64_t Syscalls{ 0U };		// System calls made to wait for and read events. Not measured on Windows, always zero there.
+	bool IsUsingIoUring{ false };	// The events are waited for and read through io_uring rather than epoll.
+	uint64_t Events{ 0U };			// Events read from the event queue.
+	uint64_t Callbacks{ 0U };		// Times this watcher's callback was invoked.
+	uint64_t CoalescedEvents{ 0U };	// Events of this watcher merged into another event by coalescing.
+	size_t QueueDepth{ 0U };		// Events waiting in the delivery queue.
+	size_t QueueHighWaterMark{ 0U };	// Most events that were waiting in a single lane of the delivery queue at once.
+	uint64_t DroppedEvents{ 0U };	// Events discarded as the delivery queue was full.
+	uint64_t UnchangedModifications{ 0U };	// Modified events discarded as the content of the file was the same.
+	size_t WatchedDirectories{ 0U };		// Directories of this watcher holding a watch descriptor, or resolved so far by fanotify.
+	size_t PendingRenames{ 0U };			// Moves out of a directory of this watcher waiting for their pair.
+	size_t PendingRenamesHighWaterMark{ 0U };	// Most moves that were waiting for their pair at once.
+	FileWatcherHistogram BytesPerRead{};	// Bytes returned by every read of the event queue.
+	FileWatcherHistogram EventsPerRead{};	// Events decoded from every read of the event queue.
+	FileWatcherHistogram CallbackNanoseconds{};	// Time spent in every invocation of this watcher's callback.
+};
+
 /**
  * File watcher class. Can be used to monitor either an existing directory recursively or a specific file. 
  * If the file doesn't exist, the watcher will listen for it's creation based on it's path.
+ * Constructed with an empty observed path, the watcher monitors any number of files and directories added by AddTarget instead.
  */
 class FileWatcher
 {
@@ -129,6 +449,42 @@ public:
 	 */
 	explicit FileWatcher(const std::filesystem::path& observedPath, const FileWatcherCallback& callback, const bool returnAbsolutePath, std::error_code& error) noexcept;
 
+	/**
+	 * File Watcher constructor.
+	 * @param observedPath - Path to observed target. Can be either a filepath or directory path.
+	 * @param callback - Callback function.
+	 * @param options - Watcher configuration.
+	 * @param error - error code, populated on failure.
+	 */
+	explicit FileWatcher(const std::filesystem::path& observedPath, FileWatcherCallback&& callback, const FileWatcherOptions& options, std::error_code& error) noexcept;
+
+	/**
+	 * File Watcher constructor.
+	 * @param observedPath - Path to observed target. Can be either a filepath or directory path.
+	 * @param callback - Callback function.
+	 * @param options - Watcher configuration.
+	 * @param error - error code, populated on failure.
+	 */
+	explicit FileWatcher(const std::filesystem::path& observedPath, const FileWatcherCallback& callback, const FileWatcherOptions& options, std::error_code& error) noexcept;
+
+	/**
+	 * File Watcher constructor. The callback receives every event read during a wakeup at once.
+	 * @param observedPath - Path to observed target. Can be either a filepath or directory path.
+	 * @param callback - Batch callback function.
+	 * @param options - Watcher configuration.
+	 * @param error - error code, populated on failure.
+	 */
+	explicit FileWatcher(const std::filesystem::path& observedPath, FileWatcherBatchCallback&& callback, const FileWatcherOptions& options, std::error_code& error) noexcept;
+
+	/**
+	 * File Watcher constructor. The callback receives every event read during a wakeup at once.
+	 * @param observedPath - Path to observed target. Can be either a filepath or directory path.
+	 * @param callback - Batch callback function.
+	 * @param options - Watcher configuration.
+	 * @param error - error code, populated on failure.
+	 */
+	explicit FileWatcher(const std::filesystem::path& observedPath, const FileWatcherBatchCallback& callback, const FileWatcherOptions& options, std::error_code& error) noexcept;
+
 	/**
 	 * File watcher destructor.
 	 */
@@ -138,19 +494,455 @@ public:
 	 * Returns true if the file watcher is actively monitoring the target.
 	 */
 	[[nodiscard]] bool IsWatching() const noexcept;
+
+	/**
+	 * Returns true once the whole tree is watched. Only differs from IsWatching during an asynchronous setup.
+	 */
+	[[nodiscard]] bool IsReady() const noexcept;
+
+	/**
+	 * Blocks until the watcher stops watching, either through Stop or because watching failed, such as when the observed directory is deleted.
+	 */
+	void Wait() const noexcept;
+
+	/**
+	 * Blocks until the watcher stops watching or the timeout passes. Returns true if the watcher stopped.
+	 * @param timeout - Longest time to wait for.
+	 */
+	[[nodiscard]] bool WaitFor(const std::chrono::milliseconds timeout) const noexcept;
+
+	/**
+	 * Stops watching and wakes the threads waiting for it. Nothing is reported afterwards, events still waiting in the delivery queue
+	 * are discarded. Safe to call from any thread, including the callback.
+	 */
+	void Stop() noexcept;
+
+	/**
+	 * Returns a snapshot of the event reading statistics.
+	 */
+	[[nodiscard]] FileWatcherStats GetStats() const noexcept;
+
+	/**
+	 * Starts watching a file or directory, only possible if the watcher was constructed with an empty observed path.
+	 * Targets in the same directory share a single watch, events are matched against them with a single lookup.
+	 * A directory target reports changes of it's entries, but not of it's subdirectories. A file target doesn't have to exist yet.
+	 * Safe to call from any thread, including the callback unless it's invoked by the delivery threads.
+	 * @param target - Path of the file or directory.
+	 * @param error - error code, populated on failure.
+	 */
+	void AddTarget(const std::filesystem::path& target, std::error_code& error) noexcept;
+
+	/**
+	 * Stops watching a target added by AddTarget. The watch of it's directory is removed along with the last target in it.
+	 * @param target - Path the target was added with.
+	 * @param error - error code, populated on failure.
+	 */
+	void RemoveTarget(const std::filesystem::path& target, std::error_code& error) noexcept;
+
+	/**
+	 * Writes the snapshot of the tree to FileWatcherOptions::SnapshotPath, replacing the previous one. Only the directories events were read for
+	 * since the snapshot was last saved are listed, the whole tree after an overflow. Safe to call from any thread.
+	 * @param error - error code, populated on failure.
+	 */
+	void SaveSnapshot(std::error_code& error) const noexcept;
+
+	/**
+	 * Builds the full path of a file reported to the batch callback. Must only be called from within the callback.
+	 * @param directoryId - DirectoryId or OldDirectoryId of the event.
+	 * @param name - Name or OldName of the event.
+	 */
+	[[nodiscard]] std::filesystem::path ResolvePath(const uint32_t directoryId, const FileWatcherStringView name) const noexcept;
+
+	/**
+	 * Builds the full path of a file reported to the batch callback into a caller owned buffer, which doesn't allocate once the buffer is large enough.
+	 * Must only be called from within the callback. Returns a view of the buffer.
+	 * @param directoryId - DirectoryId or OldDirectoryId of the event.
+	 * @param name - Name or OldName of the event.
+	 * @param buffer - Buffer receiving the path, it's previous contents are replaced.
+	 */
+	FileWatcherStringView ResolvePath(const uint32_t directoryId, const FileWatcherStringView name, FileWatcherPathBuffer& buffer) const noexcept;
 private:
-	void SetupWatcher(const bool useAsbolutePath, std::error_code& error) noexcept;
-	void WatcherThreadWork() const noexcept;
+	// Event waiting for the batch to be flushed. Names are kept as offsets, as the name buffer may grow meanwhile.
+	struct QueuedEvent
+	{
+		EFileAction Action;
+		uint32_t DirectoryId;
+		uint32_t NameOffset;
+		uint32_t NameLength;
+		uint32_t OldDirectoryId;
+		uint32_t OldNameOffset;
+		uint32_t OldNameLength;
+		std::error_code Error;
+		bool IsDirectory;
+	};
+
+	// Path of a directory as it was when the batch was collected, kept in the delivered name buffer.
+	struct DeliveryDirectory
+	{
+		uint32_t DirectoryId;
+		uint32_t PathOffset;
+		uint32_t PathLength;
+	};
+
+	// Net effect of the events of a single file during the coalescing period.
+	struct CoalescedEvent
+	{
+		std::optional<EFileAction> Action;	// empty if the events cancelled each other out.
+		std::chrono::steady_clock::time_point Deadline;
+		bool IsDirectory;
+	};
+
+	struct CoalescingKey
+	{
+		uint32_t DirectoryId;
+		FileWatcherPathBuffer Name;
+	};
+
+	struct CoalescingKeyView
+	{
+		uint32_t DirectoryId;
+		FileWatcherStringView Name;
+	};
+
+	// Lets the events be looked up by view, so merging into a pending event doesn't allocate.
+	struct CoalescingKeyHash
+	{
+		using is_transparent = void;
+
+		[[nodiscard]] size_t operator()(const CoalescingKeyView& key) const noexcept { return std::hash<FileWatcherStringView>{}(key.Name) ^ (static_cast<size_t>(key.DirectoryId) * 0x9E3779B97F4A7C15ULL); }
+		[[nodiscard]] size_t operator()(const CoalescingKey& key) const noexcept { return operator()(CoalescingKeyView{ key.DirectoryId, key.Name }); }
+	};
+
+	struct CoalescingKeyEqual
+	{
+		using is_transparent = void;
+
+		[[nodiscard]] bool operator()(const CoalescingKeyView& left, const CoalescingKeyView& right) const noexcept { return left.DirectoryId == right.DirectoryId && left.Name == right.Name; }
+		[[nodiscard]] bool operator()(const CoalescingKey& left, const CoalescingKeyView& right) const noexcept { return operator()(CoalescingKeyView{ left.DirectoryId, left.Name }, right); }
+		[[nodiscard]] bool operator()(const CoalescingKeyView& left, const CoalescingKey& right) const noexcept { return operator()(left, CoalescingKeyView{ right.DirectoryId, right.Name }); }
+		[[nodiscard]] bool operator()(const CoalescingKey& left, const CoalescingKey& right) const noexcept { return operator()(CoalescingKeyView{ left.DirectoryId, left.Name }, CoalescingKeyView{ right.DirectoryId, right.Name }); }
+	};
+
+	using CoalescedEventMap = std::unordered_map<CoalescingKey, CoalescedEvent, CoalescingKeyHash, CoalescingKeyEqual>;
+
+	[[nodiscard]] static FileWatcherBatchCallback AdaptCallback(FileWatcherCallback&& callback) noexcept;
+
+	/**
+	 * Queues an event to be delivered with the batch, or merges it into a pending event of the same file if coalescing.
+	 */
+	void QueueEvent(const EFileAction action, const uint32_t directoryId, const FileWatcherStringView name, const std::error_code& error = {}, const bool isDirectory = false) noexcept;
+	void QueueRename(const uint32_t oldDirectoryId, const FileWatcherStringView oldName, const uint32_t directoryId, const FileWatcherStringView name, const bool isDirectory = false) noexcept;
+	void AppendEvent(const EFileAction action, const uint32_t directoryId, const FileWatcherStringView name, const std::error_code& error, const bool isDirectory) noexcept;
+
+	/**
+	 * Returns true if events of the action are held back and merged with the following ones of the same file.
+	 */
+	[[nodiscard]] bool IsCoalesced(const EFileAction action) const noexcept;
+	void CoalesceEvent(const EFileAction action, const uint32_t directoryId, const FileWatcherStringView name, const bool isDirectory) noexcept;
+
+	/**
+	 * Queues the pending event of the file right away, so it's delivered before whatever happens to the file next.
+	 */
+	void ReleaseCoalescedEvent(const uint32_t directoryId, const FileWatcherStringView name) noexcept;
+
+	/**
+	 * Queues the coalesced events whose period has passed. Returns the deadline of the next pending event, if any.
+	 */
+	std::optional<std::chrono::steady_clock::time_point> ExpireCoalescedEvents(const std::chrono::steady_clock::time_point now) noexcept;
+
+	/**
+	 * Delivers the queued events to the callback in a single call, or hands them to the delivery threads.
+	 */
+	void FlushEvents() noexcept;
+
+	/**
+	 * Moves the queued events into the batch delivered next along with the paths of their directories, or hands them to the delivery threads.
+	 * Called while the directories can't change, unlike DeliverEvents.
+	 */
+	void CollectEvents() noexcept;
+
+	/**
+	 * Delivers the collected batch to the callback in a single call.
+	 */
+	void DeliverEvents() noexcept;
+
+	/**
+	 * Looks up the status of the entries of the queued events into m_BatchStatuses, a status per event. Implemented by the backends.
+	 */
+	void CollectFileStatus() noexcept;
+
+	/**
+	 * Starts the delivery threads if delivering through the queue, and creates the fingerprint cache if suppressing unchanged modifications.
+	 */
+	void StartDelivery() noexcept;
+
+	/**
+	 * Wakes and joins the delivery threads. Events still queued are discarded.
+	 */
+	void StopDelivery() noexcept;
+	void DeliveryThreadWork() noexcept;
+
+	/**
+	 * Schedules the lane an event was pushed to, unless it already is.
+	 */
+	void ScheduleLane(const size_t laneIndex) noexcept;
+
+	/**
+	 * Hands a scheduled lane to the delivery threads or to the executor.
+	 */
+	void RunLane(const size_t laneIndex) noexcept;
+
+	/**
+	 * Delivers a batch of the lane's events, and runs the lane again if more are left.
+	 */
+	void DrainLane(const size_t laneIndex) noexcept;
+
+	/**
+	 * Stores whether the watcher is watching, and wakes the threads waiting for it to stop.
+	 */
+	void SetIsWatching(const bool isWatching) noexcept;
+	void EnqueueEvent(const QueuedEvent& queuedEvent, const FileWatcherStringView names, const FileWatcherFileStatus& status) noexcept;
+
+	/**
+	 * Returns true if a Modified event, or a Renamed one replacing a fingerprinted file, left the content of the file as it was.
+	 * Any other event drops the fingerprint of the file, as whatever is at the path now wasn't fingerprinted. Called by the thread delivering the event.
+	 * @param path - Full path of the file.
+	 * @param oldPath - Full path the file was renamed from, if renamed.
+	 */
+	[[nodiscard]] bool IsUnchangedContent(const EFileAction action, const FileWatcherPathBuffer& path, const FileWatcherPathBuffer& oldPath, const bool isDirectory) noexcept;
+
+	/**
+	 * Takes the fingerprint of a regular file, reading it in chunks. Returns false if the file can't be read or exceeds the hashing budget.
+	 */
+	[[nodiscard]] bool ReadFingerprint(const FileWatcherPathBuffer& path, struct FileWatcherFingerprint& fingerprint) const noexcept;
+
+	/**
+	 * Compiles the include and exclude patterns, if there are any.
+	 */
+	void CompileFilter() noexcept;
+
+	/**
+	 * Returns true if the entry passes the filter. Checked on the name as reported, before any path is built.
+	 */
+	[[nodiscard]] bool IsReported(const uint32_t directoryId, const FileWatcherStringView name, const bool isDirectory) noexcept;
 
-	[[nodiscard]] std::filesystem::path ConstructReturnPath(struct FilewatcherCharacterType* fileNameBuffer, const size_t) const noexcept;
+	/**
+	 * Returns true if the event mask subscribes to the action. Errors, overflows and EFileAction::Ready are always reported.
+	 */
+	[[nodiscard]] bool IsSubscribed(const EFileAction action) const noexcept;
+
+	/**
+	 * Returns true if the directory is excluded and shouldn't be watched.
+	 * @param path - Full path of the directory.
+	 */
+	[[nodiscard]] bool IsExcludedDirectory(const FileWatcherStringView path) const noexcept;
+
+	void SetupWatcher(std::error_code& error) noexcept;
+#if defined(_WIN32)
+	void WatcherThreadWork() noexcept;
+#else
+	/**
+	 * Handles a single event routed to this watcher by the shared reactor.
+	 * Returns false if the watcher stopped and its watches should be released.
+	 */
+	[[nodiscard]] bool ProcessEvent(const struct inotify_event* event) noexcept;
+
+	/**
+	 * Reports moves whose pair didn't arrive before the deadline and coalesced events whose period has passed. Invoked by the shared reactor.
+	 */
+	void ProcessTimers(const std::chrono::steady_clock::time_point now) noexcept;
+
+	/**
+	 * Arms a reactor timer for the deadline, unless one fires earlier anyway.
+	 */
+	void ScheduleTimer(const std::chrono::steady_clock::time_point deadline) noexcept;
+
+	/**
+	 * Reports lost events and rescans the tree if enabled. Invoked by the shared reactor.
+	 */
+	void ProcessOverflow() noexcept;
+
+	/**
+	 * Queues the directories to be listed by the rescan thread. Directories without a snapshot only get one.
+	 */
+	void StartRescan(std::vector<std::pair<int, std::filesystem::path>>&& directories) noexcept;
+	void RescanThreadWork() noexcept;
+
+	/**
+	 * Diffs a directory listing from the rescan thread against the snapshot and reports the differences.
+	 */
+	void ApplyRescan(struct FileWatcherDirectoryListing& listing) noexcept;
+
+	/**
+	 * Registers the tree on crawler threads, which list the directories through descriptors of their parents.
+	 */
+	void StartCrawl(const std::string_view rootPath) noexcept;
+	void JoinCrawl() noexcept;
+	void CrawlThreadWork(const size_t queueIndex) noexcept;
+	void CrawlDirectory(struct FileWatcherCrawlTask& task, const size_t queueIndex, std::byte* buffer) noexcept;
+	void PushCrawlTask(const size_t queueIndex, struct FileWatcherCrawlTask&& task) noexcept;
+	void ReportCrawlError(const struct FileWatcherCrawlTask& task, const std::error_code& error) noexcept;
+
+	/**
+	 * Completes the setup once the whole tree is watched.
+	 */
+	void FinishSetup() noexcept;
+	void UpdateSnapshot(const int watchDescriptor, const std::string_view name) noexcept;
+
+	/**
+	 * Lists the directory again when the snapshot is next saved. Invoked for every event read for it, other than opening or reading an entry.
+	 */
+	void MarkSnapshotChanged(const int watchDescriptor) noexcept;
+
+	/**
+	 * Lists the directories changed since the snapshot was last saved, reuses the listings of the rest and writes the snapshot.
+	 * @param isCancellable - true if cancelling the snapshot thread stops it, what was listed so far is kept for the next save.
+	 */
+	void WriteSnapshot(std::error_code& error, const bool isCancellable) const noexcept;
+	void JoinSnapshot() noexcept;
+	void SnapshotThreadWork() noexcept;
+
+	/**
+	 * Diffs the tree against the snapshot written by the previous watcher and reports the changes made since.
+	 * Invoked by the snapshot thread once the tree is watched. Returns false if cancelled before reporting anything.
+	 */
+	[[nodiscard]] bool CatchUpSnapshot() noexcept;
+	void DiffSnapshotThreadWork(struct FileWatcherSnapshotCatchUp& catchUp) noexcept;
+
+	/**
+	 * Diffs a directory against it's entries in the snapshot. Subdirectories are diffed on their own, the entries found on one side only
+	 * are kept until every directory is diffed, as they might turn out to be renamed.
+	 */
+	void DiffSnapshotDirectory(const class FileWatcherTreeSnapshotView& snapshot, struct FileWatcherSnapshotDiff& diff, const uint32_t index, const std::string& path) const noexcept;
+
+	/**
+	 * Returns true if a snapshot is kept, which is only possible when observing a directory with the inotify backend.
+	 */
+	[[nodiscard]] bool IsSnapshotted() const noexcept { return !m_Options.SnapshotPath.empty() && IsRecursive() && m_Options.Backend == EFileWatcherBackend::Default; }
+
+	/**
+	 * Returns true if the entry of the watched directory should be reported, which is either the observed file or one of the targets.
+	 */
+	[[nodiscard]] bool IsObserved(const int watchDescriptor, const std::string_view name) const noexcept;
+
+	/**
+	 * Returns true if new subdirectories are watched as well, which is only the case when observing a directory.
+	 */
+	[[nodiscard]] bool IsRecursive() const noexcept { return m_ObservedFile.empty() && !m_ObservedPath.empty(); }
+
+	/**
+	 * Drops the targets of a directory which is no longer watched. Returns false if it held none.
+	 */
+	bool ForgetTargets(const int watchDescriptor) noexcept;
+
+	/**
+	 * Returns the path a target is looked up by, absolute if returning absolute paths and without trailing separators.
+	 */
+	[[nodiscard]] std::string NormalizeTarget(const std::filesystem::path& target, std::error_code& error) const noexcept;
+
+	/**
+	 * Adds a watch on a subdirectory. Returns it's watch descriptor, or -1 after queueing the error.
+	 */
+	[[nodiscard]] int WatchSubdirectory(const uint32_t directoryId, const std::string_view name) noexcept;
+
+	/**
+	 * Watches a directory created in (or moved into) the tree and reports it's contents, which might predate the watch.
+	 */
+	void WatchNewDirectory(const uint32_t directoryId, const std::string_view name) noexcept;
+
+	/**
+	 * Relinks a watched subdirectory the kernel reported moving to where it was moved within the tree, along with everything inside it.
+	 * Returns false if it was moved out of the tree, or into an excluded directory.
+	 */
+	[[nodiscard]] bool RelinkMovedDirectory(const int watchDescriptor) noexcept;
+
+	/**
+	 * Drops the watches of a subdirectory and everything inside it at once.
+	 */
+	void ForgetSubtree(const int watchDescriptor) noexcept;
+
+	/**
+	 * Resolves the paths of the events queued so far within a directory which is about to move, so they're still reported where they happened.
+	 */
+	void ResolveQueuedEvents(const int watchDescriptor) noexcept;
+
+	/**
+	 * Marks the file system of the observed path. Events are filtered to the observed tree by the path of their parent directory.
+	 */
+	void SetupFanotify(std::error_code& error) noexcept;
+
+	/**
+	 * Handles the events read from the fanotify group by the shared reactor.
+	 * Returns false if the watcher stopped and its group should be released.
+	 */
+	[[nodiscard]] bool ProcessFanotifyEvents(const std::byte* buffer, const size_t length) noexcept;
+
+	/**
+	 * Returns the id of the directory identified by the raw file handle, or FileWatcherEvent::s_NoDirectory if it's outside of the observed tree.
+	 */
+	[[nodiscard]] uint32_t ResolveFanotifyDirectory(const std::string_view handle) noexcept;
+
+	/**
+	 * Forgets the resolved directories once their paths might have changed. Ids handed out so far stay resolvable until the batch is delivered.
+	 */
+	void InvalidateFanotifyDirectories() noexcept;
+
+	friend class FileWatcherReactor;
+#endif
+
+	/**
+	 * Returns the path of a directory events are reported relative to.
+	 */
+	[[nodiscard]] FileWatcherStringView GetDirectoryPath(const uint32_t directoryId) const noexcept;
+
+	/**
+	 * Returns the path of an event's directory, as it was collected if the batch is being delivered by the calling thread.
+	 */
+	[[nodiscard]] FileWatcherStringView GetEventDirectoryPath(const uint32_t directoryId) const noexcept;
 private:
 	mutable std::atomic<bool> m_IsWatching;		// true if actively watching.
-	std::filesystem::path m_ObservedPath;		// path of observed directory (parent path if observing a file).
+	mutable std::mutex m_WaitMutex;
+	mutable std::condition_variable m_StoppedWatching;	// notified whenever m_IsWatching is cleared.
+	std::atomic<bool> m_IsReady{ false };		// true once the whole tree is watched.
+	std::filesystem::path m_ObservedPath;		// path of observed directory (parent path if observing a file), empty if watching targets.
 	std::filesystem::path m_ObservedFile; 		// empty if observing a directory.
-	FileWatcherCallback m_Callback;
+	FileWatcherBatchCallback m_Callback;
+	const FileWatcherOptions m_Options;
+
+	std::vector<QueuedEvent> m_QueuedEvents;	// events of the batch being built.
+	std::vector<FileWatcherEvent> m_BatchEvents;
+	std::basic_string<std::filesystem::path::value_type> m_BatchNames;
+	std::vector<FileWatcherFileStatus> m_BatchStatuses;	// empty unless collecting the status.
+	std::vector<QueuedEvent> m_DeliveryEvents;			// collected batch, only touched by the thread delivering it.
+	std::basic_string<std::filesystem::path::value_type> m_DeliveryNames;	// names of the collected events, followed by the paths of their directories.
+	std::vector<FileWatcherFileStatus> m_DeliveryStatuses;	// a status per collected event.
+	std::vector<DeliveryDirectory> m_DeliveryDirectories;	// ordered by id.
+
+	CoalescedEventMap m_CoalescedEvents;						// pending events by file.
+	std::deque<CoalescedEventMap::value_type*> m_CoalescingQueue;	// pending events by deadline. As the period is fixed, that's the order they arrived in.
+	std::atomic<uint64_t> m_Callbacks{ 0U };
+	std::atomic<uint64_t> m_CoalescedEventCount{ 0U };
+	std::unique_ptr<class FileWatcherHistogramRecorder[]> m_CallbackDurations;	// the reading thread's, followed by one per delivery lane.
+	size_t m_CallbackDurationCount{ 0U };
 
+	std::unique_ptr<class FileWatcherDeliveryLanes> m_DeliveryLanes;	// null when invoking the callback on the thread reading the events.
+	std::vector<std::thread> m_DeliveryThreads;
+	FileWatcherPathBuffer m_LaneBuffer;								// path of the event being queued, when hashing it to a lane.
+	std::atomic<size_t> m_QueueHighWaterMark{ 0U };
+	std::atomic<uint64_t> m_DroppedEvents{ 0U };
+
+	std::unique_ptr<class FileWatcherFingerprintCache> m_Fingerprints;	// null unless suppressing unchanged modifications.
+	std::atomic<uint64_t> m_UnchangedModifications{ 0U };
+
+	std::unique_ptr<class FileWatcherFilter> m_Filter;	// null without any patterns.
+	FileWatcherPathBuffer m_FilterBuffer;				// relative path of the entry being filtered, if a pattern spans directories.
+
+#if defined(_WIN32)
 	std::thread m_WatcherThread;				// watching is performed on a separate blocking thread.
+#endif
 	std::unique_ptr<struct FileWatcherInternalState> m_InternalState;
-private:	
-	constexpr static inline size_t s_WatchBufferSize{ 8192U };
+private:
+	constexpr static inline size_t s_DeliveryBatchSize{ 256U };	// most queued events a delivery thread passes to a single callback.
+	constexpr static inline std::chrono::milliseconds s_FingerprintQuietPeriod{ 100 };	// longest modifications are held back for without coalescing.
+	constexpr static inline size_t s_FingerprintQueueCapacity{ 4096U };	// events queued for hashing when fingerprinting without a DeliveryQueueCapacity.
 };
\ No newline at end of file
@@ -0,0 +1,371 @@
+#pragma once
+#include "FileWatcher.hpp"
+#include <atomic>
+#include <memory>
+#include <bit>
+#include <limits>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Event handed to the delivery threads. The paths are resolved before queueing, as the directory table
+ * belongs to the thread reading the events. Records are swapped in and out of the slots, so their buffers are reused.
+ */
+struct FileWatcherQueuedRecord
+{
+	EFileAction Action{ EFileAction::Error };
+	bool HasPath{ false };
+	bool HasOldPath{ false };
+	bool IsDirectory{ false };
+	FileWatcherPathBuffer Path{};
+	FileWatcherPathBuffer OldPath{};
+	std::error_code Error{};
+	FileWatcherFileStatus Status{};		// collected before queueing, none otherwise.
+};
+
+/**
+ * Bounded lock-free ring buffer of event records, filled by the thread reading the events and drained by the delivery threads.
+ * Every slot carries a sequence number telling whether it's turn to be written or read has come, so pushing and popping
+ * only contend on the index they advance. Waiting for room or for events blocks on the push and pop counters.
+ */
+class FileWatcherEventQueue
+{
+public:
+	FileWatcherEventQueue(const FileWatcherEventQueue&) = delete;
+	FileWatcherEventQueue& operator=(const FileWatcherEventQueue&) = delete;
+
+	/**
+	 * @param capacity - Most records queued at once, rounded up to a power of two.
+	 */
+	explicit FileWatcherEventQueue(const size_t capacity) noexcept
+		:
+		m_Slots(std::make_unique<Slot[]>(std::bit_ceil(std::max<size_t>(capacity, 2U)))),
+		m_Mask(std::bit_ceil(std::max<size_t>(capacity, 2U)) - 1U)
+	{
+		for (size_t i{ 0U }; i <= m_Mask; ++i)
+			m_Slots[i].Sequence.store(i, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Claims the next free slot and lets the function fill it's record. Returns false if the queue is full.
+	 */
+	template<typename Function>
+	[[nodiscard]] bool TryPush(Function&& fill) noexcept
+	{
+		size_t position{ m_Tail.load(std::memory_order_relaxed) };
+		while (true)
+		{
+			Slot& slot{ m_Slots[position & m_Mask] };
+			const size_t sequence{ slot.Sequence.load(std::memory_order_acquire) };
+			const intptr_t difference{ static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position) };
+
+			if (difference == 0)
+			{
+				// Sequentially consistent, so a lane released after the push is seen to have records, see FileWatcherDeliveryLanes::Release
+				if (m_Tail.compare_exchange_weak(position, position + 1U, std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					fill(slot.Record);
+					slot.Sequence.store(position + 1U, std::memory_order_release);
+
+					m_Pushes.fetch_add(1U, std::memory_order_release);
+					m_Pushes.notify_one();
+					return true;
+				}
+			}
+			else if (difference < 0) // The slot still holds a record from the previous lap
+				return false;
+			else
+				position = m_Tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Takes the oldest record, handing it to the function. Returns false if the queue is empty.
+	 */
+	template<typename Function>
+	[[nodiscard]] bool TryPop(Function&& consume) noexcept
+	{
+		size_t position{ m_Head.load(std::memory_order_relaxed) };
+		while (true)
+		{
+			Slot& slot{ m_Slots[position & m_Mask] };
+			const size_t sequence{ slot.Sequence.load(std::memory_order_acquire) };
+			const intptr_t difference{ static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1U) };
+
+			if (difference == 0)
+			{
+				if (m_Head.compare_exchange_weak(position, position + 1U, std::memory_order_relaxed))
+				{
+					consume(slot.Record);
+					slot.Sequence.store(position + m_Mask + 1U, std::memory_order_release);
+
+					m_Pops.fetch_add(1U, std::memory_order_release);
+					m_Pops.notify_one();
+					return true;
+				}
+			}
+			else if (difference < 0) // Not written yet
+				return false;
+			else
+				position = m_Head.load(std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Blocks until a record might have been pushed. Returns false once the queue is closed.
+	 */
+	[[nodiscard]] bool WaitToPop() noexcept
+	{
+		// Loaded before checking, so a push in between makes the wait return right away
+		const uint32_t pushes{ m_Pushes.load(std::memory_order_acquire) };
+		if (m_IsClosed.load(std::memory_order_acquire))
+			return false;
+
+		if (GetSize() == 0U)
+			m_Pushes.wait(pushes, std::memory_order_acquire);
+
+		return !m_IsClosed.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Blocks until a record might have been popped. Returns false once the queue is closed.
+	 */
+	[[nodiscard]] bool WaitToPush() noexcept
+	{
+		const uint32_t pops{ m_Pops.load(std::memory_order_acquire) };
+		if (m_IsClosed.load(std::memory_order_acquire))
+			return false;
+
+		if (GetSize() > m_Mask)
+			m_Pops.wait(pops, std::memory_order_acquire);
+
+		return !m_IsClosed.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Wakes every waiting thread, waiting fails from now on.
+	 */
+	void Close() noexcept
+	{
+		m_IsClosed.store(true, std::memory_order_release);
+
+		m_Pushes.fetch_add(1U, std::memory_order_release);
+		m_Pushes.notify_all();
+		m_Pops.fetch_add(1U, std::memory_order_release);
+		m_Pops.notify_all();
+	}
+
+	[[nodiscard]] size_t GetSize() const noexcept
+	{
+		const size_t head{ m_Head.load(std::memory_order_relaxed) };
+		const size_t tail{ m_Tail.load(std::memory_order_relaxed) };
+		return tail > head ? tail - head : 0U;
+	}
+
+	[[nodiscard]] bool HasRecords() const noexcept
+	{
+		return m_Tail.load(std::memory_order_seq_cst) != m_Head.load(std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] size_t GetCapacity() const noexcept { return m_Mask + 1U; }
+
+	/**
+	 * Positions of the next record pushed and popped, counting every record the queue has seen.
+	 */
+	[[nodiscard]] size_t GetPushPosition() const noexcept { return m_Tail.load(std::memory_order_acquire); }
+	[[nodiscard]] size_t GetPopPosition() const noexcept { return m_Head.load(std::memory_order_acquire); }
+private:
+	struct Slot
+	{
+		std::atomic<size_t> Sequence{ 0U };
+		FileWatcherQueuedRecord Record{};
+	};
+private:
+	std::unique_ptr<Slot[]> m_Slots;
+	const size_t m_Mask;
+
+	// Producers and consumers each get their own cache line
+	alignas(64) std::atomic<size_t> m_Tail{ 0U };		// next slot to push to.
+	alignas(64) std::atomic<size_t> m_Head{ 0U };		// next slot to pop from.
+	alignas(64) std::atomic<uint32_t> m_Pushes{ 0U };	// only waited on, it's value is meaningless.
+	alignas(64) std::atomic<uint32_t> m_Pops{ 0U };
+	std::atomic<bool> m_IsClosed{ false };
+};
+
+/**
+ * Lane of the delivery, holding the events of the paths hashed to it. Only one thread drains a lane at a time,
+ * so the events of a path are delivered in the order they occurred.
+ */
+struct FileWatcherDeliveryLane
+{
+	static constexpr size_t s_NoOverflow{ std::numeric_limits<size_t>::max() };
+
+	explicit FileWatcherDeliveryLane(const size_t capacity) noexcept
+		:
+		Queue(capacity)
+	{
+	}
+
+	FileWatcherEventQueue Queue;
+	alignas(64) std::atomic<bool> IsScheduled{ false };	// a thread drains the lane, or is about to.
+	// Push position of the first event the Coalesce policy discarded since the lane's last overflow, s_NoOverflow if none was.
+	std::atomic<size_t> OverflowPosition{ s_NoOverflow };
+	// Only touched by the thread draining the lane. The records keep their buffers between batches.
+	std::vector<FileWatcherQueuedRecord> Records{};
+	std::vector<FileWatcherEvent> Events{};
+};
+
+/**
+ * Lanes the queued events are spread over, and the lanes waiting for a thread to deliver them. A lane is scheduled when
+ * an event is pushed to it while it's idle, and released once it's drained, so it's never waiting twice.
+ */
+class FileWatcherDeliveryLanes
+{
+public:
+	FileWatcherDeliveryLanes(const FileWatcherDeliveryLanes&) = delete;
+	FileWatcherDeliveryLanes& operator=(const FileWatcherDeliveryLanes&) = delete;
+
+	/**
+	 * @param laneCount - Lanes to hash the paths to.
+	 * @param capacity - Most events queued at once, split evenly between the lanes.
+	 */
+	FileWatcherDeliveryLanes(const size_t laneCount, const size_t capacity) noexcept
+		:
+		m_ReadyLanes(laneCount)
+	{
+		m_Lanes.reserve(laneCount);
+		for (size_t i{ 0U }; i < laneCount; ++i)
+			m_Lanes.push_back(std::make_unique<FileWatcherDeliveryLane>((capacity + laneCount - 1U) / laneCount));
+	}
+
+	[[nodiscard]] size_t GetLaneCount() const noexcept { return m_Lanes.size(); }
+	[[nodiscard]] FileWatcherDeliveryLane& operator[](const size_t lane) noexcept { return *m_Lanes[lane]; }
+
+	[[nodiscard]] size_t SelectLane(const FileWatcherStringView path) const noexcept
+	{
+		return std::hash<FileWatcherStringView>{}(path) % m_Lanes.size();
+	}
+
+	/**
+	 * Marks the lane as scheduled after an event was pushed to it. Returns false if it already was, in which case
+	 * the thread draining it sees the event.
+	 */
+	[[nodiscard]] bool TrySchedule(const size_t lane) noexcept
+	{
+		return !m_Lanes[lane]->IsScheduled.exchange(true, std::memory_order_seq_cst);
+	}
+
+	/**
+	 * Called by the thread which drained the lane. Returns true if events arrived or were discarded meanwhile, in which case the lane stays scheduled.
+	 */
+	[[nodiscard]] bool Release(const size_t lane) noexcept
+	{
+		// Either the check sees a push racing with the release, or the pushing thread sees the lane released and schedules it itself.
+		// Both sides are sequentially consistent, so they can't miss each other.
+		m_Lanes[lane]->IsScheduled.store(false, std::memory_order_seq_cst);
+		const FileWatcherDeliveryLane& released{ *m_Lanes[lane] };
+		const bool isPending{ released.Queue.HasRecords() || released.OverflowPosition.load(std::memory_order_seq_cst) != FileWatcherDeliveryLane::s_NoOverflow };
+		return isPending && TrySchedule(lane);
+	}
+
+	/**
+	 * Hands a scheduled lane to the delivery threads.
+	 */
+	void PushReady(const size_t lane) noexcept
+	{
+		{
+			std::scoped_lock lock(m_Mutex);
+			m_ReadyLanes[(m_ReadyHead + m_ReadyCount++) % m_ReadyLanes.size()] = lane;
+		}
+
+		m_Changed.notify_one();
+	}
+
+	/**
+	 * Blocks until a lane is ready to be drained, in the order they were scheduled. Returns nothing once closed.
+	 */
+	[[nodiscard]] std::optional<size_t> WaitForReady() noexcept
+	{
+		std::unique_lock lock(m_Mutex);
+		m_Changed.wait(lock, [this]() noexcept { return m_IsClosed || m_ReadyCount > 0U; });
+		if (m_IsClosed)
+			return std::nullopt;
+
+		const size_t lane{ m_ReadyLanes[m_ReadyHead] };
+		m_ReadyHead = (m_ReadyHead + 1U) % m_ReadyLanes.size();
+		--m_ReadyCount;
+		return lane;
+	}
+
+	/**
+	 * Counts a task handed to an executor. Returns false once closed, in which case the task mustn't be handed out.
+	 */
+	[[nodiscard]] bool BeginTask() noexcept
+	{
+		std::scoped_lock lock(m_Mutex);
+		if (m_IsClosed)
+			return false;
+
+		++m_RunningTasks;
+		return true;
+	}
+
+	/**
+	 * Last thing a task does, the watcher may be gone once it returns.
+	 */
+	void EndTask() noexcept
+	{
+		std::scoped_lock lock(m_Mutex);
+		--m_RunningTasks;
+		m_Changed.notify_all();
+	}
+
+	/**
+	 * Blocks until every task handed to an executor has finished.
+	 */
+	void WaitForTasks() noexcept
+	{
+		std::unique_lock lock(m_Mutex);
+		m_Changed.wait(lock, [this]() noexcept { return m_RunningTasks == 0U; });
+	}
+
+	/**
+	 * Wakes the delivery threads and the thread waiting for room, waiting fails from now on. Events still queued are discarded.
+	 */
+	void Close() noexcept
+	{
+		{
+			std::scoped_lock lock(m_Mutex);
+			m_IsClosed = true;
+		}
+
+		m_Changed.notify_all();
+		for (const std::unique_ptr<FileWatcherDeliveryLane>& lane : m_Lanes)
+			lane->Queue.Close();
+	}
+
+	[[nodiscard]] bool IsClosed() const noexcept
+	{
+		std::scoped_lock lock(m_Mutex);
+		return m_IsClosed;
+	}
+
+	[[nodiscard]] size_t GetSize() const noexcept
+	{
+		size_t size{ 0U };
+		for (const std::unique_ptr<FileWatcherDeliveryLane>& lane : m_Lanes)
+			size += lane->Queue.GetSize();
+
+		return size;
+	}
+private:
+	std::vector<std::unique_ptr<FileWatcherDeliveryLane>> m_Lanes{};	// not moved, the queues are shared with the delivering threads.
+
+	mutable std::mutex m_Mutex{};
+	std::condition_variable m_Changed{};
+	std::vector<size_t> m_ReadyLanes;	// ring of the scheduled lanes, every lane is in it at most once.
+	size_t m_ReadyHead{ 0U };
+	size_t m_ReadyCount{ 0U };
+	size_t m_RunningTasks{ 0U };
+	bool m_IsClosed{ false };
+};
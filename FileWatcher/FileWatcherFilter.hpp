@@ -0,0 +1,292 @@
+#pragma once
+#include "FileWatcher.hpp"
+#include <unordered_set>
+
+/**
+ * Include and exclude patterns compiled into lookups on the raw names the kernel reports.
+ * Literal names and "*.extension" patterns are hashed, so the common exclusions (".git", "node_modules", "*.o")
+ * cost a lookup per path component. Only the remaining patterns are matched as globs. Patterns ending in a separator,
+ * such as "build/", are kept apart and only matched against directories.
+ */
+class FileWatcherFilter
+{
+public:
+	FileWatcherFilter(const FileWatcherFilter&) = delete;
+	FileWatcherFilter& operator=(const FileWatcherFilter&) = delete;
+
+	explicit FileWatcherFilter(const FileWatcherOptions& options) noexcept
+	{
+		for (const FileWatcherPathBuffer& pattern : options.ExcludePatterns)
+			AddPattern(pattern, m_Excluded, m_ExcludedDirectories);
+
+		for (const FileWatcherPathBuffer& pattern : options.IncludePatterns)
+			AddPattern(pattern, m_Included, m_IncludedDirectories);
+	}
+
+	[[nodiscard]] bool IsEmpty() const noexcept { return m_Excluded.IsEmpty() && m_ExcludedDirectories.IsEmpty() && m_Included.IsEmpty() && m_IncludedDirectories.IsEmpty(); }
+
+	/**
+	 * Returns true if the entry or any directory on it's way is excluded.
+	 * @param relativePath - Path of the entry relative to the observed directory.
+	 * @param isDirectory - The entry itself is a directory, the components before it always are.
+	 */
+	[[nodiscard]] bool IsExcluded(const FileWatcherStringView relativePath, const bool isDirectory) const noexcept
+	{
+		if (m_Excluded.IsEmpty() && m_ExcludedDirectories.IsEmpty())
+			return false;
+
+		// Any component, so the contents of an excluded directory are excluded as well
+		for (size_t begin{ 0U }; begin < relativePath.size();)
+		{
+			const size_t end{ FindSeparator(relativePath, begin) };
+			const FileWatcherStringView component{ relativePath.substr(begin, end - begin) };
+			if (end != begin && (m_Excluded.MatchesName(component) || ((end < relativePath.size() || isDirectory) && m_ExcludedDirectories.MatchesName(component))))
+				return true;
+
+			begin = end + 1U;
+		}
+
+		if (m_Excluded.PathGlobs.empty() && m_ExcludedDirectories.PathGlobs.empty())
+			return false;
+
+		for (size_t end{ FindSeparator(relativePath, 0U) };; end = FindSeparator(relativePath, end + 1U))
+		{
+			const FileWatcherStringView path{ relativePath.substr(0U, end) };
+			if (m_Excluded.MatchesPath(path) || ((end < relativePath.size() || isDirectory) && m_ExcludedDirectories.MatchesPath(path)))
+				return true;
+
+			if (end >= relativePath.size())
+				return false;
+		}
+	}
+
+	/**
+	 * Returns true if the entry should be reported.
+	 * @param directory - Path of the parent directory relative to the observed directory.
+	 * @param name - Name of the entry as reported by the kernel.
+	 * @param isDirectory - The entry is a directory.
+	 * @param buffer - Receives the relative path of the entry, but only if a pattern needs it.
+	 */
+	[[nodiscard]] bool IsReported(FileWatcherStringView directory, const FileWatcherStringView name, const bool isDirectory, FileWatcherPathBuffer& buffer) const noexcept
+	{
+		while (!directory.empty() && IsSeparator(directory.front()))
+			directory.remove_prefix(1U);
+
+		// Names are only joined into a path if a pattern spans directories
+		FileWatcherStringView relativePath{ name };
+		const bool hasPathGlobs{ !m_Excluded.PathGlobs.empty() || !m_ExcludedDirectories.PathGlobs.empty() || !m_Included.PathGlobs.empty() || !m_IncludedDirectories.PathGlobs.empty() };
+		if (!directory.empty() && hasPathGlobs)
+		{
+			buffer.assign(directory);
+			buffer.push_back(std::filesystem::path::preferred_separator);
+			buffer.append(name);
+			relativePath = buffer;
+		}
+
+		if (relativePath.data() == name.data() ? IsExcluded(directory, true) || IsExcluded(name, isDirectory) : IsExcluded(relativePath, isDirectory))
+			return false;
+
+		if (m_Included.IsEmpty() && m_IncludedDirectories.IsEmpty())
+			return true;
+
+		const size_t nameBegin{ name.find_last_of(s_Separators) };
+		const FileWatcherStringView baseName{ nameBegin == FileWatcherStringView::npos ? name : name.substr(nameBegin + 1U) };
+		return m_Included.MatchesName(baseName) || m_Included.MatchesPath(relativePath)
+			|| (isDirectory && (m_IncludedDirectories.MatchesName(baseName) || m_IncludedDirectories.MatchesPath(relativePath)));
+	}
+private:
+	// Allows looking names up by view
+	struct NameHash
+	{
+		using is_transparent = void;
+
+		[[nodiscard]] size_t operator()(const FileWatcherStringView name) const noexcept { return std::hash<FileWatcherStringView>{}(name); }
+	};
+
+	using NameSet = std::unordered_set<FileWatcherPathBuffer, NameHash, std::equal_to<>>;
+
+	struct PatternSet
+	{
+		NameSet Names{};					// literal names.
+		NameSet Suffixes{};					// "*.o" and "*.tar.gz", stored with the dot.
+		std::vector<FileWatcherPathBuffer> NameGlobs{};
+		std::vector<FileWatcherPathBuffer> PathGlobs{};	// patterns spanning directories, matched against the whole relative path.
+
+		[[nodiscard]] bool IsEmpty() const noexcept { return Names.empty() && Suffixes.empty() && NameGlobs.empty() && PathGlobs.empty(); }
+
+		void Add(FileWatcherStringView pattern) noexcept
+		{
+			while (!pattern.empty() && IsSeparator(pattern.front()))
+				pattern.remove_prefix(1U);
+
+			if (pattern.empty())
+				return;
+
+			if (pattern.find_first_of(s_Separators) != FileWatcherStringView::npos)
+				PathGlobs.emplace_back(pattern);
+			else if (pattern.find_first_of(s_Wildcards) == FileWatcherStringView::npos)
+				Names.emplace(pattern);
+			else if (pattern.size() > 2U && pattern[0] == '*' && pattern[1] == '.' && pattern.find_first_of(s_Wildcards, 1U) == FileWatcherStringView::npos)
+				Suffixes.emplace(pattern.substr(1U));
+			else
+				NameGlobs.emplace_back(pattern);
+		}
+
+		[[nodiscard]] bool MatchesName(const FileWatcherStringView name) const noexcept
+		{
+			if (!Names.empty() && Names.contains(name))
+				return true;
+
+			// Every dot might start a listed suffix
+			if (!Suffixes.empty())
+				for (size_t dot{ name.find('.') }; dot != FileWatcherStringView::npos; dot = name.find('.', dot + 1U))
+					if (Suffixes.contains(name.substr(dot)))
+						return true;
+
+			for (const FileWatcherPathBuffer& glob : NameGlobs)
+				if (MatchGlob(glob, name))
+					return true;
+
+			return false;
+		}
+
+		[[nodiscard]] bool MatchesPath(const FileWatcherStringView relativePath) const noexcept
+		{
+			for (const FileWatcherPathBuffer& glob : PathGlobs)
+				if (MatchGlob(glob, relativePath))
+					return true;
+
+			return false;
+		}
+	};
+
+	/**
+	 * Adds the pattern to the set it belongs to. A trailing separator only tells the pattern applies to directories, it's matched without it.
+	 */
+	static void AddPattern(FileWatcherStringView pattern, PatternSet& patterns, PatternSet& directoryPatterns) noexcept
+	{
+		if (pattern.empty() || !IsSeparator(pattern.back()))
+		{
+			patterns.Add(pattern);
+			return;
+		}
+
+		while (!pattern.empty() && IsSeparator(pattern.back()))
+			pattern.remove_suffix(1U);
+
+		directoryPatterns.Add(pattern);
+	}
+
+	[[nodiscard]] static constexpr bool IsSeparator(const FileWatcherPathBuffer::value_type character) noexcept
+	{
+		return character == '/' || character == std::filesystem::path::preferred_separator;
+	}
+
+	[[nodiscard]] static size_t FindSeparator(const FileWatcherStringView path, const size_t offset) noexcept
+	{
+		return std::min(path.find_first_of(s_Separators, offset), path.size());
+	}
+
+	/**
+	 * '*' matches within a path component, '**' across components and '?' a single character other than a separator.
+	 * The pattern is run as an automaton whose states are the positions in it, all positions the text may have reached are
+	 * advanced at once. Matching takes at most the pattern's length in steps per character, no matter how the stars line up.
+	 */
+	[[nodiscard]] static bool MatchGlob(const FileWatcherStringView pattern, const FileWatcherStringView text) noexcept
+	{
+		// Reused, as the globs are matched for every event. Crawler threads match the directories they find concurrently.
+		thread_local std::vector<unsigned char> t_States;
+		thread_local std::vector<unsigned char> t_NextStates;
+
+		t_States.assign(pattern.size() + 1U, 0U);
+		AddState(pattern, t_States, 0U);
+
+		for (const FileWatcherPathBuffer::value_type character : text)
+		{
+			t_NextStates.assign(pattern.size() + 1U, 0U);
+			bool isAnyReached{ false };
+
+			for (size_t position{ 0U }; position < pattern.size(); ++position)
+			{
+				if (!t_States[position])
+					continue;
+
+				const FileWatcherPathBuffer::value_type token{ pattern[position] };
+				if (token == '*')
+				{
+					// A star stays where it is while consuming the character, "**" only reaches states at it's first star
+					if (IsDoubleStar(pattern, position) || !IsSeparator(character))
+					{
+						StayInState(pattern, t_NextStates, position);
+						isAnyReached = true;
+					}
+				}
+				else if (token == '?' ? !IsSeparator(character) : (token == character || (IsSeparator(token) && IsSeparator(character))))
+				{
+					AddState(pattern, t_NextStates, position + 1U);
+					isAnyReached = true;
+				}
+			}
+
+			if (!isAnyReached)
+				return false;
+
+			std::swap(t_States, t_NextStates);
+		}
+
+		return t_States[pattern.size()] != 0U;
+	}
+
+	[[nodiscard]] static bool IsDoubleStar(const FileWatcherStringView pattern, const size_t position) noexcept
+	{
+		return position + 1U < pattern.size() && pattern[position + 1U] == '*';
+	}
+
+	/**
+	 * Marks the position as entered, along with the positions after the stars it's at, as they may match nothing.
+	 */
+	static void AddState(const FileWatcherStringView pattern, std::vector<unsigned char>& states, size_t position) noexcept
+	{
+		while (!(states[position] & s_EnteredState))
+		{
+			states[position] |= s_ReachedState | s_EnteredState;
+			if (position == pattern.size() || pattern[position] != '*')
+				break;
+
+			if (!IsDoubleStar(pattern, position))
+			{
+				++position;
+				continue;
+			}
+
+			// "**/" matches no directory at all as well, but only if entered without consuming anything
+			if (position + 2U < pattern.size() && IsSeparator(pattern[position + 2U]))
+				AddState(pattern, states, position + 3U);
+
+			position += 2U;
+		}
+	}
+
+	/**
+	 * Keeps a star reached after it consumed a character, it may still end right after.
+	 */
+	static void StayInState(const FileWatcherStringView pattern, std::vector<unsigned char>& states, const size_t position) noexcept
+	{
+		if (states[position] & s_ReachedState)
+			return;
+
+		states[position] |= s_ReachedState;
+		AddState(pattern, states, position + (IsDoubleStar(pattern, position) ? 2U : 1U));
+	}
+private:
+	PatternSet m_Excluded{};
+	PatternSet m_ExcludedDirectories{};		// patterns ending in a separator.
+	PatternSet m_Included{};
+	PatternSet m_IncludedDirectories{};
+private:
+	constexpr static inline FileWatcherPathBuffer::value_type s_Separators[]{ '/', std::filesystem::path::preferred_separator, '\0' };
+	constexpr static inline FileWatcherPathBuffer::value_type s_Wildcards[]{ '*', '?', '\0' };
+	// Flags of a position in the pattern while matching
+	constexpr static inline unsigned char s_ReachedState{ 1U };
+	constexpr static inline unsigned char s_EnteredState{ 2U };
+};
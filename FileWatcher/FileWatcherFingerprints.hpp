@@ -0,0 +1,233 @@
+#pragma once
+#include "FileWatcher.hpp"
+#include <mutex>
+#include <list>
+#include <array>
+#include <bit>
+#include <utility>
+#include <cstring>
+
+/**
+ * Size and content hash of a file, taken when it was last reported as modified.
+ */
+struct FileWatcherFingerprint
+{
+	uint64_t Size{ 0U };
+	uint64_t Hash{ 0U };
+
+	[[nodiscard]] bool operator==(const FileWatcherFingerprint&) const noexcept = default;
+};
+
+/**
+ * XXH64 of a file's content, fed in chunks of any size as they're read. Four independent lanes per 32 byte stripe,
+ * which the compiler keeps in vector registers.
+ */
+class FileWatcherContentHash
+{
+public:
+	void Update(const std::byte* data, size_t size) noexcept
+	{
+		m_Size += size;
+
+		// Completes the stripe left over by the previous chunk
+		if (m_BufferedSize > 0U)
+		{
+			const size_t copied{ std::min(size, s_StripeSize - m_BufferedSize) };
+			std::memcpy(m_Buffer + m_BufferedSize, data, copied);
+			m_BufferedSize += copied;
+			data += copied;
+			size -= copied;
+
+			if (m_BufferedSize < s_StripeSize)
+				return;
+
+			ConsumeStripe(m_Buffer);
+			m_BufferedSize = 0U;
+		}
+
+		for (; size >= s_StripeSize; data += s_StripeSize, size -= s_StripeSize)
+			ConsumeStripe(data);
+
+		std::memcpy(m_Buffer, data, size);
+		m_BufferedSize = size;
+	}
+
+	[[nodiscard]] uint64_t GetSize() const noexcept { return m_Size; }
+
+	[[nodiscard]] uint64_t Finish() const noexcept
+	{
+		uint64_t hash{ s_Prime5 };
+		if (m_Size >= s_StripeSize)
+		{
+			hash = std::rotl(m_Lanes[0U], 1) + std::rotl(m_Lanes[1U], 7) + std::rotl(m_Lanes[2U], 12) + std::rotl(m_Lanes[3U], 18);
+			for (const uint64_t lane : m_Lanes)
+				hash = (hash ^ Round(0U, lane)) * s_Prime1 + s_Prime4;
+		}
+
+		hash += m_Size;
+
+		const std::byte* data{ m_Buffer };
+		const std::byte* const end{ m_Buffer + m_BufferedSize };
+		for (; end - data >= 8; data += 8)
+			hash = std::rotl(hash ^ Round(0U, Read<uint64_t>(data)), 27) * s_Prime1 + s_Prime4;
+
+		if (end - data >= 4)
+		{
+			hash = std::rotl(hash ^ (static_cast<uint64_t>(Read<uint32_t>(data)) * s_Prime1), 23) * s_Prime2 + s_Prime3;
+			data += 4;
+		}
+
+		for (; data < end; ++data)
+			hash = std::rotl(hash ^ (static_cast<uint64_t>(*data) * s_Prime5), 11) * s_Prime1;
+
+		hash ^= hash >> 33U;
+		hash *= s_Prime2;
+		hash ^= hash >> 29U;
+		hash *= s_Prime3;
+		hash ^= hash >> 32U;
+		return hash;
+	}
+private:
+	void ConsumeStripe(const std::byte* stripe) noexcept
+	{
+		for (size_t lane{ 0U }; lane < 4U; ++lane)
+			m_Lanes[lane] = Round(m_Lanes[lane], Read<uint64_t>(stripe + lane * 8U));
+	}
+
+	[[nodiscard]] static constexpr uint64_t Round(const uint64_t accumulator, const uint64_t input) noexcept
+	{
+		return std::rotl(accumulator + input * s_Prime2, 31) * s_Prime1;
+	}
+
+	// Chunks may end anywhere, so the data isn't necessarily aligned
+	template<typename T>
+	[[nodiscard]] static T Read(const std::byte* data) noexcept
+	{
+		T value;
+		std::memcpy(&value, data, sizeof(T));
+		return value;
+	}
+private:
+	uint64_t m_Lanes[4U]{ s_Prime1 + s_Prime2, s_Prime2, 0U, 0U - s_Prime1 };
+	uint64_t m_Size{ 0U };
+	std::byte m_Buffer[32U]{};
+	size_t m_BufferedSize{ 0U };
+private:
+	constexpr static inline size_t s_StripeSize{ 32U };
+	constexpr static inline uint64_t s_Prime1{ 0x9E3779B185EBCA87ULL };
+	constexpr static inline uint64_t s_Prime2{ 0xC2B2AE3D27D4EB4FULL };
+	constexpr static inline uint64_t s_Prime3{ 0x165667B19E3779F9ULL };
+	constexpr static inline uint64_t s_Prime4{ 0x85EBCA77C2B2AE63ULL };
+	constexpr static inline uint64_t s_Prime5{ 0x27D4EB2F165667C5ULL };
+};
+
+/**
+ * Least recently used cache of file fingerprints, shared by the threads delivering the events.
+ * Also keeps the budget of bytes that may still be hashed, refilled at the configured rate.
+ */
+class FileWatcherFingerprintCache
+{
+public:
+	FileWatcherFingerprintCache(const FileWatcherFingerprintCache&) = delete;
+	FileWatcherFingerprintCache& operator=(const FileWatcherFingerprintCache&) = delete;
+
+	/**
+	 * @param capacity - Most files to keep a fingerprint of.
+	 * @param maxHashedBytesPerSecond - Rate the hashing budget is refilled at, zero doesn't limit hashing.
+	 */
+	FileWatcherFingerprintCache(const size_t capacity, const uint64_t maxHashedBytesPerSecond) noexcept
+		:
+		m_Capacity(capacity),
+		m_MaxHashedBytesPerSecond(maxHashedBytesPerSecond),
+		m_Budget(static_cast<double>(maxHashedBytesPerSecond)),
+		m_LastRefill(std::chrono::steady_clock::now())
+	{
+		m_Index.reserve(capacity);
+	}
+
+	/**
+	 * Stores the fingerprint of the file and returns the one it replaced, if any.
+	 */
+	[[nodiscard]] std::optional<FileWatcherFingerprint> Exchange(const FileWatcherStringView path, const FileWatcherFingerprint& fingerprint) noexcept
+	{
+		std::scoped_lock lock(m_Mutex);
+
+		if (const auto entry{ m_Index.find(path) }; entry != m_Index.end())
+		{
+			// Most recently used go first
+			m_Entries.splice(m_Entries.begin(), m_Entries, entry->second);
+			return std::exchange(entry->second->Fingerprint, fingerprint);
+		}
+
+		// The least recently used entry is reused, so a full cache doesn't allocate
+		if (m_Index.size() >= m_Capacity)
+		{
+			m_Index.erase(m_Entries.back().Path);
+			m_Entries.splice(m_Entries.begin(), m_Entries, std::prev(m_Entries.end()));
+			m_Entries.front().Path.assign(path);
+			m_Entries.front().Fingerprint = fingerprint;
+		}
+		else
+			m_Entries.push_front(Entry{ .Path{ FileWatcherPathBuffer(path) }, .Fingerprint{ fingerprint } });
+
+		m_Index.emplace(m_Entries.front().Path, m_Entries.begin());
+		return std::nullopt;
+	}
+
+	[[nodiscard]] bool Contains(const FileWatcherStringView path) noexcept
+	{
+		std::scoped_lock lock(m_Mutex);
+		return m_Index.contains(path);
+	}
+
+	void Forget(const FileWatcherStringView path) noexcept
+	{
+		std::scoped_lock lock(m_Mutex);
+
+		if (const auto entry{ m_Index.find(path) }; entry != m_Index.end())
+		{
+			m_Entries.erase(entry->second);
+			m_Index.erase(entry);
+		}
+	}
+
+	/**
+	 * Takes the bytes out of the hashing budget. Returns false if there isn't enough left, in which case nothing is taken.
+	 */
+	[[nodiscard]] bool ConsumeBudget(const uint64_t bytes) noexcept
+	{
+		if (m_MaxHashedBytesPerSecond == 0U)
+			return true;
+
+		std::scoped_lock lock(m_Mutex);
+
+		// The budget never exceeds a second worth of hashing
+		const std::chrono::steady_clock::time_point now{ std::chrono::steady_clock::now() };
+		const double elapsed{ std::chrono::duration<double>(now - m_LastRefill).count() };
+		m_Budget = std::min(m_Budget + elapsed * static_cast<double>(m_MaxHashedBytesPerSecond), static_cast<double>(m_MaxHashedBytesPerSecond));
+		m_LastRefill = now;
+
+		if (static_cast<double>(bytes) > m_Budget)
+			return false;
+
+		m_Budget -= static_cast<double>(bytes);
+		return true;
+	}
+private:
+	struct Entry
+	{
+		FileWatcherPathBuffer Path;
+		FileWatcherFingerprint Fingerprint;
+	};
+private:
+	const size_t m_Capacity;
+	const uint64_t m_MaxHashedBytesPerSecond;
+
+	std::mutex m_Mutex{};
+	std::list<Entry> m_Entries{};	// most recently used first. The nodes don't move, so the index can refer to their paths.
+	std::unordered_map<FileWatcherStringView, std::list<Entry>::iterator> m_Index{};
+	double m_Budget;
+	std::chrono::steady_clock::time_point m_LastRefill;
+public:
+	constexpr static inline size_t s_ChunkSize{ 65536U };	// bytes read from the file at once.
+};
@@ -0,0 +1,114 @@
+#pragma once
+#include "FileWatcher.hpp"
+#include <atomic>
+
+/**
+ * Counter written by a single thread at a time and read by any. Increased by a relaxed load and store rather than a locked
+ * read-modify-write, so counting costs no more than a plain addition. Compiled out without FILEWATCHER_METRICS.
+ */
+class FileWatcherCounter
+{
+public:
+	void Add(const uint64_t amount) noexcept
+	{
+#if FILEWATCHER_METRICS
+		m_Value.store(m_Value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+#else
+		(void)amount;
+#endif
+	}
+
+	void Set(const uint64_t value) noexcept
+	{
+#if FILEWATCHER_METRICS
+		m_Value.store(value, std::memory_order_relaxed);
+#else
+		(void)value;
+#endif
+	}
+
+	void Raise(const uint64_t value) noexcept
+	{
+#if FILEWATCHER_METRICS
+		if (value > m_Value.load(std::memory_order_relaxed))
+			m_Value.store(value, std::memory_order_relaxed);
+#else
+		(void)value;
+#endif
+	}
+
+	[[nodiscard]] uint64_t Load() const noexcept { return m_Value.load(std::memory_order_relaxed); }
+private:
+	std::atomic<uint64_t> m_Value{ 0U };
+};
+
+/**
+ * Histogram written by a single thread and read by any, see FileWatcherHistogram for the buckets. Threads recording
+ * the same value keep a recorder each, aligned to it's own cache line so they don't contend for it.
+ */
+class alignas(64) FileWatcherHistogramRecorder
+{
+public:
+	void Record(const uint64_t value) noexcept
+	{
+#if FILEWATCHER_METRICS
+		Increase(m_Buckets[FileWatcherHistogram::GetBucket(value)], 1U);
+		Increase(m_Count, 1U);
+		Increase(m_Sum, value);
+#else
+		(void)value;
+#endif
+	}
+
+	/**
+	 * Adds the values recorded so far to the histogram.
+	 */
+	void AddTo(FileWatcherHistogram& histogram) const noexcept
+	{
+		for (size_t bucket{ 0U }; bucket < FileWatcherHistogram::s_BucketCount; ++bucket)
+			histogram.Buckets[bucket] += m_Buckets[bucket].load(std::memory_order_relaxed);
+
+		histogram.Count += m_Count.load(std::memory_order_relaxed);
+		histogram.Sum += m_Sum.load(std::memory_order_relaxed);
+	}
+private:
+	static void Increase(std::atomic<uint64_t>& value, const uint64_t amount) noexcept
+	{
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+private:
+	std::array<std::atomic<uint64_t>, FileWatcherHistogram::s_BucketCount> m_Buckets{};
+	std::atomic<uint64_t> m_Count{ 0U };
+	std::atomic<uint64_t> m_Sum{ 0U };
+};
+
+/**
+ * Records the time from it's construction to it's destruction, in nanoseconds.
+ */
+class FileWatcherScopedTimer
+{
+public:
+	FileWatcherScopedTimer(const FileWatcherScopedTimer&) = delete;
+	FileWatcherScopedTimer& operator=(const FileWatcherScopedTimer&) = delete;
+
+#if FILEWATCHER_METRICS
+	explicit FileWatcherScopedTimer(FileWatcherHistogramRecorder& recorder) noexcept
+		:
+		m_Recorder(recorder),
+		m_Start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~FileWatcherScopedTimer() noexcept
+	{
+		m_Recorder.Record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_Start).count()));
+	}
+private:
+	FileWatcherHistogramRecorder& m_Recorder;
+	const std::chrono::steady_clock::time_point m_Start;
+#else
+	explicit FileWatcherScopedTimer(FileWatcherHistogramRecorder&) noexcept
+	{
+	}
+#endif
+};
@@ -0,0 +1,247 @@
+#pragma once
+#include "FileWatcher.hpp"
+#include <coroutine>
+#include <mutex>
+#include <utility>
+
+/**
+ * Stream of the events of a watcher for coroutines to await, as an alternative to handling them in the callback.
+ * The stream is passed to the watcher as it's callback, so it has to outlive the watcher:
+ *
+ *	FileWatcherEventStream stream;
+ *	FileWatcher watcher(path, stream.GetCallback(), options, error);
+ *	while (const std::span<const FileWatcherEvent> events{ co_await stream.Next() }; !events.empty())
+ *		...
+ *
+ * Without a scheduler, a coroutine awaiting the stream is resumed on the thread delivering the events, from within the callback,
+ * and gets the batch as the watcher delivered it, without copying. The events are then valid until the coroutine suspends again,
+ * and their paths are resolved with the watcher's ResolvePath as in the callback. Events arriving while nobody awaits the stream,
+ * or with a scheduler, are buffered with their full paths as the names and FileWatcherEvent::s_ResolvedPath as the directory.
+ * Buffered events stay valid until the stream is awaited again.
+ */
+class FileWatcherEventStream
+{
+public:
+	FileWatcherEventStream(const FileWatcherEventStream&) = delete;
+	FileWatcherEventStream& operator=(const FileWatcherEventStream&) = delete;
+
+	/**
+	 * @param scheduler - Resumes the awaiting coroutine, such as on the application's event loop. If empty, the coroutine is
+	 * resumed directly by the thread delivering the events.
+	 * @param capacity - Most events buffered while nobody awaits the stream. Events beyond it are discarded and replaced by a
+	 * single EFileAction::Overflow event.
+	 */
+	explicit FileWatcherEventStream(FileWatcherExecutor scheduler = {}, const size_t capacity = 65536U) noexcept
+		:
+		m_Scheduler(std::move(scheduler)),
+		m_Capacity(capacity)
+	{
+	}
+
+	/**
+	 * Returns the callback to construct the watcher with. Invoking the callback concurrently from several delivery threads is fine.
+	 */
+	[[nodiscard]] FileWatcherBatchCallback GetCallback() noexcept
+	{
+		return [this](const FileWatcher& watcher, const std::span<const FileWatcherEvent> events) noexcept { Push(watcher, events); };
+	}
+
+	class NextAwaiter
+	{
+	public:
+		explicit NextAwaiter(FileWatcherEventStream& stream) noexcept
+			:
+			m_Stream(stream)
+		{
+		}
+
+		[[nodiscard]] bool await_ready() const noexcept
+		{
+			std::scoped_lock lock(m_Stream.m_Mutex);
+			return m_Stream.m_IsClosed || !m_Stream.m_Buffered.empty();
+		}
+
+		[[nodiscard]] bool await_suspend(const std::coroutine_handle<> handle) noexcept
+		{
+			// Events might have arrived since checking
+			std::scoped_lock lock(m_Stream.m_Mutex);
+			if (m_Stream.m_IsClosed || !m_Stream.m_Buffered.empty())
+				return false;
+
+			m_Stream.m_Waiter = handle;
+			return true;
+		}
+
+		/**
+		 * Returns the next batch of events, or an empty batch once the stream is closed.
+		 */
+		[[nodiscard]] std::span<const FileWatcherEvent> await_resume() noexcept
+		{
+			return m_Stream.Take();
+		}
+	private:
+		FileWatcherEventStream& m_Stream;
+	};
+
+	/**
+	 * Awaits the next batch of events. Only one coroutine may await the stream at a time.
+	 */
+	[[nodiscard]] NextAwaiter Next() noexcept
+	{
+		return NextAwaiter(*this);
+	}
+
+	/**
+	 * Ends the stream, an awaiting coroutine is resumed with an empty batch and so is any coroutine awaiting it later.
+	 * Events buffered so far are still returned first.
+	 */
+	void Close() noexcept
+	{
+		std::unique_lock lock(m_Mutex);
+		m_IsClosed = true;
+		Resume(lock);
+	}
+private:
+	// Event buffered with it's paths resolved. The paths are kept as offsets, as the name buffer may grow meanwhile.
+	struct BufferedEvent
+	{
+		EFileAction Action;
+		bool HasPath;
+		bool HasOldPath;
+		bool IsDirectory;
+		uint32_t PathOffset;
+		uint32_t PathLength;
+		uint32_t OldPathOffset;
+		uint32_t OldPathLength;
+		std::error_code Error;
+		FileWatcherFileStatus Status;
+	};
+private:
+	void Push(const FileWatcher& watcher, const std::span<const FileWatcherEvent> events) noexcept
+	{
+		std::unique_lock lock(m_Mutex);
+
+		// Resumed right here with the watcher's own batch, unless buffered events have to be taken first to keep the order
+		if (!m_Scheduler && m_Waiter && m_Buffered.empty())
+		{
+			const std::coroutine_handle<> waiter{ std::exchange(m_Waiter, nullptr) };
+			m_Direct = events;
+			lock.unlock();
+
+			waiter.resume();
+			return;
+		}
+
+		for (const FileWatcherEvent& event : events)
+		{
+			if (m_Buffered.size() >= m_Capacity)
+			{
+				m_IsOverflowPending = true;
+				break;
+			}
+
+			BufferedEvent& buffered{ m_Buffered.emplace_back() };
+			buffered.Action = event.Action;
+			buffered.HasPath = event.DirectoryId != FileWatcherEvent::s_NoDirectory;
+			buffered.HasOldPath = event.OldDirectoryId != FileWatcherEvent::s_NoDirectory;
+			buffered.IsDirectory = event.IsDirectory;
+			buffered.Error = event.Error;
+			buffered.Status = event.Status ? *event.Status : FileWatcherFileStatus{};
+
+			buffered.PathOffset = static_cast<uint32_t>(m_BufferedNames.size());
+			m_BufferedNames.append(watcher.ResolvePath(event.DirectoryId, event.Name, m_PathBuffer));
+			buffered.PathLength = static_cast<uint32_t>(m_BufferedNames.size() - buffered.PathOffset);
+
+			buffered.OldPathOffset = static_cast<uint32_t>(m_BufferedNames.size());
+			m_BufferedNames.append(watcher.ResolvePath(event.OldDirectoryId, event.OldName, m_PathBuffer));
+			buffered.OldPathLength = static_cast<uint32_t>(m_BufferedNames.size() - buffered.OldPathOffset);
+		}
+
+		Resume(lock);
+	}
+
+	/**
+	 * Resumes the awaiting coroutine, if any, through the scheduler. Releases the lock.
+	 */
+	void Resume(std::unique_lock<std::mutex>& lock) noexcept
+	{
+		const std::coroutine_handle<> waiter{ std::exchange(m_Waiter, nullptr) };
+		lock.unlock();
+
+		if (!waiter)
+			return;
+
+		if (m_Scheduler)
+			m_Scheduler([waiter]() { waiter.resume(); });
+		else
+			waiter.resume();
+	}
+
+	[[nodiscard]] std::span<const FileWatcherEvent> Take() noexcept
+	{
+		std::scoped_lock lock(m_Mutex);
+
+		// Resumed from within the callback, the batch is the watcher's own
+		if (!m_Direct.empty())
+			return std::exchange(m_Direct, std::span<const FileWatcherEvent>{});
+
+		// Swapped, so the buffers of the batch taken previously are reused
+		std::swap(m_Buffered, m_Taken);
+		std::swap(m_BufferedNames, m_TakenNames);
+		m_Buffered.clear();
+		m_BufferedNames.clear();
+
+		const FileWatcherStringView names{ m_TakenNames };
+		m_TakenEvents.clear();
+		for (const BufferedEvent& buffered : m_Taken)
+		{
+			m_TakenEvents.push_back(FileWatcherEvent
+			{
+				.Action{ buffered.Action },
+				.DirectoryId{ buffered.HasPath ? FileWatcherEvent::s_ResolvedPath : FileWatcherEvent::s_NoDirectory },
+				.Name{ names.substr(buffered.PathOffset, buffered.PathLength) },
+				.OldDirectoryId{ buffered.HasOldPath ? FileWatcherEvent::s_ResolvedPath : FileWatcherEvent::s_NoDirectory },
+				.OldName{ names.substr(buffered.OldPathOffset, buffered.OldPathLength) },
+				.Error{ buffered.Error },
+				.IsDirectory{ buffered.IsDirectory },
+				.Status{ buffered.Status.Type != std::filesystem::file_type::none ? &buffered.Status : nullptr },
+			});
+		}
+
+		// The discarded events came after the ones buffered
+		if (std::exchange(m_IsOverflowPending, false))
+		{
+			m_TakenEvents.push_back(FileWatcherEvent
+			{
+				.Action{ EFileAction::Overflow },
+				.DirectoryId{ FileWatcherEvent::s_NoDirectory },
+				.Name{},
+				.OldDirectoryId{ FileWatcherEvent::s_NoDirectory },
+				.OldName{},
+				.Error{ std::error_code(static_cast<int>(EFileWatcherError::EventQueueOverflow), FileWatcherCategory()) },
+				.IsDirectory{ false },
+				.Status{ nullptr },
+			});
+		}
+
+		return m_TakenEvents;
+	}
+private:
+	const FileWatcherExecutor m_Scheduler;
+	const size_t m_Capacity;
+
+	std::mutex m_Mutex{};
+	std::coroutine_handle<> m_Waiter{};						// coroutine awaiting the stream, if any.
+	std::span<const FileWatcherEvent> m_Direct{};			// batch of the callback resuming the coroutine.
+	bool m_IsClosed{ false };
+	bool m_IsOverflowPending{ false };
+
+	std::vector<BufferedEvent> m_Buffered{};
+	FileWatcherPathBuffer m_BufferedNames{};
+	FileWatcherPathBuffer m_PathBuffer{};
+
+	// Batch returned to the coroutine, only touched by it
+	std::vector<BufferedEvent> m_Taken{};
+	FileWatcherPathBuffer m_TakenNames{};
+	std::vector<FileWatcherEvent> m_TakenEvents{};
+};
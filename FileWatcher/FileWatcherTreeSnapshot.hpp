@@ -0,0 +1,182 @@
+#pragma once
+#include "FileWatcher.hpp"
+#include <string>
+#include <cstring>
+
+/**
+ * Layout of the snapshot file: the header, the records and the names stored back to back.
+ * Records are stored breadth first, so the entries of a directory are contiguous and sorted by name, and a directory is diffed
+ * against it's live counterpart with a single merge. Every record refers to it's parent by index. Native byte order,
+ * as the snapshot is only read by the machine which wrote it.
+ */
+struct FileWatcherTreeSnapshotHeader
+{
+	char Magic[8];
+	uint32_t Version;
+	uint32_t RecordCount;
+	uint64_t NamesSize;
+	int64_t ListedAt;	// nanoseconds since epoch, when listing the tree began.
+};
+
+struct FileWatcherTreeSnapshotRecord
+{
+	uint64_t Inode;
+	int64_t Size;
+	int64_t ModificationTime;	// nanoseconds since epoch
+	int64_t CreationTime;		// nanoseconds since epoch, zero if the file system doesn't keep it.
+	uint32_t Parent;			// s_NoParent for the observed directory.
+	uint32_t NameOffset;
+	uint32_t FirstChild;
+	uint32_t ChildCount;
+	uint16_t NameLength;
+	uint8_t IsDirectory;
+	uint8_t IsListed;			// zero if the entries of the directory are unknown, as it was excluded or couldn't be listed.
+};
+
+/**
+ * Read only view of a snapshot, either mapped from the file or being built.
+ */
+class FileWatcherTreeSnapshotView
+{
+public:
+	FileWatcherTreeSnapshotView(const FileWatcherTreeSnapshotRecord* records, const uint32_t recordCount, const std::string_view names, const int64_t listedAt) noexcept
+		:
+		m_Records(records),
+		m_RecordCount(recordCount),
+		m_Names(names),
+		m_ListedAt(listedAt)
+	{
+	}
+
+	/**
+	 * Validates the contents of a snapshot file, so a truncated or foreign file can't make the view read out of bounds.
+	 */
+	[[nodiscard]] static std::optional<FileWatcherTreeSnapshotView> Open(const std::byte* data, const size_t size) noexcept
+	{
+		FileWatcherTreeSnapshotHeader header;
+		if (size < sizeof(header))
+			return std::nullopt;
+
+		std::memcpy(&header, data, sizeof(header));
+		if (std::memcmp(header.Magic, s_Magic, sizeof(header.Magic)) != 0 || header.Version != s_Version || header.RecordCount == 0U)
+			return std::nullopt;
+
+		const uint64_t namesOffset{ sizeof(header) + static_cast<uint64_t>(header.RecordCount) * sizeof(FileWatcherTreeSnapshotRecord) };
+		if (namesOffset > size || header.NamesSize != size - namesOffset)
+			return std::nullopt;
+
+		// The records follow a header of a multiple of their alignment, and mapped files are page aligned
+		const FileWatcherTreeSnapshotView view(reinterpret_cast<const FileWatcherTreeSnapshotRecord*>(data + sizeof(header)), header.RecordCount,
+			std::string_view(reinterpret_cast<const char*>(data + namesOffset), header.NamesSize), header.ListedAt);
+
+		// Parents precede their children, so following them always ends at the root
+		for (uint32_t index{ 0U }; index < view.m_RecordCount; ++index)
+		{
+			const FileWatcherTreeSnapshotRecord& record{ view.m_Records[index] };
+			const bool isParentValid{ index == 0U ? record.Parent == s_NoParent : record.Parent < index };
+			const bool areChildrenValid{ record.ChildCount == 0U || (record.FirstChild > index && record.FirstChild <= view.m_RecordCount && record.ChildCount <= view.m_RecordCount - record.FirstChild) };
+
+			if (!isParentValid || !areChildrenValid || static_cast<uint64_t>(record.NameOffset) + record.NameLength > header.NamesSize)
+				return std::nullopt;
+		}
+
+		return view;
+	}
+
+	[[nodiscard]] uint32_t GetSize() const noexcept { return m_RecordCount; }
+	[[nodiscard]] int64_t GetListedAt() const noexcept { return m_ListedAt; }
+	[[nodiscard]] const FileWatcherTreeSnapshotRecord& operator[](const uint32_t index) const noexcept { return m_Records[index]; }
+	[[nodiscard]] std::string_view GetName(const uint32_t index) const noexcept { return m_Names.substr(m_Records[index].NameOffset, m_Records[index].NameLength); }
+
+	/**
+	 * Builds the path of an entry by following it's parents up to the observed directory.
+	 * @param rootPath - Path of the observed directory.
+	 * @param buffer - Receives the path, it's previous contents are replaced.
+	 */
+	void GetPath(uint32_t index, const std::string_view rootPath, std::string& buffer) const noexcept
+	{
+		size_t length{ rootPath.size() };
+		for (uint32_t parent{ index }; parent != 0U; parent = m_Records[parent].Parent)
+			length += m_Records[parent].NameLength + 1U;
+
+		// Filled from the back, as the names are found leaf first
+		buffer.resize(length);
+		std::memcpy(buffer.data(), rootPath.data(), rootPath.size());
+		for (; index != 0U; index = m_Records[index].Parent)
+		{
+			const std::string_view name{ GetName(index) };
+			length -= name.size();
+			std::memcpy(buffer.data() + length, name.data(), name.size());
+			buffer[--length] = '/';
+		}
+	}
+private:
+	const FileWatcherTreeSnapshotRecord* m_Records;
+	uint32_t m_RecordCount;
+	std::string_view m_Names;
+	int64_t m_ListedAt;
+public:
+	constexpr static inline uint32_t s_NoParent{ UINT32_MAX };
+	constexpr static inline char s_Magic[8]{ 'F', 'W', 'T', 'R', 'E', 'E', '\0', '\0' };
+	constexpr static inline uint32_t s_Version{ 1U };
+};
+
+/**
+ * Builds a snapshot while listing the tree. The observed directory is added first, the entries of every directory are added
+ * at once when it's listed, which keeps them contiguous.
+ */
+class FileWatcherTreeSnapshotBuilder
+{
+public:
+	void AddRoot(const uint64_t inode, const int64_t size, const int64_t modificationTime, const int64_t creationTime) noexcept
+	{
+		m_Records.clear();
+		m_Names.clear();
+		m_Records.push_back(FileWatcherTreeSnapshotRecord{ .Inode{ inode }, .Size{ size }, .ModificationTime{ modificationTime }, .CreationTime{ creationTime },
+			.Parent{ FileWatcherTreeSnapshotView::s_NoParent }, .NameOffset{ 0U }, .FirstChild{ 0U }, .ChildCount{ 0U }, .NameLength{ 0U }, .IsDirectory{ 1U }, .IsListed{ 0U } });
+	}
+
+	/**
+	 * Marks the directory as listed, the entries added next are it's entries.
+	 */
+	void BeginDirectory(const uint32_t directory) noexcept
+	{
+		m_Records[directory].FirstChild = static_cast<uint32_t>(m_Records.size());
+		m_Records[directory].IsListed = 1U;
+	}
+
+	/**
+	 * Adds an entry of the directory last begun, in name order. Returns false once the snapshot outgrew it's 32 bit offsets.
+	 */
+	[[nodiscard]] bool AddEntry(const uint32_t directory, const std::string_view name, const uint64_t inode, const int64_t size, const int64_t modificationTime, const int64_t creationTime, const bool isDirectory) noexcept
+	{
+		if (m_Records.size() >= FileWatcherTreeSnapshotView::s_NoParent || m_Names.size() + name.size() > UINT32_MAX || name.size() > UINT16_MAX)
+			return false;
+
+		m_Records.push_back(FileWatcherTreeSnapshotRecord{ .Inode{ inode }, .Size{ size }, .ModificationTime{ modificationTime }, .CreationTime{ creationTime },
+			.Parent{ directory }, .NameOffset{ static_cast<uint32_t>(m_Names.size()) }, .FirstChild{ 0U }, .ChildCount{ 0U }, .NameLength{ static_cast<uint16_t>(name.size()) },
+			.IsDirectory{ static_cast<uint8_t>(isDirectory) }, .IsListed{ 0U } });
+
+		m_Names.append(name);
+		++m_Records[directory].ChildCount;
+		return true;
+	}
+
+	[[nodiscard]] FileWatcherTreeSnapshotView GetView() const noexcept { return FileWatcherTreeSnapshotView(m_Records.data(), static_cast<uint32_t>(m_Records.size()), m_Names, 0); }
+	[[nodiscard]] std::span<const FileWatcherTreeSnapshotRecord> GetRecords() const noexcept { return m_Records; }
+	[[nodiscard]] std::string_view GetNames() const noexcept { return m_Names; }
+
+	[[nodiscard]] FileWatcherTreeSnapshotHeader MakeHeader(const int64_t listedAt) const noexcept
+	{
+		FileWatcherTreeSnapshotHeader header{ .Magic{}, .Version{ FileWatcherTreeSnapshotView::s_Version }, .RecordCount{ static_cast<uint32_t>(m_Records.size()) },
+			.NamesSize{ m_Names.size() }, .ListedAt{ listedAt } };
+
+		std::memcpy(header.Magic, FileWatcherTreeSnapshotView::s_Magic, sizeof(header.Magic));
+		return header;
+	}
+private:
+	std::vector<FileWatcherTreeSnapshotRecord> m_Records{};
+	std::string m_Names{};
+};
+
+static_assert(sizeof(FileWatcherTreeSnapshotHeader) % alignof(FileWatcherTreeSnapshotRecord) == 0U);
@@ -1,310 +1,4875 @@
 #include "FileWatcher.hpp"
+#include "FileWatcherEventQueue.hpp"
+#include "FileWatcherFilter.hpp"
+#include "FileWatcherFingerprints.hpp"
+#include "FileWatcherTreeSnapshot.hpp"
+#include "FileWatcherMetrics.hpp"
 #include <cassert>
+#include <mutex>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <algorithm>
+#include <deque>
+#include <bit>
+#include <bitset>
+#include <memory>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/mman.h>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <condition_variable>
+#include <unordered_set>
+#include <cstring>
+#include <cstdio>
+#if FILEWATCHER_IO_URING && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
 #include <poll.h>
+#include <sys/uio.h>
+#define FILEWATCHER_HAS_IO_URING 1
+#else
+#define FILEWATCHER_HAS_IO_URING 0
+#endif
 
+// Requested no matter which events are reported, as the tree is tracked through them
 constexpr uint32_t s_RootWatcherFlags
 {
-    IN_CREATE           | 
-    IN_DELETE           | 
-    IN_MODIFY           | 
-    IN_MOVED_FROM       | 
-    IN_MOVED_TO         | 
-    IN_DELETE_SELF      | 
+    IN_CREATE           |
+    IN_DELETE           |
+    IN_MOVED_FROM       |
+    IN_MOVED_TO         |
+    IN_DELETE_SELF      |
     IN_MOVE_SELF
 };
 
+// Directory entries listed by the rescan thread before handing them over to the dispatch thread
+constexpr size_t s_RescanBatchSize{ 4096U };
+
+// Timestamp granularity assumed for file systems which don't take them from the kernel's clock, FAT's being the coarsest
+constexpr int64_t s_CoarseSnapshotRacyPeriod{ 2'000'000'000 };
+// Longest racy period saving the snapshot waits out to settle the entries modified right before listing them
+constexpr int64_t s_MaxSnapshotSettlingPeriod{ 100'000'000 };
+
+// Size of the buffer each crawler thread lists directories into
+constexpr size_t s_CrawlBufferSize{ 32768U };
+// Snapshot records per thread diffing the tree against the snapshot
+constexpr size_t s_SnapshotRecordsPerThread{ 4096U };
+// Queued directories per crawler thread before another crawler thread is started
+constexpr size_t s_CrawlTasksPerThread{ 64U };
+
+constexpr uint64_t s_FanotifyWatcherFlags
+{
+    FAN_CREATE          |
+    FAN_DELETE          |
+    FAN_ONDIR
+};
+
+// Kernel events reporting the actions subscribed to beyond those tracking the tree, for inotify and fanotify
+[[nodiscard]] static uint32_t GetWatchFlags(const FileWatcherOptions& options) noexcept
+{
+    const EFileWatcherEventMask eventMask{ options.EventMask };
+    const auto isSubscribed{ [eventMask](const EFileWatcherEventMask subscription) noexcept { return (eventMask & subscription) != EFileWatcherEventMask::None; } };
+
+    uint32_t flags{ s_RootWatcherFlags };
+    flags |= isSubscribed(EFileWatcherEventMask::Modified) ? IN_MODIFY : 0U;
+    // Fingerprinted modifications are held back until the file is closed
+    flags |= isSubscribed(EFileWatcherEventMask::CloseWrite) || (options.MaxFingerprints > 0U && isSubscribed(EFileWatcherEventMask::Modified)) ? IN_CLOSE_WRITE : 0U;
+    // Touching a file changes it's modification time, which the snapshot records
+    flags |= isSubscribed(EFileWatcherEventMask::AttributeChanged) || !options.SnapshotPath.empty() ? IN_ATTRIB : 0U;
+    flags |= isSubscribed(EFileWatcherEventMask::Opened) ? IN_OPEN : 0U;
+    flags |= isSubscribed(EFileWatcherEventMask::Accessed) ? IN_ACCESS : 0U;
+    // Tells when the accesses of the watcher itself are over
+    flags |= isSubscribed(EFileWatcherEventMask::Opened | EFileWatcherEventMask::Accessed) ? IN_CLOSE_NOWRITE : 0U;
+    return flags;
+}
+
+[[nodiscard]] static uint64_t GetFanotifyFlags(const FileWatcherOptions& options) noexcept
+{
+    const EFileWatcherEventMask eventMask{ options.EventMask };
+    const auto isSubscribed{ [eventMask](const EFileWatcherEventMask subscription) noexcept { return (eventMask & subscription) != EFileWatcherEventMask::None; } };
+
+    uint64_t flags{ s_FanotifyWatcherFlags };
+    flags |= isSubscribed(EFileWatcherEventMask::Modified) ? FAN_MODIFY : 0U;
+    flags |= isSubscribed(EFileWatcherEventMask::CloseWrite) || (options.MaxFingerprints > 0U && isSubscribed(EFileWatcherEventMask::Modified)) ? FAN_CLOSE_WRITE : 0U;
+    flags |= isSubscribed(EFileWatcherEventMask::AttributeChanged) ? FAN_ATTRIB : 0U;
+    flags |= isSubscribed(EFileWatcherEventMask::Opened) ? FAN_OPEN : 0U;
+    flags |= isSubscribed(EFileWatcherEventMask::Accessed) ? FAN_ACCESS : 0U;
+    flags |= isSubscribed(EFileWatcherEventMask::Opened | EFileWatcherEventMask::Accessed) ? FAN_CLOSE_NOWRITE : 0U;
+    return flags;
+}
+
+// Only the observed directory itself is marked for these
+constexpr uint64_t s_FanotifyRootFlags
+{
+    FAN_DELETE_SELF     |
+    FAN_MOVE_SELF       |
+    FAN_ONDIR
+};
+
+// Resolved directories cached before the cache is started over, which keeps the memory bounded no matter how large the file system is
+constexpr size_t s_MaxFanotifyDirectories{ 65536U };
+// Directory ids are reused after this many, which keeps the directory table dense. The directories resolved this many ids ago
+// were retired and released by several invalidations of the cache meanwhile.
+constexpr uint32_t s_FanotifyDirectoryIdCount{ 4U * s_MaxFanotifyDirectories };
+// Metadata and two directory records of a rename, each with a handle and a name
+constexpr size_t s_MaxFanotifyEventSize{ sizeof(fanotify_event_metadata) + 2U * (sizeof(fanotify_event_info_fid) + sizeof(file_handle) + MAX_HANDLE_SZ + NAME_MAX + 1U) };
+
+/**
+ * Map keyed by watch descriptor. The kernel hands out descriptors as small increasing integers, so the values are kept in pages
+ * of consecutive descriptors indexed directly, and a lookup is two loads rather than hashing and chasing a node. Pages are
+ * allocated on first use and released once their last value is erased, as the descriptors of a long running instance keep
+ * increasing while the directories come and go.
+ */
+template<typename Value>
+class FileWatcherDescriptorMap
+{
+public:
+    [[nodiscard]] Value* Find(const int descriptor) noexcept
+    {
+        const size_t page{ static_cast<size_t>(descriptor) >> s_PageShift };
+        if(descriptor < 0 || page >= m_Pages.size() || !m_Pages[page] || !m_Pages[page]->IsUsed[descriptor & s_PageMask])
+            return nullptr;
+
+        return &m_Pages[page]->Values[descriptor & s_PageMask];
+    }
+
+    [[nodiscard]] const Value* Find(const int descriptor) const noexcept
+    {
+        return const_cast<FileWatcherDescriptorMap*>(this)->Find(descriptor);
+    }
+
+    /**
+     * Returns the value of the descriptor, default constructed if there is none yet.
+     */
+    Value& operator[](const int descriptor) noexcept
+    {
+        assert(descriptor >= 0);
+
+        const size_t page{ static_cast<size_t>(descriptor) >> s_PageShift };
+        if(page >= m_Pages.size())
+            m_Pages.resize(page + 1U);
+
+        if(!m_Pages[page])
+            m_Pages[page] = std::make_unique<Page>();
+
+        Page& values{ *m_Pages[page] };
+        if(!values.IsUsed[descriptor & s_PageMask])
+        {
+            values.IsUsed[descriptor & s_PageMask] = true;
+            ++values.UsedCount;
+            ++m_Size;
+        }
+
+        return values.Values[descriptor & s_PageMask];
+    }
+
+    void Erase(const int descriptor) noexcept
+    {
+        const size_t page{ static_cast<size_t>(descriptor) >> s_PageShift };
+        if(descriptor < 0 || page >= m_Pages.size() || !m_Pages[page] || !m_Pages[page]->IsUsed[descriptor & s_PageMask])
+            return;
+
+        Page& values{ *m_Pages[page] };
+        values.IsUsed[descriptor & s_PageMask] = false;
+        values.Values[descriptor & s_PageMask] = Value{};
+        --m_Size;
+
+        if(--values.UsedCount != 0U)
+            return;
+
+        m_Pages[page].reset();
+        while(!m_Pages.empty() && !m_Pages.back())
+            m_Pages.pop_back();
+    }
+
+    void Clear() noexcept
+    {
+        m_Pages.clear();
+        m_Size = 0U;
+    }
+
+    [[nodiscard]] size_t GetSize() const noexcept { return m_Size; }
+    [[nodiscard]] bool IsEmpty() const noexcept { return m_Size == 0U; }
+
+    /**
+     * Visits the values in descriptor order.
+     */
+    template<typename Function>
+    void ForEach(Function&& function) noexcept
+    {
+        for(size_t page{ 0U }; page < m_Pages.size(); ++page)
+        {
+            if(!m_Pages[page])
+                continue;
+
+            for(size_t index{ 0U }; index < s_PageSize; ++index)
+                if(m_Pages[page]->IsUsed[index])
+                    function(static_cast<int>((page << s_PageShift) | index), m_Pages[page]->Values[index]);
+        }
+    }
+
+    template<typename Function>
+    void ForEach(Function&& function) const noexcept
+    {
+        const_cast<FileWatcherDescriptorMap*>(this)->ForEach([&function](const int descriptor, const Value& value) noexcept { function(descriptor, value); });
+    }
+private:
+    constexpr static inline size_t s_PageShift{ 9U };
+    constexpr static inline size_t s_PageSize{ size_t{ 1U } << s_PageShift };
+    constexpr static inline size_t s_PageMask{ s_PageSize - 1U };
+
+    struct Page
+    {
+        std::array<Value, s_PageSize> Values{};
+        std::bitset<s_PageSize> IsUsed{};
+        size_t UsedCount{ 0U };
+    };
+private:
+    std::vector<std::unique_ptr<Page>> m_Pages{};
+    size_t m_Size{ 0U };
+};
+
+#if FILEWATCHER_HAS_IO_URING
+/**
+ * Minimal io_uring driven through the raw system calls, as the dispatch thread only needs a handful of operations in flight.
+ * Submitting and waiting for completions takes a single system call.
+ */
+class FileWatcherRing
+{
+public:
+    FileWatcherRing() noexcept = default;
+    FileWatcherRing(const FileWatcherRing&) = delete;
+    FileWatcherRing& operator=(const FileWatcherRing&) = delete;
+    ~FileWatcherRing() noexcept;
+
+    /**
+     * Creates the ring. Returns false if the kernel doesn't provide io_uring, it's disabled or lacks a feature the ring relies on.
+     */
+    [[nodiscard]] bool Setup(const unsigned entries) noexcept;
+    [[nodiscard]] bool IsSetUp() const noexcept { return m_Ring != -1; }
+
+    /**
+     * Registers the buffer fixed reads go to, replacing the one registered before. Returns false if it can't be pinned.
+     */
+    [[nodiscard]] bool RegisterBuffer(std::byte* buffer, const size_t size) noexcept;
+    [[nodiscard]] bool IsRegistered(const std::byte* buffer, const size_t size) const noexcept { return m_RegisteredBuffer == buffer && m_RegisteredSize == size; }
+    [[nodiscard]] bool HasRegisteredBuffer() const noexcept { return m_RegisteredBuffer != nullptr; }
+
+    /**
+     * Returns a cleared submission queue entry, submitted with the next SubmitAndWait. Null if the queue is full.
+     */
+    [[nodiscard]] io_uring_sqe* GetSubmission() noexcept;
+
+    /**
+     * Submits the entries queued so far and waits for a completion, or until the timeout passes.
+     * @param timeout - Milliseconds to wait, or -1 to wait indefinitely.
+     * Returns zero, or the negated error code.
+     */
+    [[nodiscard]] int SubmitAndWait(const int timeout) noexcept;
+
+    template<typename Function>
+    void ForEachCompletion(Function&& function) noexcept
+    {
+        unsigned head{ *m_CompletionHead };
+        const unsigned tail{ std::atomic_ref<unsigned>(*m_CompletionTail).load(std::memory_order_acquire) };
+
+        for(; head != tail; ++head)
+            function(m_Completions[head & *m_CompletionMask]);
+
+        std::atomic_ref<unsigned>(*m_CompletionHead).store(head, std::memory_order_release);
+    }
+private:
+    void Reset() noexcept;
+private:
+    int m_Ring{ -1 };
+    void* m_Rings{ MAP_FAILED };
+    size_t m_RingsSize{ 0U };
+    io_uring_sqe* m_Submissions{ static_cast<io_uring_sqe*>(MAP_FAILED) };
+    size_t m_SubmissionsSize{ 0U };
+
+    unsigned* m_SubmissionHead{ nullptr };
+    unsigned* m_SubmissionTail{ nullptr };
+    unsigned* m_SubmissionMask{ nullptr };
+    unsigned* m_SubmissionArray{ nullptr };
+    unsigned m_SubmissionCount{ 0U };
+    unsigned m_QueuedSubmissions{ 0U };     // entries handed out since the last submission.
+
+    unsigned* m_CompletionHead{ nullptr };
+    unsigned* m_CompletionTail{ nullptr };
+    unsigned* m_CompletionMask{ nullptr };
+    io_uring_cqe* m_Completions{ nullptr };
+
+    const std::byte* m_RegisteredBuffer{ nullptr };
+    size_t m_RegisteredSize{ 0U };
+};
+#endif
+
+/**
+ * Process-wide watch reactor. All file watchers share a single inotify instance and a single epoll driven
+ * dispatch thread, which routes every event to the watchers subscribed to its watch descriptor.
+ * Watchers observing overlapping trees share the kernel watch, as inotify returns the same descriptor for the same inode.
+ */
+class FileWatcherReactor
+{
+public:
+    FileWatcherReactor(const FileWatcherReactor&) = delete;
+    FileWatcherReactor& operator=(const FileWatcherReactor&) = delete;
+
+    FileWatcherReactor() noexcept = default;
+    ~FileWatcherReactor() noexcept;
+
+    /**
+     * Returns the process-wide reactor, creating it if no watcher currently holds it.
+     * @param error - error code, populated on failure.
+     */
+    [[nodiscard]] static std::shared_ptr<FileWatcherReactor> Acquire(std::error_code& error) noexcept;
+
+    /**
+     * Locks the subscriber table. Dispatch is suspended while the lock is held,
+     * so a watcher can register a watch descriptor and its path atomically.
+     */
+    [[nodiscard]] std::unique_lock<std::recursive_mutex> Lock() noexcept { return std::unique_lock<std::recursive_mutex>(m_Mutex); }
+
+    /**
+     * Registers the watcher for notifications concerning all watchers, such as queue overflows.
+     */
+    void Register(FileWatcher* watcher) noexcept;
+
+    /**
+     * Adds a watch on the path (or shares an existing one) and subscribes the watcher to it.
+     * Returns the watch descriptor, or -1 and populates the error code on failure.
+     */
+    [[nodiscard]] int AddWatch(FileWatcher* watcher, const char* path, const uint32_t flags, std::error_code& error) noexcept;
+
+    /**
+     * Unsubscribes the watcher from the watch descriptor. The kernel watch is removed once no watcher is subscribed,
+     * and narrowed to the events the remaining watchers request otherwise.
+     */
+    void ReleaseWatch(FileWatcher* watcher, const int watchDescriptor) noexcept;
+    void ReleaseWatches(FileWatcher* watcher, const std::span<const int> watchDescriptors) noexcept;
+
+    /**
+     * Releases every watch held by the watcher. No events are routed to the watcher once this returns,
+     * which waits for the watcher's callback if the dispatch thread is running it, unless called by the dispatch thread itself.
+     */
+    void Unregister(FileWatcher* watcher) noexcept;
+
+    /**
+     * Routes the events of a fanotify group owned by the watcher to FileWatcher::ProcessFanotifyEvents.
+     * The group is read on the dispatch thread until the watcher is unregistered, only then the watcher may close it.
+     */
+    void AddSource(FileWatcher* watcher, const int fileDescriptor, std::error_code& error) noexcept;
+
+    /**
+     * Invokes FileWatcher::ProcessTimers on the dispatch thread once the deadline has passed.
+     */
+    void ScheduleTimer(FileWatcher* watcher, const std::chrono::steady_clock::time_point deadline) noexcept;
+
+    /**
+     * Runs the task on the dispatch thread, unless the watcher is unregistered by then. Safe to call from any thread.
+     */
+    void Post(FileWatcher* watcher, std::function<void()>&& task) noexcept;
+
+    /**
+     * Raises the initial and maximum event buffer size to at least the requested values.
+     */
+    void ReserveWatchBuffer(const size_t watchBufferSize, const size_t maxWatchBufferSize) noexcept;
+
+    /**
+     * Keeps reading until the event queue is empty, after which the names reported by scanning new directories are forgotten.
+     */
+    void MarkScanned() noexcept { m_IsScanPending = true; }
+
+    [[nodiscard]] FileWatcherStats GetStats() const noexcept;
+private:
+    struct PostedTask
+    {
+        FileWatcher* Watcher;
+        std::function<void()> Task;
+    };
+
+    struct Timer
+    {
+        std::chrono::steady_clock::time_point Deadline;
+        FileWatcher* Watcher;
+
+        [[nodiscard]] bool operator>(const Timer& other) const noexcept { return Deadline > other.Deadline; }
+    };
+
+    void Start(std::error_code& error) noexcept;
+    void DispatchThreadWork() noexcept;
+
+    /**
+     * Reads the event queue until it's empty.
+     * @param reads - Reads already performed during this wakeup.
+     */
+    [[nodiscard]] bool DrainEvents(uint64_t reads) noexcept;
+
+    /**
+     * Dispatches the events of a read into the watch buffer. Returns true if more events might be queued.
+     */
+    [[nodiscard]] bool DispatchRead(const size_t length) noexcept;
+    void CollectReadyEvents(const epoll_event* readyEvents, const int readyCount, bool& readAvailable) noexcept;
+#if FILEWATCHER_HAS_IO_URING
+    /**
+     * Waits on the ring rather than epoll. The inotify instance is read by a read linked to a poll of it, so a wakeup takes a single
+     * system call to submit the next read and wait for it. The epoll instance is only polled for the wakeup event and fanotify groups.
+     */
+    void RingThreadWork() noexcept;
+
+    /**
+     * Queues the next read of the inotify instance and poll of the epoll instance, unless they are still in flight.
+     */
+    void ArmRing() noexcept;
+
+    /**
+     * Cancels the requests in flight and waits for them to complete, so the watch buffer is no longer read into.
+     */
+    void CancelRing() noexcept;
+#endif
+    void DrainSource(const int fileDescriptor) noexcept;
+    void DispatchEvents(const std::byte* watchBuffer, const int length) noexcept;
+    void ExpireTimers() noexcept;
+    void RunPostedTasks() noexcept;
+    void Broadcast(const std::error_code& error) noexcept;
+    void ForgetScannedNames() noexcept;
+
+    /**
+     * Collects the events each watcher queued into it's next batch, a watcher gets a single callback per read.
+     */
+    void FlushWatchers() noexcept;
+
+    /**
+     * Invokes the callbacks with the collected batches, then unregisters the watchers which stopped. Called by the dispatch thread without holding the lock,
+     * which is only taken in between the callbacks. A watcher unregistered meanwhile isn't delivered to anymore.
+     */
+    void DeliverWatchers() noexcept;
+    [[nodiscard]] int NextTimeout() noexcept;
+    [[nodiscard]] bool IsSubscribed(const FileWatcher* watcher, const int watchDescriptor) const noexcept;
+
+    /**
+     * Replaces the events requested by the watch, which adding a watch only ever extends.
+     * @param path - Current path of the watched directory.
+     */
+    void NarrowWatch(const int watchDescriptor, const std::string_view path, const uint32_t flags) noexcept;
+private:
+    int m_InotifyInstance{ -1 };
+    int m_EpollInstance{ -1 };
+    int m_WakeupEvent{ -1 };                    // eventfd used to wake the dispatch thread on shutdown, a new timer or a posted task.
+    std::atomic<bool> m_IsRunning{ false };
+    std::thread m_DispatchThread{};
+
+    std::recursive_mutex m_Mutex{};             // recursive, as watchers add watches from within dispatch.
+    std::vector<FileWatcher*> m_Watchers{};
+    FileWatcherDescriptorMap<std::vector<FileWatcher*>> m_Subscribers{};    // watch descriptor -> subscribed watchers
+    std::unordered_map<int, FileWatcher*> m_Sources{};                      // fanotify group -> owning watcher
+    std::vector<int> m_ReadySources{};
+    std::vector<FileWatcher*> m_DispatchScratch{};
+    std::vector<FileWatcher*> m_StoppedWatchers{};
+    std::vector<FileWatcher*> m_Deliveries{};   // watchers with a collected batch, in the order they're delivered.
+    FileWatcher* m_DeliveringWatcher{ nullptr };    // watcher whose callback the dispatch thread is running.
+    std::condition_variable_any m_DeliveryFinished{};   // notified whenever a callback returns, unregistering waits for the watcher's.
+    std::vector<Timer> m_Timers{};              // min-heap ordered by deadline.
+    uint64_t m_Generation{ 0U };                // bumped whenever a subscription is dropped.
+
+    std::mutex m_PostedTasksMutex{};            // separate from m_Mutex, so posting never waits for dispatch.
+    std::vector<PostedTask> m_PostedTasks{};
+    std::vector<PostedTask> m_RunningTasks{};
+
+    std::vector<std::byte> m_WatchBuffer{};     // only touched by the dispatch thread.
+    std::vector<std::byte> m_SourceBuffer{};    // fanotify groups are read apart, as a read of the inotify instance may be in flight meanwhile.
+    bool m_IsScanPending{ false };              // a watcher scanned a new directory since the queue was last empty.
+    std::atomic<size_t> m_WatchBufferSize{ 0U };
+    std::atomic<size_t> m_MaxWatchBufferSize{ 0U };
+
+    // Only written by the dispatch thread
+    FileWatcherCounter m_Wakeups{};
+    FileWatcherCounter m_Reads{};
+    FileWatcherCounter m_ReadBytes{};
+    FileWatcherCounter m_LongestDrain{};
+    FileWatcherCounter m_BufferGrowths{};
+    FileWatcherCounter m_Syscalls{};
+    FileWatcherCounter m_Events{};
+    FileWatcherHistogramRecorder m_BytesPerRead{};
+    FileWatcherHistogramRecorder m_EventsPerRead{};
+
+#if FILEWATCHER_HAS_IO_URING
+    // Destroyed before the watch buffer it reads into. Only used by the dispatch thread once set up.
+    FileWatcherRing m_Ring{};
+    bool m_IsReadPending{ false };
+    bool m_IsPollPending{ false };
+    bool m_CanRegisterBuffer{ true };           // cleared once registering failed, such as over the locked memory limit.
+#endif
+private:
+    constexpr static inline size_t s_MaxEventSize{ sizeof(inotify_event) + NAME_MAX + 1U };
+    constexpr static inline int s_MaxReadyEvents{ 16 };
+#if FILEWATCHER_HAS_IO_URING
+    constexpr static inline unsigned s_RingEntries{ 8U };
+
+    // Completions of the ring, told apart by their user data
+    constexpr static inline uint64_t s_InotifyPollTag{ 1U };
+    constexpr static inline uint64_t s_InotifyReadTag{ 2U };
+    constexpr static inline uint64_t s_EpollPollTag{ 3U };
+    constexpr static inline uint64_t s_CancelTag{ 4U };
+#endif
+};
+
+struct FileWatcherPendingRename
+{
+    uint32_t Cookie;
+    int OldWatchDescriptor;
+    uint32_t OldNameLength;
+    std::array<char, NAME_MAX + 1U> OldName;    // stored inline, so pairing a move never allocates.
+    std::chrono::steady_clock::time_point Deadline;
+    bool IsDirectory;
+
+    [[nodiscard]] std::string_view GetOldName() const noexcept { return std::string_view(OldName.data(), OldNameLength); }
+};
+
+struct FileWatcherSnapshotEntry
+{
+    uint64_t Inode{ 0U };
+    int64_t Size{ 0 };
+    int64_t ModificationTime{ 0 };  // nanoseconds since epoch
+    int64_t CreationTime{ 0 };      // nanoseconds since epoch, zero if the file system doesn't keep it.
+    bool IsDirectory{ false };
+
+    [[nodiscard]] bool operator==(const FileWatcherSnapshotEntry&) const noexcept = default;
+};
+
+// Allows looking names up by view, so updating a known entry doesn't allocate
+struct FileWatcherNameHash
+{
+    using is_transparent = void;
+
+    [[nodiscard]] size_t operator()(const std::string_view name) const noexcept { return std::hash<std::string_view>{}(name); }
+};
+
+// name -> last known state of the entry
+using FileWatcherDirectorySnapshot = std::unordered_map<std::string, FileWatcherSnapshotEntry, FileWatcherNameHash, std::equal_to<>>;
+
+struct FileWatcherDirectoryListing
+{
+    int WatchDescriptor;
+    std::filesystem::path Path;
+    bool Exists;
+    std::vector<std::pair<std::string, FileWatcherSnapshotEntry>> Entries;
+};
+
+// Snapshot file mapped read only while it's diffed against the tree. Saving renames a new file over it rather than truncating it,
+// so the mapping stays valid even if the snapshot is saved meanwhile.
+struct FileWatcherMappedFile
+{
+    FileWatcherMappedFile(const FileWatcherMappedFile&) = delete;
+    FileWatcherMappedFile& operator=(const FileWatcherMappedFile&) = delete;
+
+    FileWatcherMappedFile(const char* path, std::error_code& error) noexcept
+    {
+        const int file{ open(path, O_RDONLY | O_CLOEXEC) };
+        if(file == -1)
+        {
+            // There's nothing to catch up on before the first snapshot is written
+            if(errno != ENOENT)
+                error.assign(errno, std::system_category());
+
+            return;
+        }
+
+        Exists = true;
+
+        struct stat status;
+        if(fstat(file, &status) == 0 && status.st_size > 0)
+        {
+            void* const data{ mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0) };
+            if(data != MAP_FAILED)
+            {
+                Data = static_cast<const std::byte*>(data);
+                Size = static_cast<size_t>(status.st_size);
+            }
+            else
+                error.assign(errno, std::system_category());
+        }
+
+        close(file);
+    }
+
+    ~FileWatcherMappedFile() noexcept
+    {
+        if(Data)
+            munmap(const_cast<std::byte*>(Data), Size);
+    }
+
+    bool Exists{ false };
+    const std::byte* Data{ nullptr };
+    size_t Size{ 0U };
+};
+
+// Entry found on one side of the snapshot diff only. Once every directory is diffed, it's either a rename or a deletion or creation.
+struct FileWatcherSnapshotCandidate
+{
+    std::string Path;
+    uint32_t Index;                     // record of a deleted entry.
+    FileWatcherSnapshotEntry Entry;     // current state of a created entry.
+    bool IsPaired{ false };
+};
+
+struct FileWatcherCaughtUpEvent
+{
+    EFileAction Action;
+    std::string Path;
+    std::string OldPath{};              // only set if renamed.
+    std::error_code Error{};
+    bool IsDirectory{ false };
+};
+
+// Entries of a directory as last listed, sorted by name. The directory is told apart from another one replacing it by it's inode and creation time.
+struct FileWatcherSnapshotListing
+{
+    uint64_t Inode{ 0U };
+    int64_t CreationTime{ 0 };
+    std::vector<std::pair<std::string, FileWatcherSnapshotEntry>> Entries{};
+};
+
+// Results of diffing directories, kept per thread until every directory is diffed
+struct FileWatcherSnapshotDiff
+{
+    std::unique_ptr<std::byte[]> Buffer{};
+    // Subdirectories found by the directory last diffed
+    std::vector<std::pair<uint32_t, std::string>> PendingDirectories{};
+    std::vector<FileWatcherSnapshotCandidate> Deleted{};
+    std::vector<FileWatcherSnapshotCandidate> Created{};
+    std::vector<FileWatcherCaughtUpEvent> Events{};
+    // Entries of the directory being diffed, sorted by name like the records
+    std::vector<std::pair<std::string, FileWatcherSnapshotEntry>> Entries{};
+    // Relative path -> entries of every directory diffed, which saving the snapshot starts from
+    std::vector<std::pair<std::string, FileWatcherSnapshotListing>> Listings{};
+    // Entries modified within this period before the snapshot was listed are compared as changed
+    int64_t RacyPeriod{ s_CoarseSnapshotRacyPeriod };
+};
+
+struct FileWatcherSnapshotCatchUp
+{
+    FileWatcherTreeSnapshotView Snapshot;
+    int64_t RacyPeriod{ s_CoarseSnapshotRacyPeriod };
+    std::mutex Mutex{};
+    std::condition_variable Condition{};
+    // Record of the directory -> it's path now, for directories waiting to be diffed
+    std::vector<std::pair<uint32_t, std::string>> PendingDirectories{};
+    size_t BusyThreads{ 0U };
+    // Merged results of every thread
+    FileWatcherSnapshotDiff Result{};
+};
+
+// Path relative to the observed directory -> it's listing
+using FileWatcherSnapshotListings = std::unordered_map<std::string, FileWatcherSnapshotListing, FileWatcherNameHash, std::equal_to<>>;
+
+struct FileWatcherSnapshotState
+{
+    // Held while saving. Events tell which directories changed since they were listed, only those are listed again.
+    std::mutex SaveMutex{};
+    FileWatcherSnapshotListings Listings{};
+    // Relative paths of the directories events were read for, and whether events were lost, since the snapshot was last saved
+    std::mutex ChangesMutex{};
+    std::unordered_set<std::string, FileWatcherNameHash, std::equal_to<>> ChangedDirectories{};
+    bool IsEverythingChanged{ false };
+    // Catches up on the previous snapshot and saves the new one once the tree is watched, so neither holds back the setup
+    std::mutex WorkerMutex{};
+    std::thread Worker{};
+    std::atomic<bool> IsCancelled{ false };
+    std::atomic<bool> IsCaughtUp{ false };
+};
+
+struct FileWatcherRescan
+{
+    std::mutex Mutex{};
+    // Directories waiting to be listed
+    std::deque<std::pair<int, std::filesystem::path>> PendingDirectories{};
+    bool IsRunning{ false };
+    bool IsCancelled{ false };
+    std::thread Worker{};
+};
+
+// Directory kept open while it's subdirectories wait to be registered, so they're opened relative to it.
+struct FileWatcherDirectoryHandle
+{
+    FileWatcherDirectoryHandle(const FileWatcherDirectoryHandle&) = delete;
+    FileWatcherDirectoryHandle& operator=(const FileWatcherDirectoryHandle&) = delete;
+
+    explicit FileWatcherDirectoryHandle(const int fileDescriptor) noexcept : FileDescriptor{ fileDescriptor } {}
+    ~FileWatcherDirectoryHandle() noexcept { close(FileDescriptor); }
+
+    int FileDescriptor;
+};
+
+struct FileWatcherCrawlTask
+{
+    std::shared_ptr<FileWatcherDirectoryHandle> Parent;     // null for the root.
+    int ParentWatchDescriptor;                              // -1 for the root, which is watched before the crawl starts.
+    std::string Path;
+    size_t NameOffset;                                      // name of the directory within the path.
+};
+
+struct alignas(64) FileWatcherCrawlQueue
+{
+    std::mutex Mutex{};
+    // The owner takes from the back, other crawler threads steal from the front
+    std::deque<FileWatcherCrawlTask> Tasks{};
+};
+
+struct FileWatcherCrawl
+{
+    // Wakes the idle crawler threads, after a task was queued or finished or the crawl was cancelled
+    void NotifyChanged() noexcept
+    {
+        Changes.fetch_add(1U, std::memory_order_release);
+        Changes.notify_all();
+    }
+
+    void Cancel() noexcept
+    {
+        IsCancelled = true;
+        NotifyChanged();
+    }
+
+    std::vector<std::unique_ptr<FileWatcherCrawlQueue>> Queues{};   // one per crawler thread, allocated up front.
+    std::atomic<size_t> PendingTasks{ 0U };                          // queued or being crawled.
+    std::atomic<uint32_t> Changes{ 0U };                             // idle crawler threads wait for it to change, it's value is meaningless.
+    std::atomic<size_t> ActiveThreads{ 0U };
+    std::atomic<bool> IsCancelled{ false };
+
+    std::mutex Mutex{};
+    std::vector<std::thread> Workers{};
+    std::error_code Error{};                                        // first failure of a synchronous setup.
+};
+
+/**
+ * Paths of the directories a watcher observes, keyed by watch descriptor. Subdirectories are stored as a tree, each refers to
+ * it's parent and keeps it's own name, so renaming a directory relinks a single entry however many directories are inside it.
+ * Directories without a parent, such as the observed one, keep their full path. The names are interned back to back in a single
+ * arena, events only carry the descriptor and the full path is built when the consumer asks for it.
+ */
+class FileWatcherDirectoryTable
+{
+public:
+    /**
+     * Interns the path of a watched directory, replacing the previous path of the descriptor.
+     */
+    void Insert(const int watchDescriptor, const std::string_view path) noexcept;
+
+    /**
+     * Interns a watched directory by it's parent and name, replacing the previous path of the descriptor.
+     * Directories within it follow it, which is how a moved directory is relinked.
+     */
+    void Insert(const int watchDescriptor, const int parentWatchDescriptor, const std::string_view name) noexcept;
+
+    /**
+     * Stops tracking the directory as watched. It's path stays resolvable until ReleaseRetired,
+     * as queued events or pending renames may still refer to it. So does the directory itself
+     * as long as the directories within it do.
+     */
+    void Retire(const int watchDescriptor) noexcept;
+    void RetireAll() noexcept;
+    void ReleaseRetired() noexcept;
+    void Clear() noexcept;
+
+    /**
+     * Returns the path of a watched or retired directory. The view is invalidated by the next lookup or modification of the table.
+     */
+    [[nodiscard]] std::optional<std::string_view> Find(const int watchDescriptor) const noexcept;
+    [[nodiscard]] bool Contains(const int watchDescriptor) const noexcept { return m_Entries.Find(watchDescriptor) != nullptr; }
+    [[nodiscard]] bool IsWatched(const int watchDescriptor) const noexcept;
+    [[nodiscard]] size_t GetWatchedCount() const noexcept { return m_Entries.GetSize() - m_Retired.size(); }
+
+    /**
+     * Returns true if the directory is stored as the entry of the given name in the parent.
+     */
+    [[nodiscard]] bool IsEntryOf(const int watchDescriptor, const int parentWatchDescriptor, const std::string_view name) const noexcept;
+
+    /**
+     * Returns true if the directory is the ancestor or within it.
+     */
+    [[nodiscard]] bool IsWithin(const int watchDescriptor, const int ancestorWatchDescriptor) const noexcept;
+
+    /**
+     * Collects the watched directories within the ancestor and the ancestor itself, in a single pass over the table.
+     */
+    void CollectSubtree(const int ancestorWatchDescriptor, std::vector<int>& watchDescriptors) const noexcept;
+    void CollectWatched(std::vector<int>& watchDescriptors) const noexcept;
+
+    /**
+     * Visits the watched directories. The path passed along is invalidated by the next lookup.
+     */
+    template<typename Function>
+    void ForEachWatched(Function&& function) const noexcept
+    {
+        m_Entries.ForEach([this, &function](const int watchDescriptor, const Entry& entry) noexcept
+        {
+            if(!entry.IsRetired)
+                function(watchDescriptor, *Find(watchDescriptor));
+        });
+    }
+private:
+    struct Entry
+    {
+        int Parent;                 // s_NoParent if the name is the full path.
+        uint32_t Offset;
+        uint32_t Length : 31;
+        uint32_t IsRetired : 1;
+        uint32_t ChildCount;        // entries referring to this one as their parent, which keep it from being released.
+    };
+
+    void Link(const int watchDescriptor, const int parentWatchDescriptor, const std::string_view name) noexcept;
+    void Unlink(const Entry& entry) noexcept;
+    void Erase(const int watchDescriptor) noexcept;
+    void Compact() noexcept;
+    [[nodiscard]] std::string_view GetName(const Entry& entry) const noexcept { return std::string_view(m_Arena).substr(entry.Offset, entry.Length); }
+private:
+    std::string m_Arena{};
+    FileWatcherDescriptorMap<Entry> m_Entries{};
+    std::vector<int> m_Retired{};
+    size_t m_UnusedBytes{ 0U };                 // bytes of the arena no entry refers to anymore.
+
+    // Path last built by Find, directories see many events in a row
+    mutable std::string m_PathBuffer{};
+    mutable int m_BuiltWatchDescriptor{ s_NoParent };
+private:
+    constexpr static inline size_t s_MinCompactedSize{ 4096U };
+    constexpr static inline int s_NoParent{ -1 };
+};
+
+struct FileWatcherFanotify
+{
+    FileWatcherFanotify() noexcept = default;
+    FileWatcherFanotify(const FileWatcherFanotify&) = delete;
+    FileWatcherFanotify& operator=(const FileWatcherFanotify&) = delete;
+
+    ~FileWatcherFanotify() noexcept
+    {
+        if(Instance != -1)
+            close(Instance);
+
+        if(MountDirectory != -1)
+            close(MountDirectory);
+    }
+
+    int Instance{ -1 };
+    // Mount point of the observed file system, which file handles are opened relative to.
+    // The observed directory itself isn't kept open, as that would hold back it's deletion event.
+    int MountDirectory{ -1 };
+    std::string RootHandle{};
+    // Resolved path of the observed directory, events are reported relative to the path as it was given though.
+    std::string RootPath{};
+    std::string ObservedPath{};
+    uint32_t RootDirectoryId{ FileWatcherEvent::s_NoDirectory };
+    uint32_t NextDirectoryId{ 0U };
+    // Both ends of a move are reported by a single event, only older kernels report them separately.
+    bool HasRenameEvents{ false };
+    // File handle -> directory id, FileWatcherEvent::s_NoDirectory for directories outside of the observed tree.
+    std::unordered_map<std::string, uint32_t, FileWatcherNameHash, std::equal_to<>> DirectoryIds{};
+};
+
+/**
+ * Subdirectory moved within the tree, waiting for the kernel to report which watch moved.
+ */
+struct FileWatcherDirectoryMove
+{
+    int OldParent;
+    std::string OldName;
+    int Parent;
+    std::string Name;
+    std::chrono::steady_clock::time_point Deadline;
+};
+
+/**
+ * Targets within a watched directory, when watching targets rather than an observed path.
+ */
+struct FileWatcherTargetDirectory
+{
+    bool IsTarget{ false };     // the directory itself is a target, so every entry is reported.
+    std::unordered_set<std::string, FileWatcherNameHash, std::equal_to<>> Files{};
+};
+
+/**
+ * Handles of the directories events were recently reported in, so the status of their entries is looked up relative to the
+ * directory rather than by walking the full path each time. A handle follows it's directory when it's moved.
+ */
+class FileWatcherDirectoryHandles
+{
+public:
+    FileWatcherDirectoryHandles() noexcept = default;
+    FileWatcherDirectoryHandles(const FileWatcherDirectoryHandles&) = delete;
+    FileWatcherDirectoryHandles& operator=(const FileWatcherDirectoryHandles&) = delete;
+    ~FileWatcherDirectoryHandles() noexcept { Clear(); }
+
+    /**
+     * Returns the handle of the directory, or -1 if it isn't open.
+     */
+    [[nodiscard]] int Find(const uint32_t directoryId) noexcept;
+
+    /**
+     * Opens the directory by it's path, closing the least recently used handle if all are taken. Returns -1 and sets errno on failure.
+     */
+    [[nodiscard]] int Open(const uint32_t directoryId, const char* path) noexcept;
+
+    /**
+     * Closes the handle of a directory no longer watched, as it's id might be reused for another one.
+     */
+    void Forget(const uint32_t directoryId) noexcept;
+    void Clear() noexcept;
+private:
+    struct Entry
+    {
+        uint32_t DirectoryId;
+        int Descriptor;
+        uint64_t LastUse;
+    };
+private:
+    std::vector<Entry> m_Entries{};
+    uint64_t m_Uses{ 0U };
+private:
+    constexpr static inline size_t s_MaxHandles{ 64U };
+};
+
+/**
+ * Entries the watcher opens itself, the directories it lists and the files it fingerprints, so the Opened and Accessed events it causes
+ * aren't reported. Only tracked while either is subscribed to. The kernel doesn't tell who opened an entry, so an access counts as the
+ * watcher's own until the entry is reported closed, and another process opening it meanwhile goes unreported as well.
+ */
+class FileWatcherOwnAccesses
+{
+public:
+    FileWatcherOwnAccesses() noexcept = default;
+    FileWatcherOwnAccesses(const FileWatcherOwnAccesses&) = delete;
+    FileWatcherOwnAccesses& operator=(const FileWatcherOwnAccesses&) = delete;
+
+    /**
+     * @param rootPath - The observed directory, which only it's own watch reports opening, without a name.
+     */
+    void Enable(const std::string_view rootPath) noexcept;
+
+    /**
+     * Opens the entry relative to the directory, counting the access as the watcher's own. Returns -1 and sets errno on failure.
+     * @param path - Full path of the entry, by which it's events are recognised.
+     */
+    [[nodiscard]] int Open(const int directory, const char* name, const std::string_view path, const int flags) noexcept;
+    [[nodiscard]] int Open(const char* path, const int flags) noexcept { return Open(AT_FDCWD, path, path, flags); }
+
+    /**
+     * Returns true if an event of the entry is due to the watcher's own access, which is over once the entry is closed.
+     */
+    [[nodiscard]] bool IsOwn(const std::string_view path, const bool isClosed) noexcept;
+
+    /**
+     * Forgets the accesses of the entry and of everything within it, as their closing isn't reported where it was anymore.
+     */
+    void Forget(const std::string_view path) noexcept;
+    void Clear() noexcept;
+
+    [[nodiscard]] bool IsEmpty() const noexcept { return m_Count.load(std::memory_order_acquire) == 0U; }
+private:
+    using AccessMap = std::unordered_map<std::string, uint32_t, FileWatcherNameHash, std::equal_to<>>;
+
+    void Release(AccessMap::iterator access) noexcept;
+private:
+    bool m_IsEnabled{ false };
+    std::string m_RootPath{};
+    std::mutex m_Mutex{};
+    AccessMap m_Accesses{};                             // path -> accesses not closed yet.
+    std::atomic<size_t> m_Count{ 0U };                  // paths with accesses, checked before taking the lock.
+};
+
 struct FileWatcherInternalState
 {
-    // Inotify instance handle
-    int InotifyInstance{ -1 };
+    // Shared reactor delivering the events
+    std::shared_ptr<FileWatcherReactor> Reactor{};
     // Root directory watch descriptor
     int RootWatchDescriptor{ -1 };
-    // Subdirectory watch descriptors
-    std::unordered_map<int, std::filesystem::path> SubdirectoryWatchDescriptors{};
+    // Paths of the root and every watched subdirectory
+    FileWatcherDirectoryTable Directories{};
+    // Moves out of a directory waiting for their pair, in arrival order so their deadlines are ascending
+    std::vector<FileWatcherPendingRename> PendingRenames{};
+    // Subdirectories renamed within the tree, relinked as soon as the kernel reports their own watch moving. In arrival order as well.
+    std::vector<FileWatcherDirectoryMove> DirectoryMoves{};
+    // Reused for the full paths the watcher needs itself, such as when adding a watch
+    std::string PathBuffer{};
+    // Entries reported by scanning new directories, so the kernel's events for them aren't reported again.
+    // Only kept until the event queue has been read empty, by then every event the scan raced with has been read.
+    std::unordered_map<int, std::unordered_set<std::string, FileWatcherNameHash, std::equal_to<>>> ScannedNames{};
+    std::vector<int> ScanStack{};
+    std::vector<std::byte> ScanBuffer{};
+    // Earliest deadline the reactor will invoke FileWatcher::ProcessTimers at
+    std::chrono::steady_clock::time_point TimerDeadline{ std::chrono::steady_clock::time_point::max() };
+    // Watch descriptor -> directory contents, only kept when rescanning on overflow. A directory is missing until first listed.
+    std::unordered_map<int, FileWatcherDirectorySnapshot> DirectorySnapshots{};
+    FileWatcherRescan Rescan{};
+    FileWatcherCrawl Crawl{};
+    // Only used when keeping a snapshot
+    FileWatcherSnapshotState Snapshot{};
+    // Only used by the fanotify backend, which keeps the resolved directories in Directories instead of watched ones.
+    FileWatcherFanotify Fanotify{};
+    // Only used when collecting the status of the entries events concern
+    FileWatcherDirectoryHandles DirectoryHandles{};
+    // Only used when Opened or Accessed events are subscribed to
+    FileWatcherOwnAccesses OwnAccesses{};
+    // Watch descriptor -> targets in the directory, and path of the directory -> watch descriptor. Only used when watching targets.
+    std::unordered_map<int, FileWatcherTargetDirectory> Targets{};
+    std::unordered_map<std::string, int, FileWatcherNameHash, std::equal_to<>> TargetDirectories{};
+    // Published by the reactor whenever it flushes the watcher, so the statistics are read without taking it's lock
+    FileWatcherCounter WatchedDirectoryCount{};
+    FileWatcherCounter PendingRenameCount{};
+    FileWatcherCounter PendingRenameHighWaterMark{};
 };
 
-FileWatcher::FileWatcher(const std::filesystem::path& observedPath, FileWatcherCallback&& callback, const bool returnAbsolutePath, std::error_code& error) noexcept
-    :
-	m_IsWatching(false),
-	m_ObservedPath(observedPath),
-	m_Callback(std::move(callback)),
-	m_WatcherThread{},
-	m_InternalState(nullptr)
+[[nodiscard]] static std::optional<FileWatcherSnapshotEntry> StatSnapshotEntry(const int directory, const char* name) noexcept
+{
+    // The creation time tells a reused inode number apart
+    struct statx status;
+    if(statx(directory, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS | STATX_BTIME, &status) == -1)
+        return std::nullopt;
+
+    return FileWatcherSnapshotEntry
+    {
+        .Inode{ static_cast<uint64_t>(status.stx_ino) },
+        .Size{ static_cast<int64_t>(status.stx_size) },
+        .ModificationTime{ static_cast<int64_t>(status.stx_mtime.tv_sec) * 1'000'000'000 + status.stx_mtime.tv_nsec },
+        .CreationTime{ (status.stx_mask & STATX_BTIME) ? static_cast<int64_t>(status.stx_btime.tv_sec) * 1'000'000'000 + status.stx_btime.tv_nsec : 0 },
+        .IsDirectory{ S_ISDIR(status.stx_mode) },
+    };
+}
+
+[[nodiscard]] static bool HasChanged(const FileWatcherSnapshotEntry& previous, const FileWatcherSnapshotEntry& current) noexcept
+{
+    // A directory's size and modification time follow it's contents, which are diffed on their own.
+    if(previous.IsDirectory && current.IsDirectory)
+        return previous.Inode != current.Inode;
+
+    return previous != current;
+}
+
+[[nodiscard]] static FileWatcherDirectoryListing ListDirectory(const int watchDescriptor, std::filesystem::path&& path, const std::filesystem::path& observedFile, FileWatcherOwnAccesses& ownAccesses) noexcept
+{
+    FileWatcherDirectoryListing listing{ .WatchDescriptor{ watchDescriptor }, .Path{ std::move(path) }, .Exists{ false }, .Entries{} };
+
+    const int descriptor{ ownAccesses.Open(listing.Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) };
+    DIR* const directory{ descriptor != -1 ? fdopendir(descriptor) : nullptr };
+    if(!directory)
+    {
+        if(descriptor != -1)
+            close(descriptor);
+
+        return listing;
+    }
+
+    listing.Exists = true;
+    while(const dirent* const entry{ readdir(directory) })
+    {
+        const std::string_view name{ entry->d_name };
+        if(name == "." || name == ".." || (!observedFile.empty() && observedFile.native() != name))
+            continue;
+
+        if(const std::optional<FileWatcherSnapshotEntry> status{ StatSnapshotEntry(dirfd(directory), entry->d_name) })
+            listing.Entries.emplace_back(name, *status);
+    }
+
+    closedir(directory);
+    return listing;
+}
+
+/**
+ * Lists the directory with getdents64, invoking the function with the name of every entry and whether it's a directory.
+ * Listing stops early once the function returns false.
+ */
+template<typename Function>
+[[nodiscard]] static std::error_code ListDirectoryEntries(const int directory, std::byte* buffer, Function&& function) noexcept
+{
+    while(true)
+    {
+        const long length{ syscall(SYS_getdents64, directory, buffer, s_CrawlBufferSize) };
+        if(length == 0)
+            return std::error_code{};
+
+        if(length == -1)
+            return errno == ENOENT ? std::error_code{} : std::error_code(errno, std::system_category());
+
+        for(long offset{ 0 }; offset < length;)
+        {
+            const dirent64* const entry{ reinterpret_cast<const dirent64*>(buffer + offset) };
+            offset += entry->d_reclen;
+
+            const std::string_view name{ entry->d_name };
+            if(name == "." || name == "..")
+                continue;
+
+            // Only some file systems leave the type out
+            bool isDirectory{ entry->d_type == DT_DIR };
+            if(entry->d_type == DT_UNKNOWN)
+            {
+                struct stat status;
+                isDirectory = fstatat(directory, entry->d_name, &status, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(status.st_mode);
+            }
+
+            if(!function(name, isDirectory))
+                return std::error_code{};
+        }
+    }
+}
+
+/**
+ * Returns true if the file might have changed since the snapshot recorded it. A file replaced by another one counts as modified,
+ * which is how saving through a temporary file turns out.
+ */
+[[nodiscard]] static bool HasChangedSince(const FileWatcherTreeSnapshotRecord& recorded, const FileWatcherSnapshotEntry& current, const int64_t listedAt,
+    const int64_t racyPeriod) noexcept
+{
+    return recorded.Inode != current.Inode || recorded.Size != current.Size || recorded.ModificationTime != current.ModificationTime ||
+        recorded.ModificationTime >= listedAt - racyPeriod;
+}
+
+/**
+ * Returns how long after listing an entry a change might still leave it's modification time as recorded, which is the granularity of
+ * the file system's timestamps. Local file systems take them from the kernel's coarse clock, the others are assumed to be as coarse as FAT.
+ */
+[[nodiscard]] static int64_t GetSnapshotRacyPeriod(const char* path) noexcept
+{
+    struct statfs status;
+    if(statfs(path, &status) == -1)
+        return s_CoarseSnapshotRacyPeriod;
+
+    switch(static_cast<uint32_t>(status.f_type))
+    {
+    case 0x4D44U:       // MSDOS_SUPER_MAGIC
+    case 0x2011BAB0U:   // EXFAT_SUPER_MAGIC
+    case 0x6969U:       // NFS_SUPER_MAGIC
+    case 0xFF534D42U:   // CIFS_SUPER_MAGIC
+    case 0xFE534D42U:   // SMB2_SUPER_MAGIC
+    case 0x65735546U:   // FUSE_SUPER_MAGIC
+        return s_CoarseSnapshotRacyPeriod;
+    default:
+        break;
+    }
+
+    timespec resolution;
+    if(clock_getres(CLOCK_REALTIME_COARSE, &resolution) == -1)
+        return s_CoarseSnapshotRacyPeriod;
+
+    return static_cast<int64_t>(resolution.tv_sec) * 1'000'000'000 + resolution.tv_nsec;
+}
+
+[[nodiscard]] static int64_t GetRealTime() noexcept
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+}
+
+/**
+ * Returns when the snapshot counts as listed. Entries modified within the racy period before listing them would be compared as changed
+ * by every catch up, so once the period has passed they're stat'ed again. If none of them changed, they were already settled when listed,
+ * and the snapshot counts as listed when they were stat'ed again. Not waited out for coarse timestamps, nor for ones ahead of the clock.
+ */
+[[nodiscard]] static int64_t SettleSnapshot(const FileWatcherTreeSnapshotView& snapshot, const std::string_view rootPath, const int64_t listedAt,
+    const int64_t racyPeriod) noexcept
+{
+    if(racyPeriod > s_MaxSnapshotSettlingPeriod)
+        return listedAt;
+
+    std::vector<uint32_t> racyEntries;
+    int64_t latestModification{ listedAt - racyPeriod };
+    for(uint32_t index{ 0U }; index < snapshot.GetSize(); ++index)
+    {
+        if(snapshot[index].ModificationTime < listedAt - racyPeriod)
+            continue;
+
+        racyEntries.push_back(index);
+        latestModification = std::max(latestModification, snapshot[index].ModificationTime);
+    }
+
+    if(racyEntries.empty())
+        return listedAt;
+
+    const int64_t settledAt{ latestModification + racyPeriod };
+    const int64_t now{ GetRealTime() };
+    if(settledAt - now > s_MaxSnapshotSettlingPeriod)
+        return listedAt;
+
+    if(settledAt >= now)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(settledAt - now + 1));
+
+    const int64_t restattedAt{ GetRealTime() };
+    std::string path;
+    for(const uint32_t index : racyEntries)
+    {
+        const FileWatcherTreeSnapshotRecord& recorded{ snapshot[index] };
+        snapshot.GetPath(index, rootPath, path);
+        const std::optional<FileWatcherSnapshotEntry> current{ StatSnapshotEntry(AT_FDCWD, path.c_str()) };
+        if(!current || current->Inode != recorded.Inode || current->Size != recorded.Size || current->ModificationTime != recorded.ModificationTime)
+            return listedAt;
+    }
+
+    return restattedAt;
+}
+
+/**
+ * Returns the path of a directory within the observed one, which the snapshot's listings are kept by. The same whether or not
+ * the observed path ends with a separator, which the directory table doesn't repeat while the paths built from the snapshot do.
+ */
+[[nodiscard]] static std::string_view GetRelativePath(const std::string_view rootPath, std::string_view path) noexcept
+{
+    path.remove_prefix(std::min(rootPath.size(), path.size()));
+    if(!path.empty() && path.front() == '/')
+        path.remove_prefix(1U);
+
+    return path;
+}
+
+/**
+ * Queues the Deleted events of a recorded entry, the entries of a directory before the directory itself.
+ * @param path - Path of the entry, restored before returning.
+ */
+static void CollectDeletedEntries(const FileWatcherTreeSnapshotView& snapshot, const uint32_t index, std::string& path, std::vector<FileWatcherCaughtUpEvent>& events) noexcept
+{
+    const FileWatcherTreeSnapshotRecord& record{ snapshot[index] };
+    if(record.IsDirectory && record.IsListed)
+    {
+        const size_t length{ path.size() };
+        for(uint32_t child{ record.FirstChild }; child < record.FirstChild + record.ChildCount; ++child)
+        {
+            path.push_back('/');
+            path.append(snapshot.GetName(child));
+            CollectDeletedEntries(snapshot, child, path, events);
+            path.resize(length);
+        }
+    }
+
+    events.push_back(FileWatcherCaughtUpEvent{ .Action{ EFileAction::Deleted }, .Path{ path }, .IsDirectory{ static_cast<bool>(record.IsDirectory) } });
+}
+
+/**
+ * Queues the Created events of everything inside a directory which is new since the snapshot, skipping the excluded directories.
+ * @param path - Path of the directory, restored before returning.
+ */
+template<typename Function>
+static void CollectCreatedEntries(std::string& path, std::byte* buffer, std::vector<FileWatcherCaughtUpEvent>& events, const Function& isExcluded, FileWatcherOwnAccesses& ownAccesses) noexcept
+{
+    const int directory{ ownAccesses.Open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) };
+    if(directory == -1)
+        return;
+
+    // Listed before descending, as the buffer is shared with the subdirectories
+    std::vector<std::pair<std::string, bool>> entries;
+    const std::error_code error{ ListDirectoryEntries(directory, buffer, [&entries](const std::string_view name, const bool isDirectory) noexcept
+    {
+        entries.emplace_back(name, isDirectory);
+        return true;
+    }) };
+
+    close(directory);
+    if(error)
+    {
+        events.push_back(FileWatcherCaughtUpEvent{ .Action{ EFileAction::Error }, .Path{ path }, .Error{ error } });
+        return;
+    }
+
+    const size_t length{ path.size() };
+    for(const auto& [name, isDirectory] : entries)
+    {
+        path.push_back('/');
+        path.append(name);
+        events.push_back(FileWatcherCaughtUpEvent{ .Action{ EFileAction::Created }, .Path{ path }, .IsDirectory{ isDirectory } });
+
+        if(isDirectory && !isExcluded(path))
+            CollectCreatedEntries(path, buffer, events, isExcluded, ownAccesses);
+
+        path.resize(length);
+    }
+}
+
+/**
+ * Writes the snapshot next to it's destination and renames it over the previous one, so a crash never leaves a torn snapshot behind.
+ */
+[[nodiscard]] static std::error_code WriteSnapshotFile(const std::filesystem::path& path, const FileWatcherTreeSnapshotHeader& header,
+    const std::span<const FileWatcherTreeSnapshotRecord> records, const std::string_view names) noexcept
+{
+    const std::string temporaryPath{ path.native() + ".tmp" };
+    const int file{ open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) };
+    if(file == -1)
+        return std::error_code(errno, std::system_category());
+
+    const std::pair<const std::byte*, size_t> parts[]
+    {
+        { reinterpret_cast<const std::byte*>(&header), sizeof(header) },
+        { reinterpret_cast<const std::byte*>(records.data()), records.size_bytes() },
+        { reinterpret_cast<const std::byte*>(names.data()), names.size() },
+    };
+
+    std::error_code error;
+    for(auto [data, size] : parts)
+    {
+        while(size > 0U && !error)
+        {
+            const ssize_t written{ write(file, data, size) };
+            if(written == -1 && errno != EINTR)
+                error.assign(errno, std::system_category());
+            else if(written > 0)
+            {
+                data += written;
+                size -= static_cast<size_t>(written);
+            }
+        }
+    }
+
+    if(!error && fdatasync(file) == -1)
+        error.assign(errno, std::system_category());
+
+    close(file);
+    if(!error && rename(temporaryPath.c_str(), path.c_str()) == -1)
+        error.assign(errno, std::system_category());
+
+    if(error)
+        unlink(temporaryPath.c_str());
+
+    return error;
+}
+
+// The kernel doesn't pad fanotify events and their records, so they're copied out rather than accessed in place.
+template<typename Record>
+[[nodiscard]] static Record ReadRecord(const std::byte* data) noexcept
+{
+    Record record;
+    std::memcpy(&record, data, sizeof(Record));
+    return record;
+}
+
+/**
+ * Invokes the function with the metadata and start of every whole fanotify event in the buffer. Stops early once the function returns false.
+ */
+template<typename Function>
+static bool ForEachFanotifyEvent(const std::byte* buffer, const size_t length, Function&& function) noexcept
+{
+    for(size_t offset{ 0U }; offset + sizeof(fanotify_event_metadata) <= length;)
+    {
+        const fanotify_event_metadata event{ ReadRecord<fanotify_event_metadata>(buffer + offset) };
+        if(event.event_len < sizeof(fanotify_event_metadata) || offset + event.event_len > length)
+            break;
+
+        if(!function(event, buffer + offset))
+            return false;
+
+        offset += event.event_len;
+    }
+
+    return true;
+}
+
+// A mount of the file system is needed to open file handles with
+[[nodiscard]] static int OpenMountPoint(const std::filesystem::path& path) noexcept
+{
+    struct stat status;
+    if(stat(path.c_str(), &status) == -1)
+        return -1;
+
+    std::filesystem::path mountPoint{ path };
+    while(mountPoint.has_relative_path())
+    {
+        struct stat parentStatus;
+        const std::filesystem::path parent{ mountPoint.parent_path() };
+        if(stat(parent.c_str(), &parentStatus) == -1 || parentStatus.st_dev != status.st_dev)
+            break;
+
+        mountPoint = parent;
+    }
+
+    return open(mountPoint.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Reads the current path of the directory identified by the file handle. Returns false if it has been removed.
+ */
+[[nodiscard]] static bool ReadHandlePath(const int mountDirectory, const std::string_view handle, std::string& path) noexcept
+{
+    alignas(file_handle) std::array<std::byte, sizeof(file_handle) + MAX_HANDLE_SZ> alignedHandle;
+    if(handle.size() > alignedHandle.size())
+        return false;
+
+    std::memcpy(alignedHandle.data(), handle.data(), handle.size());
+    const int directory{ open_by_handle_at(mountDirectory, reinterpret_cast<file_handle*>(alignedHandle.data()), O_PATH | O_CLOEXEC) };
+    if(directory == -1)
+        return false;
+
+    std::array<char, 32U> link;
+    std::snprintf(link.data(), link.size(), "/proc/self/fd/%d", directory);
+
+    path.resize(PATH_MAX);
+    const ssize_t pathLength{ readlink(link.data(), path.data(), path.size()) };
+    close(directory);
+
+    // A directory removed meanwhile might still be cached
+    path.resize(pathLength == -1 ? 0U : static_cast<size_t>(pathLength));
+    return !path.empty() && path.front() == '/' && !path.ends_with(" (deleted)");
+}
+
+[[nodiscard]] static std::vector<std::pair<int, std::filesystem::path>> CollectWatchedDirectories(const FileWatcherInternalState& state) noexcept
+{
+    std::vector<std::pair<int, std::filesystem::path>> directories;
+    directories.reserve(state.Directories.GetWatchedCount());
+
+    state.Directories.ForEachWatched([&directories](const int watchDescriptor, const std::string_view path) noexcept
+    {
+        directories.emplace_back(watchDescriptor, path);
+    });
+
+    return directories;
+}
+
+void FileWatcherDirectoryTable::Insert(const int watchDescriptor, const std::string_view path) noexcept
+{
+    Link(watchDescriptor, s_NoParent, path);
+}
+
+void FileWatcherDirectoryTable::Insert(const int watchDescriptor, const int parentWatchDescriptor, const std::string_view name) noexcept
+{
+    assert(Contains(parentWatchDescriptor) && !IsWithin(parentWatchDescriptor, watchDescriptor));
+    Link(watchDescriptor, parentWatchDescriptor, name);
+}
+
+void FileWatcherDirectoryTable::Retire(const int watchDescriptor) noexcept
+{
+    Entry* entry{ m_Entries.Find(watchDescriptor) };
+    if(!entry || entry->IsRetired)
+        return;
+
+    entry->IsRetired = 1U;
+    m_Retired.push_back(watchDescriptor);
+}
+
+void FileWatcherDirectoryTable::RetireAll() noexcept
+{
+    m_Entries.ForEach([this](const int watchDescriptor, Entry& entry) noexcept
+    {
+        if(entry.IsRetired)
+            return;
+
+        entry.IsRetired = 1U;
+        m_Retired.push_back(watchDescriptor);
+    });
+}
+
+void FileWatcherDirectoryTable::ReleaseRetired() noexcept
+{
+    if(m_Retired.empty())
+        return;
+
+    // A directory still holding others stays, until they're released by a later call.
+    size_t keptCount{ 0U };
+    for(const int watchDescriptor : m_Retired)
+    {
+        const Entry* entry{ m_Entries.Find(watchDescriptor) };
+        if(!entry)
+            continue;
+
+        if(entry->ChildCount != 0U)
+            m_Retired[keptCount++] = watchDescriptor;
+        else
+            Erase(watchDescriptor);
+    }
+
+    m_Retired.resize(keptCount);
+
+    // Reclaim the arena once most of it is unused, views handed out earlier are only valid until the next modification anyway.
+    if(m_UnusedBytes > s_MinCompactedSize && m_UnusedBytes * 2U > m_Arena.size())
+        Compact();
+}
+
+void FileWatcherDirectoryTable::Clear() noexcept
+{
+    m_Arena.clear();
+    m_Entries.Clear();
+    m_Retired.clear();
+    m_UnusedBytes = 0U;
+    m_BuiltWatchDescriptor = s_NoParent;
+}
+
+std::optional<std::string_view> FileWatcherDirectoryTable::Find(const int watchDescriptor) const noexcept
+{
+    const Entry* entry{ m_Entries.Find(watchDescriptor) };
+    if(!entry)
+        return std::nullopt;
+
+    if(entry->Parent == s_NoParent)
+        return GetName(*entry);
+
+    if(watchDescriptor == m_BuiltWatchDescriptor)
+        return m_PathBuffer;
+
+    // Filled from the back, as the names are found leaf first. A parent's path ending with a separator, such as the root, isn't given another one.
+    const Entry* ancestor{ entry };
+    size_t length{ 0U };
+    for(; ancestor->Parent != s_NoParent; ancestor = m_Entries.Find(ancestor->Parent))
+        length += ancestor->Length + 1U;
+
+    const std::string_view rootPath{ GetName(*ancestor) };
+    const bool hasSeparator{ rootPath.ends_with('/') };
+    length += rootPath.size() - hasSeparator;
+
+    m_PathBuffer.resize(length);
+    for(const Entry* current{ entry }; ; current = m_Entries.Find(current->Parent))
+    {
+        const std::string_view name{ GetName(*current).substr(0U, current == ancestor ? rootPath.size() - hasSeparator : std::string_view::npos) };
+        length -= name.size();
+        std::memcpy(m_PathBuffer.data() + length, name.data(), name.size());
+
+        if(current == ancestor)
+            break;
+
+        m_PathBuffer[--length] = '/';
+    }
+
+    m_BuiltWatchDescriptor = watchDescriptor;
+    return m_PathBuffer;
+}
+
+bool FileWatcherDirectoryTable::IsWatched(const int watchDescriptor) const noexcept
+{
+    const Entry* entry{ m_Entries.Find(watchDescriptor) };
+    return entry && !entry->IsRetired;
+}
+
+bool FileWatcherDirectoryTable::IsEntryOf(const int watchDescriptor, const int parentWatchDescriptor, const std::string_view name) const noexcept
+{
+    const Entry* entry{ m_Entries.Find(watchDescriptor) };
+    return entry && entry->Parent == parentWatchDescriptor && GetName(*entry) == name;
+}
+
+bool FileWatcherDirectoryTable::IsWithin(const int watchDescriptor, const int ancestorWatchDescriptor) const noexcept
+{
+    for(int current{ watchDescriptor }; current != s_NoParent;)
+    {
+        if(current == ancestorWatchDescriptor)
+            return true;
+
+        const Entry* entry{ m_Entries.Find(current) };
+        if(!entry)
+            return false;
+
+        current = entry->Parent;
+    }
+
+    return false;
+}
+
+void FileWatcherDirectoryTable::CollectSubtree(const int ancestorWatchDescriptor, std::vector<int>& watchDescriptors) const noexcept
+{
+    watchDescriptors.clear();
+    m_Entries.ForEach([this, ancestorWatchDescriptor, &watchDescriptors](const int watchDescriptor, const Entry& entry) noexcept
+    {
+        if(!entry.IsRetired && IsWithin(watchDescriptor, ancestorWatchDescriptor))
+            watchDescriptors.push_back(watchDescriptor);
+    });
+}
+
+void FileWatcherDirectoryTable::CollectWatched(std::vector<int>& watchDescriptors) const noexcept
+{
+    watchDescriptors.clear();
+    watchDescriptors.reserve(GetWatchedCount());
+    m_Entries.ForEach([&watchDescriptors](const int watchDescriptor, const Entry& entry) noexcept
+    {
+        if(!entry.IsRetired)
+            watchDescriptors.push_back(watchDescriptor);
+    });
+}
+
+void FileWatcherDirectoryTable::Link(const int watchDescriptor, const int parentWatchDescriptor, const std::string_view name) noexcept
+{
+    // Relinked in place, so the directories within it keep referring to it
+    Entry* entry{ m_Entries.Find(watchDescriptor) };
+    if(entry)
+    {
+        Unlink(*entry);
+        if(entry->IsRetired)
+            std::erase(m_Retired, watchDescriptor);
+    }
+    else
+        entry = &m_Entries[watchDescriptor];
+
+    entry->Parent = parentWatchDescriptor;
+    entry->Offset = static_cast<uint32_t>(m_Arena.size());
+    entry->Length = static_cast<uint32_t>(name.size());
+    entry->IsRetired = 0U;
+    m_Arena.append(name);
+
+    if(parentWatchDescriptor != s_NoParent)
+        ++m_Entries.Find(parentWatchDescriptor)->ChildCount;
+
+    m_BuiltWatchDescriptor = s_NoParent;
+}
+
+void FileWatcherDirectoryTable::Unlink(const Entry& entry) noexcept
+{
+    if(entry.Parent != s_NoParent)
+        if(Entry* parent{ m_Entries.Find(entry.Parent) })
+            --parent->ChildCount;
+
+    m_UnusedBytes += entry.Length;
+}
+
+void FileWatcherDirectoryTable::Erase(const int watchDescriptor) noexcept
+{
+    const Entry* entry{ m_Entries.Find(watchDescriptor) };
+    if(!entry)
+        return;
+
+    Unlink(*entry);
+    m_Entries.Erase(watchDescriptor);
+    m_BuiltWatchDescriptor = s_NoParent;
+}
+
+void FileWatcherDirectoryTable::Compact() noexcept
+{
+    std::string arena;
+    arena.reserve(m_Arena.size() - m_UnusedBytes);
+
+    m_Entries.ForEach([this, &arena](const int, Entry& entry) noexcept
+    {
+        const uint32_t offset{ static_cast<uint32_t>(arena.size()) };
+        arena.append(m_Arena, entry.Offset, entry.Length);
+        entry.Offset = offset;
+    });
+
+    m_Arena = std::move(arena);
+    m_UnusedBytes = 0U;
+}
+
+std::shared_ptr<FileWatcherReactor> FileWatcherReactor::Acquire(std::error_code& error) noexcept
+{
+    static std::mutex s_InstanceMutex;
+    static std::weak_ptr<FileWatcherReactor> s_Instance;
+
+    std::scoped_lock lock(s_InstanceMutex);
+    if(std::shared_ptr<FileWatcherReactor> reactor{ s_Instance.lock() }; reactor && reactor->m_IsRunning)
+        return reactor;
+
+    std::shared_ptr<FileWatcherReactor> reactor{ std::make_shared<FileWatcherReactor>() };
+    reactor->Start(error);
+    if(error)
+        return nullptr;
+
+    s_Instance = reactor;
+    return reactor;
+}
+
+int FileWatcherDirectoryHandles::Find(const uint32_t directoryId) noexcept
+{
+    for(Entry& entry : m_Entries)
+    {
+        if(entry.DirectoryId == directoryId)
+        {
+            entry.LastUse = ++m_Uses;
+            return entry.Descriptor;
+        }
+    }
+
+    return -1;
+}
+
+int FileWatcherDirectoryHandles::Open(const uint32_t directoryId, const char* path) noexcept
+{
+    // Only resolved, neither read nor kept from being deleted
+    const int descriptor{ open(path, O_PATH | O_DIRECTORY | O_CLOEXEC) };
+    if(descriptor == -1)
+        return -1;
+
+    if(m_Entries.size() < s_MaxHandles)
+    {
+        m_Entries.push_back(Entry{ .DirectoryId{ directoryId }, .Descriptor{ descriptor }, .LastUse{ ++m_Uses } });
+        return descriptor;
+    }
+
+    Entry& leastRecent{ *std::min_element(m_Entries.begin(), m_Entries.end(), [](const Entry& first, const Entry& second) noexcept { return first.LastUse < second.LastUse; }) };
+    close(leastRecent.Descriptor);
+    leastRecent = Entry{ .DirectoryId{ directoryId }, .Descriptor{ descriptor }, .LastUse{ ++m_Uses } };
+    return descriptor;
+}
+
+void FileWatcherDirectoryHandles::Forget(const uint32_t directoryId) noexcept
+{
+    const auto entry{ std::find_if(m_Entries.begin(), m_Entries.end(), [directoryId](const Entry& handle) noexcept { return handle.DirectoryId == directoryId; }) };
+    if(entry == m_Entries.end())
+        return;
+
+    close(entry->Descriptor);
+    *entry = m_Entries.back();
+    m_Entries.pop_back();
+}
+
+void FileWatcherDirectoryHandles::Clear() noexcept
+{
+    for(const Entry& entry : m_Entries)
+        close(entry.Descriptor);
+
+    m_Entries.clear();
+}
+
+void FileWatcherOwnAccesses::Enable(const std::string_view rootPath) noexcept
+{
+    m_IsEnabled = true;
+    m_RootPath.assign(rootPath);
+}
+
+int FileWatcherOwnAccesses::Open(const int directory, const char* name, const std::string_view path, const int flags) noexcept
+{
+    if(!m_IsEnabled || path == m_RootPath)
+        return openat(directory, name, flags);
+
+    // Counted before opening, as the events might be read before the call returns
+    {
+        std::scoped_lock lock(m_Mutex);
+        auto access{ m_Accesses.find(path) };
+        if(access == m_Accesses.end())
+        {
+            access = m_Accesses.emplace(std::string(path), 0U).first;
+            m_Count.fetch_add(1U, std::memory_order_release);
+        }
+
+        ++access->second;
+    }
+
+    const int file{ openat(directory, name, flags) };
+    if(file != -1)
+        return file;
+
+    // Nothing is reported about an entry which failed to open
+    const int openError{ errno };
+    {
+        std::scoped_lock lock(m_Mutex);
+        if(const auto failed{ m_Accesses.find(path) }; failed != m_Accesses.end())
+            Release(failed);
+    }
+
+    errno = openError;
+    return -1;
+}
+
+bool FileWatcherOwnAccesses::IsOwn(const std::string_view path, const bool isClosed) noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+    const auto access{ m_Accesses.find(path) };
+    if(access == m_Accesses.end())
+        return false;
+
+    if(isClosed)
+        Release(access);
+
+    return true;
+}
+
+void FileWatcherOwnAccesses::Forget(const std::string_view path) noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+    std::erase_if(m_Accesses, [path](const auto& access) noexcept
+    {
+        return access.first.starts_with(path) && (access.first.size() == path.size() || access.first[path.size()] == '/');
+    });
+
+    m_Count.store(m_Accesses.size(), std::memory_order_release);
+}
+
+void FileWatcherOwnAccesses::Clear() noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+    m_Accesses.clear();
+    m_Count.store(0U, std::memory_order_release);
+}
+
+void FileWatcherOwnAccesses::Release(AccessMap::iterator access) noexcept
+{
+    if(--access->second != 0U)
+        return;
+
+    m_Accesses.erase(access);
+    m_Count.fetch_sub(1U, std::memory_order_release);
+}
+
+#if FILEWATCHER_HAS_IO_URING
+FileWatcherRing::~FileWatcherRing() noexcept
+{
+    Reset();
+}
+
+bool FileWatcherRing::Setup(const unsigned entries) noexcept
+{
+    io_uring_params parameters{};
+    m_Ring = static_cast<int>(syscall(__NR_io_uring_setup, entries, &parameters));
+    if(m_Ring == -1)
+        return false;
+
+    // Completions are never dropped, waiting takes a timeout without a timeout request and both rings share a mapping
+    constexpr uint32_t requiredFeatures{ IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG };
+    if((parameters.features & requiredFeatures) != requiredFeatures)
+    {
+        Reset();
+        return false;
+    }
+
+    m_RingsSize = std::max(parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned), parameters.cq_off.cqes + parameters.cq_entries * sizeof(io_uring_cqe));
+    m_Rings = mmap(nullptr, m_RingsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Ring, IORING_OFF_SQ_RING);
+    m_SubmissionsSize = parameters.sq_entries * sizeof(io_uring_sqe);
+    m_Submissions = static_cast<io_uring_sqe*>(mmap(nullptr, m_SubmissionsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_Ring, IORING_OFF_SQES));
+
+    if(m_Rings == MAP_FAILED || m_Submissions == MAP_FAILED)
+    {
+        Reset();
+        return false;
+    }
+
+    std::byte* rings{ static_cast<std::byte*>(m_Rings) };
+    m_SubmissionHead = reinterpret_cast<unsigned*>(rings + parameters.sq_off.head);
+    m_SubmissionTail = reinterpret_cast<unsigned*>(rings + parameters.sq_off.tail);
+    m_SubmissionMask = reinterpret_cast<unsigned*>(rings + parameters.sq_off.ring_mask);
+    m_SubmissionArray = reinterpret_cast<unsigned*>(rings + parameters.sq_off.array);
+    m_SubmissionCount = parameters.sq_entries;
+
+    m_CompletionHead = reinterpret_cast<unsigned*>(rings + parameters.cq_off.head);
+    m_CompletionTail = reinterpret_cast<unsigned*>(rings + parameters.cq_off.tail);
+    m_CompletionMask = reinterpret_cast<unsigned*>(rings + parameters.cq_off.ring_mask);
+    m_Completions = reinterpret_cast<io_uring_cqe*>(rings + parameters.cq_off.cqes);
+
+    return true;
+}
+
+bool FileWatcherRing::RegisterBuffer(std::byte* buffer, const size_t size) noexcept
+{
+    if(m_RegisteredBuffer != nullptr)
+    {
+        syscall(__NR_io_uring_register, m_Ring, IORING_UNREGISTER_BUFFERS, nullptr, 0U);
+        m_RegisteredBuffer = nullptr;
+        m_RegisteredSize = 0U;
+    }
+
+    iovec vector{ .iov_base{ buffer }, .iov_len{ size } };
+    if(syscall(__NR_io_uring_register, m_Ring, IORING_REGISTER_BUFFERS, &vector, 1U) == -1)
+        return false;
+
+    m_RegisteredBuffer = buffer;
+    m_RegisteredSize = size;
+    return true;
+}
+
+io_uring_sqe* FileWatcherRing::GetSubmission() noexcept
+{
+    const unsigned tail{ *m_SubmissionTail + m_QueuedSubmissions };
+    if(tail - std::atomic_ref<unsigned>(*m_SubmissionHead).load(std::memory_order_acquire) >= m_SubmissionCount)
+        return nullptr;
+
+    const unsigned index{ tail & *m_SubmissionMask };
+    m_SubmissionArray[index] = index;
+    ++m_QueuedSubmissions;
+
+    io_uring_sqe* submission{ &m_Submissions[index] };
+    std::memset(submission, 0, sizeof(io_uring_sqe));
+    return submission;
+}
+
+int FileWatcherRing::SubmitAndWait(const int timeout) noexcept
+{
+    // Entries the kernel didn't consume, as waiting was interrupted, are submitted again along
+    const unsigned tail{ *m_SubmissionTail + std::exchange(m_QueuedSubmissions, 0U) };
+    std::atomic_ref<unsigned>(*m_SubmissionTail).store(tail, std::memory_order_release);
+    const unsigned submissions{ tail - std::atomic_ref<unsigned>(*m_SubmissionHead).load(std::memory_order_acquire) };
+
+    __kernel_timespec timespec{ .tv_sec{ timeout / 1000 }, .tv_nsec{ (timeout % 1000) * 1000000LL } };
+    io_uring_getevents_arg argument{};
+    if(timeout >= 0)
+        argument.ts = reinterpret_cast<uint64_t>(&timespec);
+
+    if(syscall(__NR_io_uring_enter, m_Ring, submissions, 1U, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &argument, sizeof(argument)) == -1)
+    {
+        if(errno != ETIME && errno != EINTR)
+            return -errno;
+    }
+
+    return 0;
+}
+
+void FileWatcherRing::Reset() noexcept
+{
+    if(m_Submissions != MAP_FAILED)
+        munmap(m_Submissions, m_SubmissionsSize);
+
+    if(m_Rings != MAP_FAILED)
+        munmap(m_Rings, m_RingsSize);
+
+    // Closing the ring releases the registered buffer too
+    if(m_Ring != -1)
+        close(m_Ring);
+
+    m_Ring = -1;
+    m_Rings = MAP_FAILED;
+    m_Submissions = static_cast<io_uring_sqe*>(MAP_FAILED);
+    m_RegisteredBuffer = nullptr;
+    m_RegisteredSize = 0U;
+}
+#endif
+
+FileWatcherReactor::~FileWatcherReactor() noexcept
+{
+    assert(m_Subscribers.IsEmpty());
+    // Destroying the reactor from within a callback would join the dispatch thread on itself.
+    assert(!m_DispatchThread.joinable() || m_DispatchThread.get_id() != std::this_thread::get_id());
+
+    m_IsRunning = false;
+    if(m_WakeupEvent != -1)
+        eventfd_write(m_WakeupEvent, 1U);
+
+    if(m_DispatchThread.joinable())
+        m_DispatchThread.join();
+
+    if(m_WakeupEvent != -1)
+        close(m_WakeupEvent);
+
+    if(m_EpollInstance != -1)
+        close(m_EpollInstance);
+
+    if(m_InotifyInstance != -1)
+        close(m_InotifyInstance);
+}
+
+void FileWatcherReactor::Start(std::error_code& error) noexcept
+{
+    m_InotifyInstance = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    m_EpollInstance = epoll_create1(EPOLL_CLOEXEC);
+    m_WakeupEvent = eventfd(0U, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(m_InotifyInstance == -1 || m_EpollInstance == -1 || m_WakeupEvent == -1)
+    {
+        error.assign(errno, std::system_category());
+        return;
+    }
+
+#if FILEWATCHER_HAS_IO_URING
+    // Falls back to epoll where io_uring is missing, disabled through io_uring_disabled or filtered by a sandbox
+    const bool isUsingRing{ m_Ring.Setup(s_RingEntries) };
+#else
+    const bool isUsingRing{ false };
+#endif
+
+    for(const int fileDescriptor : { m_InotifyInstance, m_WakeupEvent })
+    {
+        // The ring reads the inotify instance itself
+        if(fileDescriptor == m_InotifyInstance && isUsingRing)
+            continue;
+
+        epoll_event readEvent
+        {
+            .events{ EPOLLIN },
+            .data{ .fd{ fileDescriptor } }
+        };
+
+        if(epoll_ctl(m_EpollInstance, EPOLL_CTL_ADD, fileDescriptor, &readEvent) == -1)
+        {
+            error.assign(errno, std::system_category());
+            return;
+        }
+    }
+
+    m_IsRunning = true;
+    m_DispatchThread = std::thread(&FileWatcherReactor::DispatchThreadWork, this);
+}
+
+int FileWatcherReactor::AddWatch(FileWatcher* watcher, const char* path, const uint32_t flags, std::error_code& error) noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+
+    // Added to the events already requested, a watch shared by watchers reports the events of them all
+    const int watchDescriptor{ inotify_add_watch(m_InotifyInstance, path, flags | IN_MASK_ADD) };
+    if(watchDescriptor == -1)
+    {
+        error.assign(errno, std::system_category());
+        return -1;
+    }
+
+    std::vector<FileWatcher*>& subscribers{ m_Subscribers[watchDescriptor] };
+    if(std::find(subscribers.begin(), subscribers.end(), watcher) == subscribers.end())
+        subscribers.push_back(watcher);
+
+    return watchDescriptor;
+}
+
+void FileWatcherReactor::ReleaseWatch(FileWatcher* watcher, const int watchDescriptor) noexcept
+{
+    ReleaseWatches(watcher, std::span<const int>(&watchDescriptor, 1U));
+}
+
+void FileWatcherReactor::ReleaseWatches(FileWatcher* watcher, const std::span<const int> watchDescriptors) noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+
+    for(const int watchDescriptor : watchDescriptors)
+    {
+        std::vector<FileWatcher*>* subscribers{ m_Subscribers.Find(watchDescriptor) };
+        if(!subscribers)
+            continue;
+
+        std::erase(*subscribers, watcher);
+        if(subscribers->empty())
+        {
+            inotify_rm_watch(m_InotifyInstance, watchDescriptor);
+            m_Subscribers.Erase(watchDescriptor);
+            continue;
+        }
+
+        // Every watch of a watcher requests the same events, so the remaining watchers tell which are still needed
+        uint32_t flags{ 0U };
+        for(const FileWatcher* subscriber : *subscribers)
+            flags |= GetWatchFlags(subscriber->m_Options);
+
+        if((GetWatchFlags(watcher->m_Options) & ~flags) == 0U)
+            continue;
+
+        std::optional<std::string_view> path{ watcher->m_InternalState->Directories.Find(watchDescriptor) };
+        if(!path)
+            path = subscribers->front()->m_InternalState->Directories.Find(watchDescriptor);
+
+        if(path)
+            NarrowWatch(watchDescriptor, *path, flags);
+    }
+
+    ++m_Generation;
+}
+
+void FileWatcherReactor::NarrowWatch(const int watchDescriptor, const std::string_view path, const uint32_t flags) noexcept
+{
+    // The path might refer to another directory by now, so the directory is opened and checked to be the watched one.
+    // Checking adds nothing every watch doesn't request already.
+    const int directory{ open(std::string(path).c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC) };
+    if(directory == -1)
+        return;
+
+    std::array<char, 32U> link;
+    std::snprintf(link.data(), link.size(), "/proc/self/fd/%d", directory);
+
+    const int openedWatchDescriptor{ inotify_add_watch(m_InotifyInstance, link.data(), s_RootWatcherFlags | IN_MASK_ADD) };
+    if(openedWatchDescriptor == watchDescriptor)
+        inotify_add_watch(m_InotifyInstance, link.data(), flags);
+    else if(openedWatchDescriptor != -1 && !m_Subscribers.Find(openedWatchDescriptor))
+        inotify_rm_watch(m_InotifyInstance, openedWatchDescriptor);
+
+    close(directory);
+}
+
+void FileWatcherReactor::Unregister(FileWatcher* watcher) noexcept
+{
+    std::unique_lock lock(m_Mutex);
+
+    // The watcher might be destroyed once this returns. A callback unregistering it's own watcher returns to the dispatch thread first.
+    if(std::this_thread::get_id() != m_DispatchThread.get_id())
+        m_DeliveryFinished.wait(lock, [this, watcher]() noexcept { return m_DeliveringWatcher != watcher; });
+
+    std::erase(m_Deliveries, watcher);
+
+    FileWatcherInternalState& state{ *watcher->m_InternalState };
+    if(state.Fanotify.Instance == -1)
+    {
+        std::vector<int> watchDescriptors;
+        state.Directories.CollectWatched(watchDescriptors);
+        ReleaseWatches(watcher, watchDescriptors);
+    }
+
+    for(auto source{ m_Sources.begin() }; source != m_Sources.end();)
+    {
+        if(source->second != watcher)
+        {
+            ++source;
+            continue;
+        }
+
+        epoll_ctl(m_EpollInstance, EPOLL_CTL_DEL, source->first, nullptr);
+        source = m_Sources.erase(source);
+    }
+
+    state.Directories.Clear();
+    state.DirectoryHandles.Clear();
+    state.RootWatchDescriptor = -1;
+    state.PendingRenames.clear();
+    std::erase(m_StoppedWatchers, watcher);
+    std::erase(m_Watchers, watcher);
+
+    {
+        std::scoped_lock postedTasksLock(m_PostedTasksMutex);
+        std::erase_if(m_PostedTasks, [watcher](const PostedTask& postedTask) { return postedTask.Watcher == watcher; });
+    }
+
+    if(std::erase_if(m_Timers, [watcher](const Timer& timer) { return timer.Watcher == watcher; }))
+        std::make_heap(m_Timers.begin(), m_Timers.end(), std::greater<Timer>{});
+
+    ++m_Generation;
+}
+
+void FileWatcherReactor::Register(FileWatcher* watcher) noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+
+    if(std::find(m_Watchers.begin(), m_Watchers.end(), watcher) == m_Watchers.end())
+        m_Watchers.push_back(watcher);
+}
+
+void FileWatcherReactor::AddSource(FileWatcher* watcher, const int fileDescriptor, std::error_code& error) noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+
+    epoll_event readEvent
+    {
+        .events{ EPOLLIN },
+        .data{ .fd{ fileDescriptor } }
+    };
+
+    if(epoll_ctl(m_EpollInstance, EPOLL_CTL_ADD, fileDescriptor, &readEvent) == -1)
+    {
+        error.assign(errno, std::system_category());
+        return;
+    }
+
+    m_Sources.insert_or_assign(fileDescriptor, watcher);
+}
+
+void FileWatcherReactor::Post(FileWatcher* watcher, std::function<void()>&& task) noexcept
+{
+    {
+        std::scoped_lock lock(m_PostedTasksMutex);
+        m_PostedTasks.push_back(PostedTask{ .Watcher{ watcher }, .Task{ std::move(task) } });
+    }
+
+    eventfd_write(m_WakeupEvent, 1U);
+}
+
+void FileWatcherReactor::RunPostedTasks() noexcept
+{
+    {
+        std::scoped_lock lock(m_PostedTasksMutex);
+        std::swap(m_PostedTasks, m_RunningTasks);
+    }
+
+    if(m_RunningTasks.empty())
+        return;
+
+    {
+        std::scoped_lock lock(m_Mutex);
+        for(PostedTask& postedTask : m_RunningTasks)
+        {
+            // The watcher might have been unregistered after the task was swapped out.
+            if(std::find(m_Watchers.begin(), m_Watchers.end(), postedTask.Watcher) != m_Watchers.end() && postedTask.Watcher->m_IsWatching)
+                postedTask.Task();
+        }
+
+        m_RunningTasks.clear();
+        FlushWatchers();
+    }
+
+    DeliverWatchers();
+}
+
+void FileWatcherReactor::ScheduleTimer(FileWatcher* watcher, const std::chrono::steady_clock::time_point deadline) noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+
+    const bool isEarliest{ m_Timers.empty() || deadline < m_Timers.front().Deadline };
+    m_Timers.push_back(Timer{ .Deadline{ deadline }, .Watcher{ watcher } });
+    std::push_heap(m_Timers.begin(), m_Timers.end(), std::greater<Timer>{});
+
+    // The dispatch thread recomputes it's timeout every iteration, other threads have to wake it up.
+    if(isEarliest && std::this_thread::get_id() != m_DispatchThread.get_id())
+        eventfd_write(m_WakeupEvent, 1U);
+}
+
+int FileWatcherReactor::NextTimeout() noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+
+    if(m_Timers.empty())
+        return -1;
+
+    const auto remaining{ m_Timers.front().Deadline - std::chrono::steady_clock::now() };
+    if(remaining <= std::chrono::steady_clock::duration::zero())
+        return 0;
+
+    // Round up, waking before the deadline would just spin
+    return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(remaining).count());
+}
+
+void FileWatcherReactor::ExpireTimers() noexcept
+{
+    {
+        std::scoped_lock lock(m_Mutex);
+
+        const auto now{ std::chrono::steady_clock::now() };
+        while(!m_Timers.empty() && m_Timers.front().Deadline <= now)
+        {
+            std::pop_heap(m_Timers.begin(), m_Timers.end(), std::greater<Timer>{});
+            FileWatcher* watcher{ m_Timers.back().Watcher };
+            m_Timers.pop_back();
+
+            if(watcher->m_IsWatching)
+                watcher->ProcessTimers(now);
+        }
+
+        FlushWatchers();
+    }
+
+    DeliverWatchers();
+}
+
+bool FileWatcherReactor::IsSubscribed(const FileWatcher* watcher, const int watchDescriptor) const noexcept
+{
+    const std::vector<FileWatcher*>* subscribers{ m_Subscribers.Find(watchDescriptor) };
+    return subscribers && std::find(subscribers->begin(), subscribers->end(), watcher) != subscribers->end();
+}
+
+void FileWatcherReactor::Broadcast(const std::error_code& error) noexcept
+{
+    {
+        std::scoped_lock lock(m_Mutex);
+
+        const std::vector<FileWatcher*> watchers{ m_Watchers };
+        for(FileWatcher* watcher : watchers)
+        {
+            watcher->SetIsWatching(false);
+            watcher->QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, error);
+        }
+
+        FlushWatchers();
+    }
+
+    DeliverWatchers();
+}
+
+void FileWatcherReactor::ForgetScannedNames() noexcept
+{
+    if(!m_IsScanPending)
+        return;
+
+    std::scoped_lock lock(m_Mutex);
+    for(FileWatcher* watcher : m_Watchers)
+        watcher->m_InternalState->ScannedNames.clear();
+
+    m_IsScanPending = false;
+}
+
+void FileWatcherReactor::FlushWatchers() noexcept
+{
+    std::scoped_lock lock(m_Mutex);
+
+    m_DispatchScratch.assign(m_Watchers.begin(), m_Watchers.end());
+    for(FileWatcher* watcher : m_DispatchScratch)
+    {
+        // A callback might have destroyed another watcher.
+        if(std::find(m_Watchers.begin(), m_Watchers.end(), watcher) == m_Watchers.end())
+            continue;
+
+        FileWatcherInternalState& state{ *watcher->m_InternalState };
+
+        // Events merged during this pass wait for their period to pass
+        if(!watcher->m_CoalescingQueue.empty())
+            watcher->ScheduleTimer(watcher->m_CoalescingQueue.front()->second.Deadline);
+
+        watcher->CollectEvents();
+        if(!watcher->m_DeliveryEvents.empty() && std::find(m_Deliveries.begin(), m_Deliveries.end(), watcher) == m_Deliveries.end())
+            m_Deliveries.push_back(watcher);
+
+        // The collected batch carries copies of it's directories' paths
+        if(state.PendingRenames.empty() && watcher->m_CoalescingQueue.empty())
+            state.Directories.ReleaseRetired();
+
+        state.WatchedDirectoryCount.Set(state.Directories.GetWatchedCount());
+        state.PendingRenameCount.Set(state.PendingRenames.size());
+    }
+}
+
+void FileWatcherReactor::DeliverWatchers() noexcept
+{
+    std::unique_lock lock(m_Mutex);
+
+    while(!m_Deliveries.empty())
+    {
+        FileWatcher* watcher{ m_Deliveries.front() };
+        m_Deliveries.erase(m_Deliveries.begin());
+        m_DeliveringWatcher = watcher;
+
+        // Unregistering the watcher from another thread waits for the callback, so the watcher outlives it
+        lock.unlock();
+        watcher->DeliverEvents();
+        lock.lock();
+
+        m_DeliveringWatcher = nullptr;
+        m_DeliveryFinished.notify_all();
+    }
+
+    // Stopped watchers still get the events queued before they stopped.
+    while(!m_StoppedWatchers.empty())
+        Unregister(m_StoppedWatchers.back());
+}
+
+void FileWatcherReactor::DispatchThreadWork() noexcept
+{
+#if FILEWATCHER_HAS_IO_URING
+    if(m_Ring.IsSetUp())
+    {
+        RingThreadWork();
+        return;
+    }
+#endif
+
+    while(m_IsRunning) [[likely]]
+    {
+        epoll_event readyEvents[s_MaxReadyEvents];
+
+        // Blocking on epoll avoids thread exhaustion
+        const int readyCount{ epoll_wait(m_EpollInstance, readyEvents, s_MaxReadyEvents, NextTimeout()) };
+        m_Syscalls.Add(1U);
+        if(readyCount == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            Broadcast(std::error_code(errno, std::system_category()));
+            goto quitDispatching;
+        }
+
+        bool readAvailable{ false };
+        CollectReadyEvents(readyEvents, readyCount, readAvailable);
+
+        if(!m_IsRunning)
+            continue;
+
+        if(readAvailable)
+        {
+            m_Wakeups.Add(1U);
+            if(!DrainEvents(0U))
+                goto quitDispatching;
+        }
+
+        for(const int source : m_ReadySources)
+            DrainSource(source);
+
+        RunPostedTasks();
+
+        // Pending moves are only expired once the queue is empty, so a pair split across reads still matches even if the deadline passed meanwhile.
+        ExpireTimers();
+    }
+
+quitDispatching:
+    m_IsRunning = false;
+}
+
+void FileWatcherReactor::CollectReadyEvents(const epoll_event* readyEvents, const int readyCount, bool& readAvailable) noexcept
+{
+    m_ReadySources.clear();
+    for(int i{ 0 }; i < readyCount; ++i)
+    {
+        if(readyEvents[i].data.fd == m_WakeupEvent)
+        {
+            eventfd_t value;
+            eventfd_read(m_WakeupEvent, &value);
+            m_Syscalls.Add(1U);
+        }
+        else if(readyEvents[i].data.fd == m_InotifyInstance)
+            readAvailable = true;
+        else
+            m_ReadySources.push_back(readyEvents[i].data.fd);
+    }
+}
+
+#if FILEWATCHER_HAS_IO_URING
+void FileWatcherReactor::RingThreadWork() noexcept
+{
+    while(m_IsRunning) [[likely]]
+    {
+        ArmRing();
+
+        const int result{ m_Ring.SubmitAndWait(NextTimeout()) };
+        m_Syscalls.Add(1U);
+        if(result < 0)
+        {
+            Broadcast(std::error_code(-result, std::system_category()));
+            break;
+        }
+
+        bool hasRead{ false };
+        bool isPolled{ false };
+        int readResult{ 0 };
+        m_Ring.ForEachCompletion([&](const io_uring_cqe& completion) noexcept
+        {
+            if(completion.user_data == s_InotifyReadTag)
+            {
+                m_IsReadPending = false;
+                hasRead = true;
+                readResult = completion.res;
+            }
+            else if(completion.user_data == s_EpollPollTag)
+            {
+                m_IsPollPending = false;
+                isPolled = true;
+            }
+        });
+
+        m_ReadySources.clear();
+        if(isPolled)
+        {
+            epoll_event readyEvents[s_MaxReadyEvents];
+            const int readyCount{ epoll_wait(m_EpollInstance, readyEvents, s_MaxReadyEvents, 0) };
+            m_Syscalls.Add(1U);
+
+            bool readAvailable{ false };
+            CollectReadyEvents(readyEvents, std::max(readyCount, 0), readAvailable);
+        }
+
+        if(!m_IsRunning)
+            break;
+
+        if(hasRead && readResult >= 0)
+        {
+            // The first read of the wakeup is already done, the queue is only read further if it might hold more
+            m_Wakeups.Add(1U);
+            if(!DispatchRead(static_cast<size_t>(readResult)))
+                m_LongestDrain.Raise(1U);
+            else if(!DrainEvents(1U))
+                break;
+        }
+        else if(hasRead && readResult != -EAGAIN && readResult != -EINTR && readResult != -ECANCELED)
+        {
+            Broadcast(std::error_code(-readResult, std::system_category()));
+            break;
+        }
+
+        for(const int source : m_ReadySources)
+            DrainSource(source);
+
+        RunPostedTasks();
+        ExpireTimers();
+    }
+
+    m_IsRunning = false;
+    CancelRing();
+}
+
+void FileWatcherReactor::ArmRing() noexcept
+{
+    // The kernel takes the poll mask as two swapped halves on big endian machines
+    constexpr auto pollMask{ [](const uint32_t mask) noexcept
+    {
+        if constexpr(std::endian::native == std::endian::big)
+            return (mask << 16U) | (mask >> 16U);
+        else
+            return mask;
+    } };
+
+    if(!m_IsReadPending)
+    {
+        // Armed before any watcher reserved the buffer, unlike a read which only follows events
+        const size_t watchBufferSize{ std::max(m_WatchBufferSize.load(std::memory_order_relaxed), s_MaxEventSize) };
+        if(m_WatchBuffer.size() < watchBufferSize)
+            m_WatchBuffer.resize(watchBufferSize);
+
+        // Registering waits for every request in flight on older kernels, so the poll of the epoll instance is cancelled first.
+        // Only happens when the buffer grows.
+        if(m_CanRegisterBuffer && !m_Ring.IsRegistered(m_WatchBuffer.data(), m_WatchBuffer.size()))
+        {
+            CancelRing();
+            m_Syscalls.Add(m_Ring.HasRegisteredBuffer() ? 2U : 1U);
+            m_CanRegisterBuffer = m_Ring.RegisterBuffer(m_WatchBuffer.data(), m_WatchBuffer.size());
+        }
+
+        // The instance is non-blocking, so it's polled first and the read runs once events are queued
+        io_uring_sqe* poll{ m_Ring.GetSubmission() };
+        io_uring_sqe* read{ m_Ring.GetSubmission() };
+        assert(poll != nullptr && read != nullptr);
+
+        poll->opcode = IORING_OP_POLL_ADD;
+        poll->flags = IOSQE_IO_LINK;
+        poll->fd = m_InotifyInstance;
+        poll->poll32_events = pollMask(POLLIN);
+        poll->user_data = s_InotifyPollTag;
+
+        read->opcode = m_CanRegisterBuffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        read->fd = m_InotifyInstance;
+        read->addr = reinterpret_cast<uint64_t>(m_WatchBuffer.data());
+        read->len = static_cast<uint32_t>(m_WatchBuffer.size());
+        read->buf_index = 0U;
+        read->user_data = s_InotifyReadTag;
+        m_IsReadPending = true;
+    }
+
+    if(!m_IsPollPending)
+    {
+        io_uring_sqe* poll{ m_Ring.GetSubmission() };
+        assert(poll != nullptr);
+
+        poll->opcode = IORING_OP_POLL_ADD;
+        poll->fd = m_EpollInstance;
+        poll->poll32_events = pollMask(POLLIN);
+        poll->user_data = s_EpollPollTag;
+        m_IsPollPending = true;
+    }
+}
+
+void FileWatcherReactor::CancelRing() noexcept
+{
+    // Cancelling the poll of the inotify instance cancels the read linked to it as well
+    for(const auto& [isPending, tag] : { std::pair(m_IsReadPending, s_InotifyPollTag), std::pair(m_IsPollPending, s_EpollPollTag) })
+    {
+        if(!isPending)
+            continue;
+
+        io_uring_sqe* cancel{ m_Ring.GetSubmission() };
+        if(cancel == nullptr)
+            break;
+
+        cancel->opcode = IORING_OP_ASYNC_CANCEL;
+        cancel->fd = -1;
+        cancel->addr = tag;
+        cancel->user_data = s_CancelTag;
+    }
+
+    // Events read meanwhile are dropped, as the reactor is shutting down or the poll is armed again right away
+    while(m_IsReadPending || m_IsPollPending)
+    {
+        m_Syscalls.Add(1U);
+        if(m_Ring.SubmitAndWait(-1) < 0)
+            break;
+
+        m_Ring.ForEachCompletion([this](const io_uring_cqe& completion) noexcept
+        {
+            if(completion.user_data == s_InotifyReadTag)
+                m_IsReadPending = false;
+            else if(completion.user_data == s_EpollPollTag)
+                m_IsPollPending = false;
+        });
+    }
+}
+#endif
+
+bool FileWatcherReactor::DrainEvents(uint64_t reads) noexcept
+{
+    while(m_IsRunning)
+    {
+        if(m_WatchBuffer.size() < m_WatchBufferSize.load(std::memory_order_relaxed))
+            m_WatchBuffer.resize(m_WatchBufferSize.load(std::memory_order_relaxed));
+
+        const ssize_t length{ read(m_InotifyInstance, m_WatchBuffer.data(), m_WatchBuffer.size()) };
+        m_Syscalls.Add(1U);
+        if(length == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            if(errno == EAGAIN)
+            {
+                ForgetScannedNames();
+                break;
+            }
+
+            Broadcast(std::error_code(errno, std::system_category()));
+            return false;
+        }
+
+        ++reads;
+        if(!DispatchRead(static_cast<size_t>(length)))
+            break;
+    }
+
+    m_LongestDrain.Raise(reads);
+
+    return true;
+}
+
+bool FileWatcherReactor::DispatchRead(const size_t length) noexcept
+{
+    m_Reads.Add(1U);
+    m_ReadBytes.Add(length);
+    m_BytesPerRead.Record(length);
+
+    DispatchEvents(m_WatchBuffer.data(), static_cast<int>(length));
+
+    // The kernel returns as many whole events as fit. If another event of maximum size would have fit, the queue was empty.
+    // Unless a scan ran meanwhile, whose duplicates have to be read before it's forgotten.
+    if(m_WatchBuffer.size() - length >= s_MaxEventSize && !m_IsScanPending)
+        return false;
+
+    // The buffer filled up, so a burst is in progress. Grow to fit everything that is queued, up to the limit.
+    int queuedBytes{ 0 };
+    m_Syscalls.Add(1U);
+    if(ioctl(m_InotifyInstance, FIONREAD, &queuedBytes) == 0 && static_cast<size_t>(queuedBytes) > m_WatchBuffer.size())
+    {
+        const size_t maxBufferSize{ m_MaxWatchBufferSize.load(std::memory_order_relaxed) };
+        const size_t grownBufferSize{ std::min(std::bit_ceil(static_cast<size_t>(queuedBytes)), maxBufferSize) };
+
+        if(grownBufferSize > m_WatchBuffer.size())
+        {
+            m_WatchBufferSize.store(grownBufferSize, std::memory_order_relaxed);
+            m_BufferGrowths.Add(1U);
+        }
+    }
+
+    return true;
+}
+
+void FileWatcherReactor::DrainSource(const int fileDescriptor) noexcept
+{
+    // Held while reading, so the owning watcher can't close the descriptor meanwhile.
+    std::unique_lock lock(m_Mutex);
+    m_Wakeups.Add(1U);
+
+    uint64_t reads{ 0U };
+    while(m_IsRunning)
+    {
+        const auto source{ m_Sources.find(fileDescriptor) };
+        if(source == m_Sources.end() || !source->second->m_IsWatching)
+            break;
+
+        FileWatcher* watcher{ source->second };
+        if(m_SourceBuffer.size() < m_WatchBufferSize.load(std::memory_order_relaxed))
+            m_SourceBuffer.resize(m_WatchBufferSize.load(std::memory_order_relaxed));
+
+        const ssize_t length{ read(fileDescriptor, m_SourceBuffer.data(), m_SourceBuffer.size()) };
+        m_Syscalls.Add(1U);
+        if(length == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            // Unlike the shared inotify instance, the group only concerns it's own watcher
+            if(errno != EAGAIN)
+            {
+                watcher->SetIsWatching(false);
+                watcher->QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, std::error_code(errno, std::system_category()));
+                m_StoppedWatchers.push_back(watcher);
+            }
+
+            break;
+        }
+
+        ++reads;
+        m_Reads.Add(1U);
+        m_ReadBytes.Add(static_cast<uint64_t>(length));
+        m_BytesPerRead.Record(static_cast<uint64_t>(length));
+
+        uint64_t events{ 0U };
+        ForEachFanotifyEvent(m_SourceBuffer.data(), static_cast<size_t>(length), [&events](const fanotify_event_metadata&, const std::byte*) noexcept
+        {
+            ++events;
+            return true;
+        });
+
+        m_Events.Add(events);
+        m_EventsPerRead.Record(events);
+
+        if(!watcher->ProcessFanotifyEvents(m_SourceBuffer.data(), static_cast<size_t>(length)))
+            m_StoppedWatchers.push_back(watcher);
+
+        // Delivered per read, the descriptor is looked up again once the lock is taken back
+        FlushWatchers();
+        lock.unlock();
+        DeliverWatchers();
+        lock.lock();
+    }
+
+    m_LongestDrain.Raise(reads);
+
+    FlushWatchers();
+    lock.unlock();
+    DeliverWatchers();
+}
+
+void FileWatcherReactor::ReserveWatchBuffer(const size_t watchBufferSize, const size_t maxWatchBufferSize) noexcept
+{
+    const auto raise{ [](std::atomic<size_t>& value, const size_t desired) noexcept
+    {
+        size_t current{ value.load(std::memory_order_relaxed) };
+        while(desired > current && !value.compare_exchange_weak(current, desired, std::memory_order_relaxed));
+    } };
+
+    // Reading fails with EINVAL if the next event doesn't fit.
+    raise(m_WatchBufferSize, std::max(watchBufferSize, s_MaxEventSize));
+    raise(m_MaxWatchBufferSize, std::max(maxWatchBufferSize, watchBufferSize));
+}
+
+FileWatcherStats FileWatcherReactor::GetStats() const noexcept
+{
+    FileWatcherStats stats
+    {
+        .WatchBufferSize{ m_WatchBufferSize.load(std::memory_order_relaxed) },
+        .Wakeups{ m_Wakeups.Load() },
+        .Reads{ m_Reads.Load() },
+        .ReadBytes{ m_ReadBytes.Load() },
+        .LongestDrain{ m_LongestDrain.Load() },
+        .BufferGrowths{ m_BufferGrowths.Load() },
+        .Syscalls{ m_Syscalls.Load() },
+#if FILEWATCHER_HAS_IO_URING
+        .IsUsingIoUring{ m_Ring.IsSetUp() },
+#endif
+        .Events{ m_Events.Load() },
+    };
+
+    m_BytesPerRead.AddTo(stats.BytesPerRead);
+    m_EventsPerRead.AddTo(stats.EventsPerRead);
+    return stats;
+}
+
+void FileWatcherReactor::DispatchEvents(const std::byte* watchBuffer, const int length) noexcept
+{
+    std::unique_lock lock(m_Mutex);
+
+    int i{ 0 };
+    uint64_t events{ 0U };
+    while(i < length)
+    {
+        const inotify_event* const event{ reinterpret_cast<const inotify_event*>(&watchBuffer[i]) };
+        i += (sizeof(inotify_event) + event->len);
+        ++events;
+
+        // The kernel dropped events, every watcher has to be told as there's no telling whose events were lost.
+        if(event->mask & IN_Q_OVERFLOW)
+        {
+            m_DispatchScratch.assign(m_Watchers.begin(), m_Watchers.end());
+            for(FileWatcher* watcher : m_DispatchScratch)
+                if(std::find(m_Watchers.begin(), m_Watchers.end(), watcher) != m_Watchers.end() && watcher->m_IsWatching)
+                    watcher->ProcessOverflow();
+
+            continue;
+        }
+
+        const std::vector<FileWatcher*>* subscribers{ m_Subscribers.Find(event->wd) };
+        if(!subscribers)
+            continue;
+
+        // Watchers may add or drop subscriptions from within the callback, so dispatch from a copy.
+        m_DispatchScratch.assign(subscribers->begin(), subscribers->end());
+        const uint64_t generation{ m_Generation };
+
+        for(FileWatcher* watcher : m_DispatchScratch)
+        {
+            // A callback might have destroyed another watcher subscribed to the same descriptor.
+            if(generation != m_Generation && !IsSubscribed(watcher, event->wd))
+                continue;
+
+            if(watcher->m_IsWatching && !watcher->ProcessEvent(event))
+                m_StoppedWatchers.push_back(watcher);
+        }
+
+        // The kernel has dropped the watch, so nobody is subscribed to it anymore.
+        if(event->mask & IN_IGNORED)
+        {
+            m_Subscribers.Erase(event->wd);
+            ++m_Generation;
+        }
+    }
+
+    m_Events.Add(events);
+    m_EventsPerRead.Record(events);
+
+    FlushWatchers();
+    lock.unlock();
+    DeliverWatchers();
+}
+
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, FileWatcherBatchCallback&& callback, const FileWatcherOptions& options, std::error_code& error) noexcept
+    :
+	m_IsWatching(false),
+	m_ObservedPath(observedPath),
+	m_Callback(std::move(callback)),
+	m_Options(options),
+	m_InternalState(nullptr)
+{
+    assert(m_Callback != nullptr);
+    CompileFilter();
+    StartDelivery();
+    SetupWatcher(error);
+}
+
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, const FileWatcherBatchCallback& callback, const FileWatcherOptions& options, std::error_code& error) noexcept
+    :
+	m_IsWatching(false),
+	m_ObservedPath(observedPath),
+	m_Callback(callback),
+	m_Options(options),
+	m_InternalState(nullptr)
+{
+    assert(m_Callback != nullptr);
+    CompileFilter();
+    StartDelivery();
+    SetupWatcher(error);
+}
+
+FileWatcher::~FileWatcher() noexcept
+{
+    if(m_IsReady && IsSnapshotted())
+    {
+        // What the snapshot thread listed before being cancelled isn't listed again
+        JoinSnapshot();
+
+        // Saved while still watching, so the changes made meanwhile are reported now rather than caught up on next time.
+        // A watcher which never finished catching up leaves the previous snapshot in place.
+        if(m_InternalState->Snapshot.IsCaughtUp)
+        {
+            std::error_code error;
+            WriteSnapshot(error, false);
+        }
+    }
+
+    SetIsWatching(false);
+
+    // The dispatch thread might be waiting for room in the delivery queue
+    StopDelivery();
+
+    if(m_InternalState)
+    {
+        // The crawler threads might start a rescan or the snapshot thread, so they're stopped first.
+        m_InternalState->Crawl.Cancel();
+        JoinCrawl();
+        JoinSnapshot();
+
+        // The rescan thread posts to the reactor, so it has to be gone before unregistering.
+        std::thread rescanWorker;
+        {
+            std::scoped_lock lock(m_InternalState->Rescan.Mutex);
+            m_InternalState->Rescan.IsCancelled = true;
+            rescanWorker = std::move(m_InternalState->Rescan.Worker);
+        }
+
+        if(rescanWorker.joinable())
+            rescanWorker.join();
+    }
+
+    // Once unregistered, the reactor no longer routes events to this watcher.
+    if(m_InternalState && m_InternalState->Reactor)
+        m_InternalState->Reactor->Unregister(this);
+}
+
+bool FileWatcher::IsWatching() const noexcept
+{
+    return m_IsWatching.load();
+}
+
+void FileWatcher::Stop() noexcept
+{
+    SetIsWatching(false);
+
+    // Releases the dispatch thread if it waits for room, events still queued are discarded
+    if(m_DeliveryLanes)
+        m_DeliveryLanes->Close();
+
+    if(!m_InternalState)
+        return;
+
+    m_InternalState->Crawl.Cancel();
+    m_InternalState->Snapshot.IsCancelled = true;
+
+    // The kernel drops the watches right away rather than once the watcher is destroyed. Unregistering is safe from within
+    // the callback, the dispatch thread checks the watchers it iterates over are still registered.
+    if(m_InternalState->Reactor)
+        m_InternalState->Reactor->Unregister(this);
+}
+
+FileWatcherStats FileWatcher::GetStats() const noexcept
+{
+    if(!m_InternalState || !m_InternalState->Reactor)
+        return FileWatcherStats{};
+
+    FileWatcherStats stats{ m_InternalState->Reactor->GetStats() };
+    stats.Callbacks = m_Callbacks.load(std::memory_order_relaxed);
+    stats.CoalescedEvents = m_CoalescedEventCount.load(std::memory_order_relaxed);
+    stats.QueueDepth = m_DeliveryLanes ? m_DeliveryLanes->GetSize() : 0U;
+    stats.QueueHighWaterMark = m_QueueHighWaterMark.load(std::memory_order_relaxed);
+    stats.DroppedEvents = m_DroppedEvents.load(std::memory_order_relaxed);
+    stats.UnchangedModifications = m_UnchangedModifications.load(std::memory_order_relaxed);
+    stats.WatchedDirectories = m_InternalState->WatchedDirectoryCount.Load();
+    stats.PendingRenames = m_InternalState->PendingRenameCount.Load();
+    stats.PendingRenamesHighWaterMark = m_InternalState->PendingRenameHighWaterMark.Load();
+
+    for(size_t i{ 0U }; i < m_CallbackDurationCount; ++i)
+        m_CallbackDurations[i].AddTo(stats.CallbackNanoseconds);
+
+    return stats;
+}
+
+void FileWatcher::SetupWatcher(std::error_code& error) noexcept
+{
+    // Targets are added once constructed, there's nothing to watch yet
+    if(m_ObservedPath.empty())
+    {
+        if(m_Options.Backend == EFileWatcherBackend::Fanotify)
+        {
+            error.assign(static_cast<int>(EFileWatcherError::TargetsNotSupported), FileWatcherCategory());
+            return;
+        }
+
+        std::shared_ptr<FileWatcherReactor> reactor{ FileWatcherReactor::Acquire(error) };
+        if(!reactor)
+            return;
+
+        reactor->ReserveWatchBuffer(m_Options.WatchBufferSize, m_Options.MaxWatchBufferSize);
+
+        m_InternalState = std::make_unique<FileWatcherInternalState>();
+        m_InternalState->Reactor = reactor;
+        if(IsSubscribed(EFileAction::Opened) || IsSubscribed(EFileAction::Accessed))
+            m_InternalState->OwnAccesses.Enable({});
+
+        {
+            const auto lock{ reactor->Lock() };
+            reactor->Register(this);
+            SetIsWatching(true);
+        }
+
+        FinishSetup();
+        return;
+    }
+
+    if (!std::filesystem::exists(m_ObservedPath))
+	{
+		if (m_ObservedPath.has_parent_path() && m_ObservedPath.has_filename())
+		{
+			m_ObservedFile = m_ObservedPath.filename();
+			m_ObservedPath = m_ObservedPath.parent_path();
+		}
+		else
+		{
+			error.assign(static_cast<int>(EFileWatcherError::SpecifiedFileDoesntExist), FileWatcherCategory());
+
+			return;
+		}
+	}
+
+	if (std::filesystem::is_regular_file(m_ObservedPath))
+	{
+		if (m_ObservedPath.has_parent_path())
+		{
+			if (m_ObservedPath.has_filename())
+			{
+				m_ObservedFile = m_ObservedPath.filename();
+				m_ObservedPath = m_ObservedPath.parent_path();
+			}
+			else
+			{
+                error.assign(static_cast<int>(EFileWatcherError::InvalidFile), FileWatcherCategory());
+				return;
+			}
+		}
+		else
+		{
+            error.assign(static_cast<int>(EFileWatcherError::RegularFileHasNoParentDirectory), FileWatcherCategory());
+			return;
+		}
+	}
+	if (m_Options.ReturnAbsolutePath)
+	{
+		m_ObservedPath = std::filesystem::absolute(m_ObservedPath, error);
+		if (error)
+			return;
+	}
+
+    std::shared_ptr<FileWatcherReactor> reactor{ FileWatcherReactor::Acquire(error) };
+    if(!reactor)
+        return;
+
+    reactor->ReserveWatchBuffer(m_Options.WatchBufferSize, m_Options.MaxWatchBufferSize);
+
+    m_InternalState = std::make_unique<FileWatcherInternalState>();
+    m_InternalState->Reactor = reactor;
+    if(IsSubscribed(EFileAction::Opened) || IsSubscribed(EFileAction::Accessed))
+        m_InternalState->OwnAccesses.Enable(m_ObservedPath.native());
+
+    // Nothing is registered per directory, so there's nothing to crawl either
+    if(m_Options.Backend == EFileWatcherBackend::Fanotify)
+    {
+        SetupFanotify(error);
+        if(!error)
+            FinishSetup();
+
+        return;
+    }
+
+    {
+        // Hold dispatch until the root descriptor is known, events for it are routed as soon as the lock is released.
+        const auto lock{ reactor->Lock() };
+        reactor->Register(this);
+
+        const std::string path{ m_ObservedPath.string() };
+        m_InternalState->RootWatchDescriptor = reactor->AddWatch(this, path.c_str(), GetWatchFlags(m_Options), error);
+        if(error)
+            return;
+
+        m_InternalState->Directories.Insert(m_InternalState->RootWatchDescriptor, path);
+
+        SetIsWatching(true);
+    }
+
+    // A single file has nothing to crawl
+    if(!m_ObservedFile.empty())
+    {
+        FinishSetup();
+        return;
+    }
+
+    StartCrawl(m_ObservedPath.native());
+    if(m_Options.AsynchronousSetup)
+        return;
+
+    // The constructing thread crawls as well
+    CrawlThreadWork(0U);
+    JoinCrawl();
+
+    if(m_InternalState->Crawl.Error)
+    {
+        error = m_InternalState->Crawl.Error;
+        SetIsWatching(false);
+        reactor->Unregister(this);
+        return;
+    }
+
+    FinishSetup();
+}
+
+void FileWatcher::AddTarget(const std::filesystem::path& target, std::error_code& error) noexcept
+{
+    if(!m_InternalState || !m_ObservedPath.empty() || m_Options.Backend == EFileWatcherBackend::Fanotify)
+    {
+        error.assign(static_cast<int>(EFileWatcherError::TargetsNotSupported), FileWatcherCategory());
+        return;
+    }
+
+    const std::string path{ NormalizeTarget(target, error) };
+    if(error)
+        return;
+
+    // Anything but a directory is watched through it's parent, so a file doesn't have to exist yet
+    std::string_view directory{ path };
+    std::string_view file{};
+
+    std::error_code statusError;
+    if(!std::filesystem::is_directory(path, statusError))
+    {
+        const size_t separator{ path.rfind('/') };
+        if(separator == std::string::npos)
+        {
+            const bool exists{ std::filesystem::exists(path, statusError) };
+            error.assign(static_cast<int>(exists ? EFileWatcherError::RegularFileHasNoParentDirectory : EFileWatcherError::SpecifiedFileDoesntExist), FileWatcherCategory());
+            return;
+        }
+
+        directory = directory.substr(0U, std::max<size_t>(separator, 1U));
+        file = std::string_view(path).substr(separator + 1U);
+    }
+
+    FileWatcherInternalState& state{ *m_InternalState };
+    const auto lock{ state.Reactor->Lock() };
+
+    const std::string directoryPath{ directory };
+    const int watchDescriptor{ state.Reactor->AddWatch(this, directoryPath.c_str(), GetWatchFlags(m_Options), error) };
+    if(watchDescriptor == -1)
+        return;
+
+    // Another path of the same directory shares it's watch, the events are reported relative to the path it was first added with
+    if(!state.Directories.IsWatched(watchDescriptor))
+    {
+        state.Directories.Insert(watchDescriptor, directoryPath);
+
+        if(m_Options.RescanOnOverflow)
+        {
+            std::vector<std::pair<int, std::filesystem::path>> directories;
+            directories.emplace_back(watchDescriptor, directoryPath);
+            StartRescan(std::move(directories));
+        }
+    }
+
+    FileWatcherTargetDirectory& targets{ state.Targets[watchDescriptor] };
+    if(file.empty())
+        targets.IsTarget = true;
+    else
+        targets.Files.emplace(file);
+
+    state.TargetDirectories.insert_or_assign(directoryPath, watchDescriptor);
+}
+
+void FileWatcher::RemoveTarget(const std::filesystem::path& target, std::error_code& error) noexcept
+{
+    if(!m_InternalState || !m_ObservedPath.empty() || m_Options.Backend == EFileWatcherBackend::Fanotify)
+    {
+        error.assign(static_cast<int>(EFileWatcherError::TargetsNotSupported), FileWatcherCategory());
+        return;
+    }
+
+    const std::string path{ NormalizeTarget(target, error) };
+    if(error)
+        return;
+
+    FileWatcherInternalState& state{ *m_InternalState };
+    const auto lock{ state.Reactor->Lock() };
+
+    // Looked up by the path alone, the target might have been replaced or removed since it was added
+    int watchDescriptor{ -1 };
+    if(const auto directory{ state.TargetDirectories.find(path) }; directory != state.TargetDirectories.end())
+    {
+        FileWatcherTargetDirectory& targets{ state.Targets[directory->second] };
+        if(targets.IsTarget)
+        {
+            targets.IsTarget = false;
+            watchDescriptor = directory->second;
+        }
+    }
+
+    if(const size_t separator{ path.rfind('/') }; watchDescriptor == -1 && separator != std::string::npos)
+    {
+        const auto directory{ state.TargetDirectories.find(std::string_view(path).substr(0U, std::max<size_t>(separator, 1U))) };
+        if(directory != state.TargetDirectories.end())
+        {
+            FileWatcherTargetDirectory& targets{ state.Targets[directory->second] };
+            if(const auto file{ targets.Files.find(std::string_view(path).substr(separator + 1U)) }; file != targets.Files.end())
+            {
+                targets.Files.erase(file);
+                watchDescriptor = directory->second;
+            }
+        }
+    }
+
+    if(watchDescriptor == -1)
+    {
+        error.assign(static_cast<int>(EFileWatcherError::TargetNotWatched), FileWatcherCategory());
+        return;
+    }
+
+    // The watch goes with the last target of the directory
+    const auto targets{ state.Targets.find(watchDescriptor) };
+    if(targets->second.IsTarget || !targets->second.Files.empty())
+        return;
+
+    ForgetTargets(watchDescriptor);
+    state.DirectorySnapshots.erase(watchDescriptor);
+    state.Reactor->ReleaseWatch(this, watchDescriptor);
+    state.Directories.Retire(watchDescriptor);
+    state.DirectoryHandles.Forget(static_cast<uint32_t>(watchDescriptor));
+}
+
+std::string FileWatcher::NormalizeTarget(const std::filesystem::path& target, std::error_code& error) const noexcept
+{
+    std::string path{ m_Options.ReturnAbsolutePath ? std::filesystem::absolute(target, error).native() : target.native() };
+    while(path.size() > 1U && path.back() == '/')
+        path.pop_back();
+
+    if(!error && path.empty())
+        error.assign(static_cast<int>(EFileWatcherError::InvalidFile), FileWatcherCategory());
+
+    return path;
+}
+
+bool FileWatcher::ForgetTargets(const int watchDescriptor) noexcept
+{
+    if(!m_InternalState->Targets.erase(watchDescriptor))
+        return false;
+
+    std::erase_if(m_InternalState->TargetDirectories, [watchDescriptor](const auto& directory) { return directory.second == watchDescriptor; });
+    return true;
+}
+
+bool FileWatcher::IsObserved(const int watchDescriptor, const std::string_view name) const noexcept
+{
+    if(!m_ObservedPath.empty())
+        return m_ObservedFile.empty() || m_ObservedFile.native() == name;
+
+    // A single lookup, no matter how many targets share the directory
+    const auto targets{ m_InternalState->Targets.find(watchDescriptor) };
+    return targets != m_InternalState->Targets.end() && (targets->second.IsTarget || targets->second.Files.contains(name));
+}
+
+void FileWatcher::FinishSetup() noexcept
+{
+    // Diffing lists the whole tree, so it's done by another thread rather than holding back the setup
+    if(IsSnapshotted())
+    {
+        FileWatcherSnapshotState& snapshot{ m_InternalState->Snapshot };
+        std::scoped_lock lock(snapshot.WorkerMutex);
+        if(!snapshot.IsCancelled)
+            snapshot.Worker = std::thread(&FileWatcher::SnapshotThreadWork, this);
+    }
+
+    const auto lock{ m_InternalState->Reactor->Lock() };
+
+    // The snapshot is built by the rescan thread, so it doesn't slow down the setup.
+    if(m_Options.RescanOnOverflow && m_Options.Backend != EFileWatcherBackend::Fanotify)
+        StartRescan(CollectWatchedDirectories(*m_InternalState));
+
+    m_IsReady = true;
+    if(m_Options.AsynchronousSetup)
+        m_InternalState->Reactor->Post(this, [this]() noexcept { QueueEvent(EFileAction::Ready, FileWatcherEvent::s_NoDirectory, {}); });
+}
+
+void FileWatcher::StartCrawl(const std::string_view rootPath) noexcept
+{
+    FileWatcherCrawl& crawl{ m_InternalState->Crawl };
+    const size_t maxThreads{ m_Options.CrawlerThreads ? m_Options.CrawlerThreads : std::max(std::thread::hardware_concurrency(), 1U) };
+
+    crawl.Queues.reserve(maxThreads);
+    for(size_t i{ 0U }; i < maxThreads; ++i)
+        crawl.Queues.push_back(std::make_unique<FileWatcherCrawlQueue>());
+
+    crawl.PendingTasks = 1U;
+    crawl.Queues.front()->Tasks.push_back(FileWatcherCrawlTask{ .Parent{}, .ParentWatchDescriptor{ -1 }, .Path{ std::string(rootPath) }, .NameOffset{ 0U } });
+
+    // A synchronous setup crawls on the constructing thread, further threads only start once there's enough work queued.
+    crawl.ActiveThreads = 1U;
+    if(m_Options.AsynchronousSetup)
+    {
+        std::scoped_lock lock(crawl.Mutex);
+        crawl.Workers.emplace_back(&FileWatcher::CrawlThreadWork, this, 0U);
+    }
+}
+
+void FileWatcher::JoinCrawl() noexcept
+{
+    FileWatcherCrawl& crawl{ m_InternalState->Crawl };
+
+    // Threads still crawling might start new ones
+    while(true)
+    {
+        std::vector<std::thread> workers;
+        {
+            std::scoped_lock lock(crawl.Mutex);
+            if(crawl.Workers.empty())
+                break;
+
+            workers = std::move(crawl.Workers);
+            crawl.Workers.clear();
+        }
+
+        for(std::thread& worker : workers)
+            worker.join();
+    }
+
+    // Closes the directories left behind by a cancelled crawl
+    for(std::unique_ptr<FileWatcherCrawlQueue>& queue : crawl.Queues)
+        queue->Tasks.clear();
+}
+
+void FileWatcher::CrawlThreadWork(const size_t queueIndex) noexcept
+{
+    FileWatcherCrawl& crawl{ m_InternalState->Crawl };
+    std::unique_ptr<std::byte[]> buffer{ new(std::nothrow) std::byte[s_CrawlBufferSize] };
+
+    while(buffer && !crawl.IsCancelled.load(std::memory_order_relaxed))
+    {
+        // Loaded before looking for a task, so a task queued meanwhile isn't slept through
+        const uint32_t changes{ crawl.Changes.load(std::memory_order_acquire) };
+        std::optional<FileWatcherCrawlTask> task;
+
+        // Own queue first, depth first, so a thread keeps few directories open
+        for(size_t i{ 0U }; i < crawl.Queues.size() && !task; ++i)
+        {
+            FileWatcherCrawlQueue& queue{ *crawl.Queues[(queueIndex + i) % crawl.Queues.size()] };
+            std::scoped_lock lock(queue.Mutex);
+            if(queue.Tasks.empty())
+                continue;
+
+            if(i == 0U)
+            {
+                task = std::move(queue.Tasks.back());
+                queue.Tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queue.Tasks.front());
+                queue.Tasks.pop_front();
+            }
+        }
+
+        if(!task)
+        {
+            // Tasks being crawled can still queue more
+            if(crawl.PendingTasks.load(std::memory_order_acquire) == 0U)
+                break;
+
+            crawl.Changes.wait(changes, std::memory_order_acquire);
+            continue;
+        }
+
+        CrawlDirectory(*task, queueIndex, buffer.get());
+
+        // The last task finishing lets the idle threads leave
+        if(crawl.PendingTasks.fetch_sub(1U, std::memory_order_acq_rel) == 1U)
+            crawl.NotifyChanged();
+    }
+
+    if(!buffer)
+        ReportCrawlError(FileWatcherCrawlTask{ .Parent{}, .ParentWatchDescriptor{ -1 }, .Path{}, .NameOffset{ 0U } }, std::make_error_code(std::errc::not_enough_memory));
+
+    // The last thread out completes an asynchronous setup
+    if(crawl.ActiveThreads.fetch_sub(1U, std::memory_order_acq_rel) == 1U && m_Options.AsynchronousSetup && !crawl.IsCancelled)
+        FinishSetup();
+}
+
+void FileWatcher::CrawlDirectory(FileWatcherCrawlTask& task, const size_t queueIndex, std::byte* buffer) noexcept
+{
+    FileWatcherCrawl& crawl{ m_InternalState->Crawl };
+    const bool isRoot{ task.ParentWatchDescriptor == -1 };
+
+    // Opening relative to the parent saves resolving the whole path again. The root might be a symbolic link to a directory.
+    const int directory
+    {
+        isRoot ?
+            open(task.Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+            m_InternalState->OwnAccesses.Open(task.Parent->FileDescriptor, task.Path.c_str() + task.NameOffset, task.Path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+    };
+
+    if(directory == -1)
+    {
+        // Removed or replaced meanwhile, which the parent reports on it's own
+        if(errno != ENOENT && errno != ENOTDIR && errno != ELOOP)
+            ReportCrawlError(task, std::error_code(errno, std::system_category()));
+
+        return;
+    }
+
+    const std::shared_ptr<FileWatcherDirectoryHandle> handle{ std::make_shared<FileWatcherDirectoryHandle>(directory) };
+    task.Parent.reset();
+
+    // The watch is added before listing, so whatever is created meanwhile is reported by the directory itself.
+    int watchDescriptor{ -1 };
+    if(isRoot)
+    {
+        // Stopping resets it under the reactor's lock, while the crawl might still be running
+        const auto lock{ m_InternalState->Reactor->Lock() };
+        watchDescriptor = m_InternalState->RootWatchDescriptor;
+        if(watchDescriptor == -1)
+            return;
+    }
+    else
+    {
+        const auto lock{ m_InternalState->Reactor->Lock() };
+
+        std::error_code error;
+        watchDescriptor = m_InternalState->Reactor->AddWatch(this, task.Path.c_str(), GetWatchFlags(m_Options), error);
+        if(watchDescriptor == -1)
+        {
+            ReportCrawlError(task, error);
+            return;
+        }
+
+        // The parent moved out of the tree or was deleted meanwhile
+        if(!m_InternalState->Directories.IsWatched(task.ParentWatchDescriptor))
+        {
+            if(!m_InternalState->Directories.IsWatched(watchDescriptor))
+                m_InternalState->Reactor->ReleaseWatch(this, watchDescriptor);
+
+            return;
+        }
+
+        m_InternalState->Directories.Insert(watchDescriptor, task.ParentWatchDescriptor, std::string_view(task.Path).substr(task.NameOffset));
+    }
+
+    const std::error_code error{ ListDirectoryEntries(directory, buffer, [this, &crawl, &task, &handle, queueIndex, watchDescriptor](const std::string_view name, const bool isDirectory) noexcept
+    {
+        if(!isDirectory)
+            return true;
+
+        FileWatcherCrawlTask subdirectory{ .Parent{ handle }, .ParentWatchDescriptor{ watchDescriptor }, .Path{}, .NameOffset{ 0U } };
+        subdirectory.Path.reserve(task.Path.size() + name.size() + 1U);
+        subdirectory.Path.append(task.Path);
+        if(subdirectory.Path.back() != '/')
+            subdirectory.Path.push_back('/');
+
+        subdirectory.NameOffset = subdirectory.Path.size();
+        subdirectory.Path.append(name);
+
+        if(IsExcludedDirectory(subdirectory.Path))
+            return true;
+
+        PushCrawlTask(queueIndex, std::move(subdirectory));
+        return !crawl.IsCancelled.load(std::memory_order_relaxed);
+    }) };
+
+    if(error)
+        ReportCrawlError(task, error);
+}
+
+void FileWatcher::PushCrawlTask(const size_t queueIndex, FileWatcherCrawlTask&& task) noexcept
+{
+    FileWatcherCrawl& crawl{ m_InternalState->Crawl };
+    const size_t pendingTasks{ crawl.PendingTasks.fetch_add(1U, std::memory_order_acq_rel) + 1U };
+
+    {
+        FileWatcherCrawlQueue& queue{ *crawl.Queues[queueIndex] };
+        std::scoped_lock lock(queue.Mutex);
+        queue.Tasks.push_back(std::move(task));
+    }
+
+    crawl.NotifyChanged();
+
+    // Small trees are crawled by a single thread, large ones get another thread for every few queued directories.
+    if(pendingTasks < s_CrawlTasksPerThread * crawl.ActiveThreads.load(std::memory_order_relaxed))
+        return;
+
+    std::scoped_lock lock(crawl.Mutex);
+    const size_t threadIndex{ crawl.ActiveThreads.load(std::memory_order_relaxed) };
+    if(threadIndex >= crawl.Queues.size() || crawl.IsCancelled)
+        return;
+
+    crawl.ActiveThreads.fetch_add(1U, std::memory_order_acq_rel);
+    crawl.Workers.emplace_back(&FileWatcher::CrawlThreadWork, this, threadIndex);
+}
+
+void FileWatcher::ReportCrawlError(const FileWatcherCrawlTask& task, const std::error_code& error) noexcept
+{
+    FileWatcherCrawl& crawl{ m_InternalState->Crawl };
+
+    // A synchronous setup fails as a whole
+    if(!m_Options.AsynchronousSetup)
+    {
+        std::scoped_lock lock(crawl.Mutex);
+        if(!crawl.Error)
+            crawl.Error = error;
+
+        crawl.Cancel();
+        return;
+    }
+
+    m_InternalState->Reactor->Post(this, [this, parentWatchDescriptor{ task.ParentWatchDescriptor }, name{ task.Path.substr(task.NameOffset) }, error]() noexcept
+    {
+        // The parent might be gone by now
+        if(parentWatchDescriptor != -1 && m_InternalState->Directories.Contains(parentWatchDescriptor))
+            QueueEvent(EFileAction::Error, static_cast<uint32_t>(parentWatchDescriptor), name, error);
+        else
+            QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, error);
+    });
+}
+
+bool FileWatcher::ProcessEvent(const inotify_event* const event) noexcept
+{
+    if(
+        event->mask & IN_IGNORED        ||
+        event->mask & IN_DELETE_SELF    ||
+        event->mask & IN_MOVE_SELF)     // Watched directory was deleted, renamed or the filesystem was unmounted.
+    {
+        if(m_InternalState->RootWatchDescriptor == event->wd)
+        {
+            SetIsWatching(false);
+            QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, std::error_code(static_cast<int>(EFileWatcherError::WatchedDirectoryWasDeleted), FileWatcherCategory()));
+            return false;
+        }
+        else if(event->mask & IN_MOVE_SELF && IsRecursive() && m_InternalState->Directories.IsWatched(event->wd))
+        {
+            // Everything inside a subdirectory moves along with it, so it's either relinked or it's whole subtree dropped
+            if(!RelinkMovedDirectory(event->wd))
+                ForgetSubtree(event->wd);
+        }
+        else if(m_InternalState->Directories.IsWatched(event->wd))
+        {
+            // Targets in the directory can't be watched any longer, the rest of the targets are
+            if(ForgetTargets(event->wd))
+                QueueEvent(EFileAction::Error, static_cast<uint32_t>(event->wd), {}, std::error_code(static_cast<int>(EFileWatcherError::WatchedDirectoryWasDeleted), FileWatcherCategory()));
+
+            m_InternalState->Reactor->ReleaseWatch(this, event->wd);
+            m_InternalState->Directories.Retire(event->wd);
+            m_InternalState->DirectoryHandles.Forget(static_cast<uint32_t>(event->wd));
+            m_InternalState->DirectorySnapshots.erase(event->wd);
+        }
+    }
+
+    if(event->len) // Length will be 0 if watch was removed.
+    {
+        const std::string_view name{ event->name };
+        const uint32_t directoryId{ static_cast<uint32_t>(event->wd) };
+        const bool isObserved{ IsObserved(event->wd, name) };
+        const bool isDirectory{ (event->mask & IN_ISDIR) != 0U };
+        std::vector<FileWatcherPendingRename>& pendingRenames{ m_InternalState->PendingRenames };
+
+        // Opening or reading an entry leaves it as it was
+        if(m_Options.RescanOnOverflow && isObserved && !(event->mask & (IN_OPEN | IN_ACCESS)))
+            UpdateSnapshot(event->wd, name);
+
+        if(IsSnapshotted() && !(event->mask & (IN_OPEN | IN_ACCESS | IN_CLOSE_NOWRITE)))
+            MarkSnapshotChanged(event->wd);
+
+        // A path moved out of the tree has to be reported before anything that happens to the same path afterwards.
+        if(!pendingRenames.empty() && !(event->mask & (IN_MOVED_FROM | IN_MOVED_TO)))
+        {
+            const auto pendingRename{ std::find_if(pendingRenames.begin(), pendingRenames.end(), [event, name](const FileWatcherPendingRename& rename) { return rename.OldWatchDescriptor == event->wd && rename.GetOldName() == name; }) };
+            if(pendingRename != pendingRenames.end())
+            {
+                if(isObserved)
+                    QueueEvent(EFileAction::Deleted, directoryId, name, {}, pendingRename->IsDirectory);
+
+                pendingRenames.erase(pendingRename);
+            }
+        }
+
+        // The scan of a new directory has already reported the entry
+        if(!m_InternalState->ScannedNames.empty())
+        {
+            const auto scannedNames{ m_InternalState->ScannedNames.find(event->wd) };
+            if(scannedNames != m_InternalState->ScannedNames.end())
+            {
+                const auto scannedName{ scannedNames->second.find(name) };
+                if(scannedName != scannedNames->second.end() && event->mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM))
+                {
+                    // Anything after the entry is gone again is new
+                    scannedNames->second.erase(scannedName);
+
+                    if(event->mask & IN_CREATE)
+                        return true;
+
+                    if(event->mask & IN_MOVED_TO)
+                    {
+                        // Only the old name of a move is news
+                        const auto pendingRename{ std::find_if(pendingRenames.begin(), pendingRenames.end(), [event](const FileWatcherPendingRename& rename) { return rename.Cookie == event->cookie; }) };
+                        if(pendingRename != pendingRenames.end())
+                        {
+                            if(IsObserved(pendingRename->OldWatchDescriptor, pendingRename->GetOldName()))
+                                QueueEvent(EFileAction::Deleted, static_cast<uint32_t>(pendingRename->OldWatchDescriptor), pendingRename->GetOldName(), {}, isDirectory);
+
+                            pendingRenames.erase(pendingRename);
+                        }
+
+                        return true;
+                    }
+                }
+            }
+        }
+
+        // A file was created. If the subject is a directory, we add a watch to keep track of it's contents.
+        if(event->mask & IN_CREATE)
+        {
+            if(isObserved)
+                QueueEvent(EFileAction::Created, directoryId, name, {}, isDirectory);
+
+            if(isDirectory && IsRecursive())
+                WatchNewDirectory(directoryId, name);
+        }
+        else if(event->mask & IN_DELETE)
+        {
+            if(isObserved)
+                QueueEvent(EFileAction::Deleted, directoryId, name, {}, isDirectory);
+        }
+        else if(event->mask & IN_MODIFY)
+        {
+            if(isObserved)
+                QueueEvent(EFileAction::Modified, directoryId, name, {}, isDirectory);
+        }
+        else if(event->mask & IN_MOVED_FROM)
+        {
+            // Closing an entry the watcher opened is reported by it's new path
+            if(!m_InternalState->OwnAccesses.IsEmpty())
+                m_InternalState->OwnAccesses.Forget(ResolvePath(directoryId, name, m_InternalState->PathBuffer));
+
+            // The pair usually follows immediately, the deadline only matters for moves out of the tree.
+            const auto deadline{ std::chrono::steady_clock::now() + m_Options.RenamePairingTimeout };
+            if(pendingRenames.empty())
+                ScheduleTimer(deadline);
+
+            FileWatcherPendingRename& pendingRename{ pendingRenames.emplace_back() };
+            pendingRename.Cookie = event->cookie;
+            pendingRename.OldWatchDescriptor = event->wd;
+            pendingRename.OldNameLength = static_cast<uint32_t>(name.copy(pendingRename.OldName.data(), pendingRename.OldName.size()));
+            pendingRename.Deadline = deadline;
+            pendingRename.IsDirectory = isDirectory;
+            m_InternalState->PendingRenameHighWaterMark.Raise(pendingRenames.size());
+        }
+        else if(event->mask & IN_MOVED_TO)
+        {
+            const auto pendingRename{ std::find_if(pendingRenames.begin(), pendingRenames.end(), [event](const FileWatcherPendingRename& rename) { return rename.Cookie == event->cookie; }) };
+            if(pendingRename != pendingRenames.end())
+            {
+                if(isObserved || IsObserved(pendingRename->OldWatchDescriptor, pendingRename->GetOldName()))
+                    QueueRename(static_cast<uint32_t>(pendingRename->OldWatchDescriptor), pendingRename->GetOldName(), directoryId, name, isDirectory);
+
+                // The kernel reports the watch of the directory moving right after
+                if(isDirectory && IsRecursive())
+                {
+                    m_InternalState->DirectoryMoves.push_back(FileWatcherDirectoryMove{ .OldParent{ pendingRename->OldWatchDescriptor }, .OldName{ std::string(pendingRename->GetOldName()) },
+                        .Parent{ event->wd }, .Name{ std::string(name) }, .Deadline{ pendingRename->Deadline } });
+
+                    ScheduleTimer(pendingRename->Deadline);
+                }
+
+                pendingRenames.erase(pendingRename);
+            }
+            else if(isObserved) // Moved in from outside of the tree.
+            {
+                QueueEvent(EFileAction::Created, directoryId, name, {}, isDirectory);
+
+                if(isDirectory && IsRecursive())
+                    WatchNewDirectory(directoryId, name);
+            }
+        }
+        else if(isObserved)
+        {
+            // The watcher's own accesses aren't news
+            FileWatcherOwnAccesses& ownAccesses{ m_InternalState->OwnAccesses };
+            if(event->mask & (IN_OPEN | IN_ACCESS | IN_CLOSE_NOWRITE) && !ownAccesses.IsEmpty() && ownAccesses.IsOwn(ResolvePath(directoryId, name, m_InternalState->PathBuffer), (event->mask & IN_CLOSE_NOWRITE) != 0U))
+                return true;
+
+            // Only requested if subscribed to, unless the watch is shared with another watcher, which QueueEvent drops
+            if(event->mask & IN_CLOSE_WRITE)
+                QueueEvent(EFileAction::CloseWrite, directoryId, name, {}, isDirectory);
+            else if(event->mask & IN_ATTRIB)
+                QueueEvent(EFileAction::AttributeChanged, directoryId, name, {}, isDirectory);
+            else if(event->mask & IN_OPEN)
+                QueueEvent(EFileAction::Opened, directoryId, name, {}, isDirectory);
+            else if(event->mask & IN_ACCESS)
+                QueueEvent(EFileAction::Accessed, directoryId, name, {}, isDirectory);
+        }
+    }
+
+    return true;
+}
+
+void FileWatcher::ProcessTimers(const std::chrono::steady_clock::time_point now) noexcept
+{
+    std::vector<FileWatcherPendingRename>& pendingRenames{ m_InternalState->PendingRenames };
+
+    // The pair never arrived, so the file was moved out of the tree.
+    auto pendingRename{ pendingRenames.begin() };
+    for(; pendingRename != pendingRenames.end() && pendingRename->Deadline <= now; ++pendingRename)
+    {
+        if(IsObserved(pendingRename->OldWatchDescriptor, pendingRename->GetOldName()))
+            QueueEvent(EFileAction::Deleted, static_cast<uint32_t>(pendingRename->OldWatchDescriptor), pendingRename->GetOldName(), {}, pendingRename->IsDirectory);
+    }
+
+    pendingRenames.erase(pendingRenames.begin(), pendingRename);
+
+    // The directory wasn't watched, such as an excluded one
+    std::vector<FileWatcherDirectoryMove>& directoryMoves{ m_InternalState->DirectoryMoves };
+    directoryMoves.erase(directoryMoves.begin(), std::find_if(directoryMoves.begin(), directoryMoves.end(), [now](const FileWatcherDirectoryMove& move) { return move.Deadline > now; }));
+
+    // This timer has fired, the next one is armed for whichever deadline comes first.
+    m_InternalState->TimerDeadline = std::chrono::steady_clock::time_point::max();
+    if(!pendingRenames.empty())
+        ScheduleTimer(pendingRenames.front().Deadline);
+
+    if(!directoryMoves.empty())
+        ScheduleTimer(directoryMoves.front().Deadline);
+
+    if(const std::optional<std::chrono::steady_clock::time_point> coalescingDeadline{ ExpireCoalescedEvents(now) })
+        ScheduleTimer(*coalescingDeadline);
+}
+
+void FileWatcher::ScheduleTimer(const std::chrono::steady_clock::time_point deadline) noexcept
+{
+    // A timer armed for an earlier deadline reschedules when it fires
+    if(deadline >= m_InternalState->TimerDeadline)
+        return;
+
+    m_InternalState->TimerDeadline = deadline;
+    m_InternalState->Reactor->ScheduleTimer(this, deadline);
+}
+
+void FileWatcher::ProcessOverflow() noexcept
+{
+    // The closing of the watcher's own accesses might have been lost
+    m_InternalState->OwnAccesses.Clear();
+
+    // Nothing tells which directories changed, so saving the snapshot lists all of them again
+    if(IsSnapshotted())
+    {
+        std::scoped_lock lock(m_InternalState->Snapshot.ChangesMutex);
+        m_InternalState->Snapshot.IsEverythingChanged = true;
+    }
+
+    QueueEvent(EFileAction::Overflow, FileWatcherEvent::s_NoDirectory, {}, std::error_code(static_cast<int>(EFileWatcherError::EventQueueOverflow), FileWatcherCategory()));
+
+    if(m_Options.RescanOnOverflow && m_Options.Backend != EFileWatcherBackend::Fanotify)
+        StartRescan(CollectWatchedDirectories(*m_InternalState));
+}
+
+void FileWatcher::StartRescan(std::vector<std::pair<int, std::filesystem::path>>&& directories) noexcept
+{
+    FileWatcherRescan& rescan{ m_InternalState->Rescan };
+    std::thread finishedWorker;
+
+    {
+        std::scoped_lock lock(rescan.Mutex);
+        if(rescan.IsCancelled)
+            return;
+
+        for(std::pair<int, std::filesystem::path>& directory : directories)
+            rescan.PendingDirectories.push_back(std::move(directory));
+
+        if(!rescan.IsRunning)
+        {
+            finishedWorker = std::move(rescan.Worker);
+            rescan.IsRunning = true;
+            rescan.Worker = std::thread(&FileWatcher::RescanThreadWork, this);
+        }
+    }
+
+    // The previous worker has already left it's loop
+    if(finishedWorker.joinable())
+        finishedWorker.join();
+}
+
+void FileWatcher::RescanThreadWork() noexcept
+{
+    FileWatcherRescan& rescan{ m_InternalState->Rescan };
+    std::vector<FileWatcherDirectoryListing> listings;
+    size_t listedEntries{ 0U };
+
+    // Listings are handed over in batches, the dispatch thread diffs them in small steps between reading events.
+    const auto postListings{ [this, &listings, &listedEntries]() noexcept
+    {
+        if(listings.empty())
+            return;
+
+        m_InternalState->Reactor->Post(this, [this, batch{ std::make_shared<std::vector<FileWatcherDirectoryListing>>(std::move(listings)) }]() noexcept
+        {
+            for(FileWatcherDirectoryListing& listing : *batch)
+                ApplyRescan(listing);
+        });
+
+        listings.clear();
+        listedEntries = 0U;
+    } };
+
+    while(true)
+    {
+        std::pair<int, std::filesystem::path> directory;
+        {
+            std::scoped_lock lock(rescan.Mutex);
+            if(rescan.IsCancelled || rescan.PendingDirectories.empty())
+            {
+                // Posting before leaving makes sure directories found by the last batch start a new worker.
+                if(!rescan.IsCancelled)
+                    postListings();
+
+                rescan.IsRunning = false;
+                return;
+            }
+
+            directory = std::move(rescan.PendingDirectories.front());
+            rescan.PendingDirectories.pop_front();
+        }
+
+        listings.push_back(ListDirectory(directory.first, std::move(directory.second), m_ObservedFile, m_InternalState->OwnAccesses));
+        listedEntries += listings.back().Entries.size() + 1U;
+
+        if(listedEntries >= s_RescanBatchSize)
+            postListings();
+    }
+}
+
+void FileWatcher::ApplyRescan(FileWatcherDirectoryListing& listing) noexcept
+{
+    FileWatcherInternalState& state{ *m_InternalState };
+    const int watchDescriptor{ listing.WatchDescriptor };
+    const bool isRoot{ watchDescriptor == state.RootWatchDescriptor };
+
+    // The directory might have stopped being watched since it was listed.
+    if(!isRoot)
+    {
+        const std::optional<std::string_view> directory{ state.Directories.Find(watchDescriptor) };
+        if(!directory || !state.Directories.IsWatched(watchDescriptor) || *directory != listing.Path.native())
+            return;
+    }
+
+    const auto snapshot{ state.DirectorySnapshots.find(watchDescriptor) };
+    if(!listing.Exists)
+    {
+        // The kernel reports the root going away on it's own.
+        if(isRoot)
+            return;
+
+        if(snapshot != state.DirectorySnapshots.end())
+        {
+            for(auto&& [name, entry] : snapshot->second)
+                if(IsObserved(watchDescriptor, name))
+                    QueueEvent(EFileAction::Deleted, static_cast<uint32_t>(watchDescriptor), name, {}, entry.IsDirectory);
+
+            state.DirectorySnapshots.erase(snapshot);
+        }
+
+        ForgetTargets(watchDescriptor);
+        state.Reactor->ReleaseWatch(this, watchDescriptor);
+        state.Directories.Retire(watchDescriptor);
+        state.DirectoryHandles.Forget(static_cast<uint32_t>(watchDescriptor));
+        return;
+    }
+
+    // The first listing of a directory only records it's contents.
+    if(snapshot == state.DirectorySnapshots.end())
+    {
+        FileWatcherDirectorySnapshot& directorySnapshot{ state.DirectorySnapshots[watchDescriptor] };
+        directorySnapshot.reserve(listing.Entries.size());
+
+        for(auto&& [name, entry] : listing.Entries)
+            directorySnapshot.emplace(std::move(name), entry);
+
+        return;
+    }
+
+    FileWatcherDirectorySnapshot& directorySnapshot{ snapshot->second };
+    std::vector<std::string> candidates;
+    size_t foundEntries{ 0U };
+
+    for(auto&& [name, entry] : listing.Entries)
+    {
+        const auto previous{ directorySnapshot.find(name) };
+        if(previous == directorySnapshot.end())
+            candidates.push_back(name);
+        else
+        {
+            ++foundEntries;
+            if(HasChanged(previous->second, entry))
+                candidates.push_back(name);
+        }
+    }
+
+    // Something in the snapshot wasn't listed anymore
+    if(foundEntries != directorySnapshot.size())
+    {
+        std::unordered_set<std::string_view> listedNames;
+        listedNames.reserve(listing.Entries.size());
+        for(auto&& [name, _] : listing.Entries)
+            listedNames.insert(name);
+
+        for(auto&& [name, _] : directorySnapshot)
+            if(!listedNames.contains(name))
+                candidates.push_back(name);
+    }
+
+    // The listing is already stale, so every candidate is confirmed against the file system before being reported.
+    std::vector<std::pair<int, std::filesystem::path>> newDirectories;
+    for(const std::string& name : candidates)
+    {
+        // A directory holding targets is listed as a whole
+        if(!IsObserved(watchDescriptor, name))
+            continue;
+
+        std::filesystem::path file{ listing.Path / name };
+        const std::optional<FileWatcherSnapshotEntry> current{ StatSnapshotEntry(AT_FDCWD, file.c_str()) };
+        const auto previous{ directorySnapshot.find(name) };
+
+        if(!current)
+        {
+            if(previous != directorySnapshot.end())
+            {
+                QueueEvent(EFileAction::Deleted, static_cast<uint32_t>(watchDescriptor), name, {}, previous->second.IsDirectory);
+                directorySnapshot.erase(previous);
+            }
+
+            continue;
+        }
+
+        const bool isReplaced{ previous != directorySnapshot.end() && previous->second.IsDirectory != current->IsDirectory };
+        if(previous != directorySnapshot.end() && !isReplaced && !HasChanged(previous->second, *current))
+            continue;
+
+        if(previous == directorySnapshot.end() || isReplaced || current->IsDirectory)
+        {
+            if(previous != directorySnapshot.end())
+                QueueEvent(EFileAction::Deleted, static_cast<uint32_t>(watchDescriptor), name, {}, previous->second.IsDirectory);
+
+            directorySnapshot.insert_or_assign(name, *current);
+            if(current->IsDirectory && IsRecursive() && !IsExcludedDirectory(file.native()))
+            {
+                std::error_code error;
+                const int subdirectoryWatchHandle{ state.Reactor->AddWatch(this, file.c_str(), GetWatchFlags(m_Options), error) };
+
+                if(subdirectoryWatchHandle != -1)
+                {
+                    state.Directories.Insert(subdirectoryWatchHandle, watchDescriptor, name);
+
+                    // Everything inside is new as well, so the listing of the directory is diffed against nothing.
+                    state.DirectorySnapshots.try_emplace(subdirectoryWatchHandle);
+                    newDirectories.emplace_back(subdirectoryWatchHandle, file);
+                }
+                else
+                    QueueEvent(EFileAction::Error, static_cast<uint32_t>(watchDescriptor), name, error);
+            }
+
+            QueueEvent(EFileAction::Created, static_cast<uint32_t>(watchDescriptor), name, {}, current->IsDirectory);
+        }
+        else
+        {
+            previous->second = *current;
+            QueueEvent(EFileAction::Modified, static_cast<uint32_t>(watchDescriptor), name, {}, current->IsDirectory);
+        }
+    }
+
+    if(!newDirectories.empty())
+        StartRescan(std::move(newDirectories));
+}
+
+int FileWatcher::WatchSubdirectory(const uint32_t directoryId, const std::string_view name) noexcept
+{
+    FileWatcherInternalState& state{ *m_InternalState };
+    const FileWatcherStringView file{ ResolvePath(directoryId, name, state.PathBuffer) };
+
+    // Nothing inside an excluded directory is reported, so it isn't watched at all
+    if(IsExcludedDirectory(file))
+        return -1;
+
+    std::error_code error;
+    const int subdirectoryWatchHandle{ state.Reactor->AddWatch(this, state.PathBuffer.c_str(), GetWatchFlags(m_Options), error) };
+    if(subdirectoryWatchHandle == -1)
+    {
+        QueueEvent(EFileAction::Error, directoryId, name, error);
+        return -1;
+    }
+
+    state.Directories.Insert(subdirectoryWatchHandle, static_cast<int>(directoryId), name);
+
+    // Filled by the scan, the directory has been empty before that
+    if(m_Options.RescanOnOverflow)
+        state.DirectorySnapshots.try_emplace(subdirectoryWatchHandle);
+
+    return subdirectoryWatchHandle;
+}
+
+void FileWatcher::WatchNewDirectory(const uint32_t directoryId, const std::string_view name) noexcept
+{
+    FileWatcherInternalState& state{ *m_InternalState };
+
+    const int subdirectoryWatchHandle{ WatchSubdirectory(directoryId, name) };
+    if(subdirectoryWatchHandle == -1)
+        return;
+
+    if(state.ScanBuffer.empty())
+        state.ScanBuffer.resize(s_CrawlBufferSize);
+
+    // Whatever was created before the watch was added is reported by listing the new subtree, depth first.
+    state.ScanStack.push_back(subdirectoryWatchHandle);
+    while(!state.ScanStack.empty())
+    {
+        const int watchDescriptor{ state.ScanStack.back() };
+        state.ScanStack.pop_back();
+
+        if(const std::optional<std::string_view> path{ state.Directories.Find(watchDescriptor) })
+            state.PathBuffer.assign(*path);
+        else
+            continue;
+
+        // Removed again meanwhile, which the events tell
+        const int directory{ state.OwnAccesses.Open(state.PathBuffer.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) };
+        if(directory == -1)
+            continue;
+
+        state.Reactor->MarkScanned();
+        auto& scannedNames{ state.ScannedNames[watchDescriptor] };
+
+        const std::error_code error{ ListDirectoryEntries(directory, state.ScanBuffer.data(), [this, &state, &scannedNames, watchDescriptor](const std::string_view entryName, const bool isDirectory) noexcept
+        {
+            const uint32_t scannedDirectoryId{ static_cast<uint32_t>(watchDescriptor) };
+            if(!scannedNames.emplace(entryName).second)
+                return true;
+
+            QueueEvent(EFileAction::Created, scannedDirectoryId, entryName, {}, isDirectory);
+            if(m_Options.RescanOnOverflow)
+                UpdateSnapshot(watchDescriptor, entryName);
+
+            if(isDirectory)
+                if(const int subdirectoryWatchHandle{ WatchSubdirectory(scannedDirectoryId, entryName) }; subdirectoryWatchHandle != -1)
+                    state.ScanStack.push_back(subdirectoryWatchHandle);
+
+            return true;
+        }) };
+
+        close(directory);
+
+        if(error)
+            QueueEvent(EFileAction::Error, static_cast<uint32_t>(watchDescriptor), {}, error);
+    }
+}
+
+bool FileWatcher::RelinkMovedDirectory(const int watchDescriptor) noexcept
+{
+    FileWatcherInternalState& state{ *m_InternalState };
+    std::vector<FileWatcherDirectoryMove>& directoryMoves{ state.DirectoryMoves };
+
+    // The directory is still stored under the name it was moved from
+    const auto move{ std::find_if(directoryMoves.begin(), directoryMoves.end(), [&state, watchDescriptor](const FileWatcherDirectoryMove& move)
+    {
+        return state.Directories.IsEntryOf(watchDescriptor, move.OldParent, move.OldName);
+    }) };
+
+    if(move == directoryMoves.end())
+        return false;
+
+    const int parentWatchDescriptor{ move->Parent };
+    const std::string name{ std::move(move->Name) };
+    directoryMoves.erase(move);
+
+    if(!state.Directories.IsWatched(parentWatchDescriptor) || state.Directories.IsWithin(parentWatchDescriptor, watchDescriptor))
+        return false;
+
+    ResolveQueuedEvents(watchDescriptor);
+    state.Directories.Insert(watchDescriptor, parentWatchDescriptor, name);
+
+    // Nothing inside an excluded directory is reported
+    return !IsExcludedDirectory(*state.Directories.Find(watchDescriptor));
+}
+
+void FileWatcher::ForgetSubtree(const int watchDescriptor) noexcept
+{
+    FileWatcherInternalState& state{ *m_InternalState };
+
+    std::vector<int> subtree;
+    state.Directories.CollectSubtree(watchDescriptor, subtree);
+    state.Reactor->ReleaseWatches(this, subtree);
+
+    for(const int subdirectory : subtree)
+    {
+        state.Directories.Retire(subdirectory);
+        state.DirectoryHandles.Forget(static_cast<uint32_t>(subdirectory));
+        state.DirectorySnapshots.erase(subdirectory);
+    }
+}
+
+void FileWatcher::ResolveQueuedEvents(const int watchDescriptor) noexcept
+{
+    FileWatcherInternalState& state{ *m_InternalState };
+    const auto resolve{ [this, &state, watchDescriptor](uint32_t& directoryId, uint32_t& nameOffset, uint32_t& nameLength) noexcept
+    {
+        if(directoryId == FileWatcherEvent::s_NoDirectory || directoryId == FileWatcherEvent::s_ResolvedPath || !state.Directories.IsWithin(static_cast<int>(directoryId), watchDescriptor))
+            return;
+
+        // Resolved aside first, as the names are about to grow
+        ResolvePath(directoryId, std::string_view(m_BatchNames).substr(nameOffset, nameLength), state.PathBuffer);
+        directoryId = FileWatcherEvent::s_ResolvedPath;
+        nameOffset = static_cast<uint32_t>(m_BatchNames.size());
+        nameLength = static_cast<uint32_t>(state.PathBuffer.size());
+        m_BatchNames.append(state.PathBuffer);
+    } };
+
+    for(QueuedEvent& queuedEvent : m_QueuedEvents)
+    {
+        resolve(queuedEvent.DirectoryId, queuedEvent.NameOffset, queuedEvent.NameLength);
+        resolve(queuedEvent.OldDirectoryId, queuedEvent.OldNameOffset, queuedEvent.OldNameLength);
+    }
+}
+
+void FileWatcher::UpdateSnapshot(const int watchDescriptor, const std::string_view name) noexcept
+{
+    // A directory which wasn't listed yet will be by the rescan thread
+    const auto snapshot{ m_InternalState->DirectorySnapshots.find(watchDescriptor) };
+    if(snapshot == m_InternalState->DirectorySnapshots.end())
+        return;
+
+    ResolvePath(static_cast<uint32_t>(watchDescriptor), name, m_InternalState->PathBuffer);
+    const std::optional<FileWatcherSnapshotEntry> current{ StatSnapshotEntry(AT_FDCWD, m_InternalState->PathBuffer.c_str()) };
+    const auto previous{ snapshot->second.find(name) };
+
+    if(!current)
+    {
+        if(previous != snapshot->second.end())
+            snapshot->second.erase(previous);
+    }
+    else if(previous != snapshot->second.end())
+        previous->second = *current;
+    else
+        snapshot->second.emplace(name, *current);
+}
+
+void FileWatcher::MarkSnapshotChanged(const int watchDescriptor) noexcept
+{
+    const std::optional<std::string_view> directory{ m_InternalState->Directories.Find(watchDescriptor) };
+    if(!directory)
+        return;
+
+    // Most events concern a directory already marked, which is looked up without allocating
+    const std::string_view relativePath{ GetRelativePath(m_ObservedPath.native(), *directory) };
+    FileWatcherSnapshotState& snapshot{ m_InternalState->Snapshot };
+    std::scoped_lock lock(snapshot.ChangesMutex);
+    if(!snapshot.ChangedDirectories.contains(relativePath))
+        snapshot.ChangedDirectories.emplace(relativePath);
+}
+
+void FileWatcher::SaveSnapshot(std::error_code& error) const noexcept
+{
+    if(!IsSnapshotted())
+    {
+        error.assign(static_cast<int>(EFileWatcherError::SnapshotNotSupported), FileWatcherCategory());
+        return;
+    }
+
+    WriteSnapshot(error, false);
+}
+
+void FileWatcher::WriteSnapshot(std::error_code& error, const bool isCancellable) const noexcept
+{
+    FileWatcherSnapshotState& snapshot{ m_InternalState->Snapshot };
+    std::scoped_lock saving(snapshot.SaveMutex);
+
+    const int64_t listedAt{ GetRealTime() };
+
+    const std::string& rootPath{ m_ObservedPath.native() };
+    const std::optional<FileWatcherSnapshotEntry> root{ StatSnapshotEntry(AT_FDCWD, rootPath.c_str()) };
+    if(!root)
+    {
+        error.assign(errno, std::system_category());
+        return;
+    }
+
+    std::unique_ptr<std::byte[]> buffer{ new(std::nothrow) std::byte[s_CrawlBufferSize] };
+    if(!buffer)
+    {
+        error = std::make_error_code(std::errc::not_enough_memory);
+        return;
+    }
+
+    // Taken before listing, so a directory changed meanwhile is listed again next time
+    std::unordered_set<std::string, FileWatcherNameHash, std::equal_to<>> changedDirectories;
+    {
+        std::scoped_lock lock(snapshot.ChangesMutex);
+        changedDirectories.swap(snapshot.ChangedDirectories);
+        if(std::exchange(snapshot.IsEverythingChanged, false))
+            snapshot.Listings.clear();
+    }
+
+    FileWatcherTreeSnapshotBuilder builder;
+    builder.AddRoot(root->Inode, root->Size, root->ModificationTime, root->CreationTime);
+
+    FileWatcherSnapshotListings listings;
+    std::string path;
+    std::string file;
+
+    // Records are visited in the order they're added, so the directories are listed breadth first and their entries appended as a block.
+    // Every entry is stat'ed before it's directory is listed, so a change racing with the listing leaves the recorded modification time behind.
+    for(uint32_t index{ 0U }; index < builder.GetRecords().size(); ++index)
+    {
+        if(!builder.GetRecords()[index].IsDirectory)
+            continue;
+
+        if(isCancellable && snapshot.IsCancelled.load(std::memory_order_relaxed))
+        {
+            // What was listed so far is kept for the next save, every directory not listed again yet is still changed
+            while(!listings.empty())
+            {
+                auto listing{ listings.extract(listings.begin()) };
+                snapshot.Listings.erase(listing.key());
+                snapshot.Listings.insert(std::move(listing));
+            }
+
+            std::scoped_lock lock(snapshot.ChangesMutex);
+            snapshot.ChangedDirectories.merge(changedDirectories);
+            return;
+        }
+
+        builder.GetView().GetPath(index, rootPath, path);
+        if(IsExcludedDirectory(path))
+            continue;
+
+        // Reused unless an event was read for the directory, or it was replaced, which the parent's listing tells
+        const std::string_view relativePath{ GetRelativePath(rootPath, path) };
+        const FileWatcherTreeSnapshotRecord& record{ builder.GetRecords()[index] };
+        const auto listed{ snapshot.Listings.find(relativePath) };
+        const bool isReused{ listed != snapshot.Listings.end() && listed->second.Inode == record.Inode && listed->second.CreationTime == record.CreationTime &&
+            !changedDirectories.contains(relativePath) };
+
+        FileWatcherSnapshotListings::iterator listing;
+        if(isReused)
+        {
+            listing = listings.insert(snapshot.Listings.extract(listed)).position;
+
+            // A changed subdirectory's own modification time is only recorded here
+            for(auto& [name, entry] : listing->second.Entries)
+            {
+                if(!entry.IsDirectory)
+                    continue;
+
+                file.assign(path).append("/").append(name);
+                if(!changedDirectories.contains(GetRelativePath(rootPath, file)))
+                    continue;
+
+                if(const std::optional<FileWatcherSnapshotEntry> current{ StatSnapshotEntry(AT_FDCWD, file.c_str()) })
+                    entry = *current;
+            }
+        }
+        else
+        {
+            const int directory{ m_InternalState->OwnAccesses.Open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) };
+            if(directory == -1)
+                continue;
+
+            FileWatcherSnapshotListing listedEntries{ .Inode{ record.Inode }, .CreationTime{ record.CreationTime } };
+            const std::error_code listError{ ListDirectoryEntries(directory, buffer.get(), [directory, &listedEntries](const std::string_view name, const bool) noexcept
+            {
+                // The name points into the listed record, which terminates it
+                if(const std::optional<FileWatcherSnapshotEntry> entry{ StatSnapshotEntry(directory, name.data()) })
+                    listedEntries.Entries.emplace_back(name, *entry);
+
+                return true;
+            }) };
+
+            close(directory);
+            if(listError)
+                continue;
+
+            std::sort(listedEntries.Entries.begin(), listedEntries.Entries.end(), [](const auto& left, const auto& right) noexcept { return left.first < right.first; });
+            listing = listings.emplace(relativePath, std::move(listedEntries)).first;
+        }
+
+        builder.BeginDirectory(index);
+        for(const auto& [name, entry] : listing->second.Entries)
+        {
+            if(!builder.AddEntry(index, name, entry.Inode, entry.Size, entry.ModificationTime, entry.CreationTime, entry.IsDirectory))
+            {
+                // Nothing is reused from a snapshot which can't be written
+                snapshot.Listings.clear();
+                error = std::make_error_code(std::errc::value_too_large);
+                return;
+            }
+        }
+    }
+
+    // Directories no longer in the tree are dropped along with the previous listings
+    snapshot.Listings = std::move(listings);
+    const int64_t settledAt{ SettleSnapshot(builder.GetView(), rootPath, listedAt, GetSnapshotRacyPeriod(rootPath.c_str())) };
+    error = WriteSnapshotFile(m_Options.SnapshotPath, builder.MakeHeader(settledAt), builder.GetRecords(), builder.GetNames());
+}
+
+void FileWatcher::JoinSnapshot() noexcept
 {
-    assert(m_Callback != nullptr);
-    SetupWatcher(returnAbsolutePath, error);
+    FileWatcherSnapshotState& snapshot{ m_InternalState->Snapshot };
+    std::thread worker;
+    {
+        // Once cancelled, finishing the setup doesn't start it
+        std::scoped_lock lock(snapshot.WorkerMutex);
+        snapshot.IsCancelled = true;
+        worker = std::move(snapshot.Worker);
+    }
+
+    if(worker.joinable())
+        worker.join();
 }
 
-FileWatcher::FileWatcher(const std::filesystem::path& observedPath, const FileWatcherCallback& callback, const bool returnAbsolutePath, std::error_code& error) noexcept
-    :
-	m_IsWatching(false),
-	m_ObservedPath(observedPath),
-	m_Callback(std::move(callback)),
-	m_WatcherThread{},
-	m_InternalState(nullptr)
+void FileWatcher::SnapshotThreadWork() noexcept
 {
-    assert(m_Callback != nullptr);
-    SetupWatcher(returnAbsolutePath, error);
+    if(!CatchUpSnapshot())
+        return;
+
+    m_InternalState->Snapshot.IsCaughtUp = true;
+
+    // Saved right away, so the destructor only lists the directories changed from now on
+    std::error_code error;
+    WriteSnapshot(error, true);
 }
 
-FileWatcher::~FileWatcher() noexcept
+bool FileWatcher::CatchUpSnapshot() noexcept
 {
-    m_IsWatching = false;
-    
-    if(m_InternalState && m_InternalState->RootWatchDescriptor != -1)
+    std::error_code error;
+    const FileWatcherMappedFile file(m_Options.SnapshotPath.c_str(), error);
+    if(!file.Exists && !error)
+        return true;
+
+    const std::optional<FileWatcherTreeSnapshotView> snapshot{ error ? std::nullopt : FileWatcherTreeSnapshotView::Open(file.Data, file.Size) };
+    if(!snapshot)
+    {
+        if(!error)
+            error.assign(static_cast<int>(EFileWatcherError::InvalidSnapshot), FileWatcherCategory());
+
+        m_InternalState->Reactor->Post(this, [this, error]() noexcept { QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, error); });
+        return true;
+    }
+
+    FileWatcherSnapshotCatchUp catchUp{ .Snapshot{ *snapshot }, .RacyPeriod{ GetSnapshotRacyPeriod(m_ObservedPath.c_str()) } };
+    FileWatcherSnapshotDiff& result{ catchUp.Result };
+
+    // Diffing is mostly spent stat'ing every entry, which the threads share by directory. Small trees only use a single one.
+    const size_t maxThreads{ m_Options.CrawlerThreads ? m_Options.CrawlerThreads : std::max(std::thread::hardware_concurrency(), 1U) };
+    const size_t threadCount{ std::min(maxThreads, snapshot->GetSize() / s_SnapshotRecordsPerThread + 1U) };
+
+    catchUp.PendingDirectories.emplace_back(0U, m_ObservedPath.native());
+    while(true)
+    {
+        // The calling thread diffs as well
+        std::vector<std::thread> workers;
+        for(size_t i{ 1U }; i < threadCount; ++i)
+            workers.emplace_back(&FileWatcher::DiffSnapshotThreadWork, this, std::ref(catchUp));
+
+        DiffSnapshotThreadWork(catchUp);
+        for(std::thread& worker : workers)
+            worker.join();
+
+        // The previous snapshot stays in place, so nothing is lost by reporting the changes next time
+        if(m_InternalState->Snapshot.IsCancelled.load(std::memory_order_relaxed))
+            return false;
+
+        if(result.Deleted.empty() || result.Created.empty())
+            break;
+
+        // An entry which disappeared in one place and appeared in another was renamed, which it's inode and creation time tell.
+        // A renamed file keeps it's size and modification time as well, a directory's follow it's contents.
+        std::unordered_map<uint64_t, FileWatcherSnapshotCandidate*> deletedByInode;
+        deletedByInode.reserve(result.Deleted.size());
+        for(FileWatcherSnapshotCandidate& deleted : result.Deleted)
+            deletedByInode.emplace(catchUp.Snapshot[deleted.Index].Inode, &deleted);
+
+        for(FileWatcherSnapshotCandidate& created : result.Created)
+        {
+            const auto match{ deletedByInode.find(created.Entry.Inode) };
+            if(match == deletedByInode.end() || match->second->IsPaired)
+                continue;
+
+            FileWatcherSnapshotCandidate& deleted{ *match->second };
+            const FileWatcherTreeSnapshotRecord& recorded{ catchUp.Snapshot[deleted.Index] };
+            if(static_cast<bool>(recorded.IsDirectory) != created.Entry.IsDirectory || recorded.CreationTime != created.Entry.CreationTime ||
+                (!recorded.IsDirectory && (recorded.Size != created.Entry.Size || recorded.ModificationTime != created.Entry.ModificationTime)))
+                continue;
+
+            deleted.IsPaired = true;
+            created.IsPaired = true;
+            result.Events.push_back(FileWatcherCaughtUpEvent{ .Action{ EFileAction::Renamed }, .Path{ created.Path }, .OldPath{ deleted.Path }, .IsDirectory{ created.Entry.IsDirectory } });
+
+            // The contents moved along, and are diffed at their new place
+            if(recorded.IsDirectory)
+                catchUp.PendingDirectories.emplace_back(deleted.Index, created.Path);
+        }
+
+        std::erase_if(result.Deleted, [](const FileWatcherSnapshotCandidate& candidate) noexcept { return candidate.IsPaired; });
+        std::erase_if(result.Created, [](const FileWatcherSnapshotCandidate& candidate) noexcept { return candidate.IsPaired; });
+
+        if(catchUp.PendingDirectories.empty())
+            break;
+    }
+
+    for(FileWatcherSnapshotCandidate& deleted : result.Deleted)
+        CollectDeletedEntries(catchUp.Snapshot, deleted.Index, deleted.Path, result.Events);
+
+    std::unique_ptr<std::byte[]> buffer{ new(std::nothrow) std::byte[s_CrawlBufferSize] };
+    const auto isExcluded{ [this](const std::string_view path) noexcept { return IsExcludedDirectory(path); } };
+    for(FileWatcherSnapshotCandidate& created : result.Created)
+    {
+        result.Events.push_back(FileWatcherCaughtUpEvent{ .Action{ EFileAction::Created }, .Path{ created.Path }, .IsDirectory{ created.Entry.IsDirectory } });
+        if(buffer && created.Entry.IsDirectory && !isExcluded(created.Path))
+            CollectCreatedEntries(created.Path, buffer.get(), result.Events, isExcluded, m_InternalState->OwnAccesses);
+    }
+
+    // Saving starts from the directories diffed, which were all listed since the tree is watched
     {
-        assert(m_InternalState->InotifyInstance != -1);
-        inotify_rm_watch(m_InternalState->InotifyInstance, m_InternalState->RootWatchDescriptor);
+        FileWatcherSnapshotState& snapshot{ m_InternalState->Snapshot };
+        std::scoped_lock lock(snapshot.SaveMutex);
+        for(auto& [relativePath, listing] : result.Listings)
+            snapshot.Listings.insert_or_assign(std::move(relativePath), std::move(listing));
     }
 
-    if(m_WatcherThread.joinable())
-        m_WatcherThread.join();
+    if(result.Events.empty())
+        return true;
+
+    // Queued by the dispatch thread like any other event, ahead of EFileAction::Ready
+    m_InternalState->Reactor->Post(this, [this, events{ std::make_shared<std::vector<FileWatcherCaughtUpEvent>>(std::move(result.Events)) }]() noexcept
+    {
+        for(const FileWatcherCaughtUpEvent& event : *events)
+        {
+            if(event.Action == EFileAction::Renamed)
+                QueueRename(FileWatcherEvent::s_ResolvedPath, event.OldPath, FileWatcherEvent::s_ResolvedPath, event.Path, event.IsDirectory);
+            else
+                QueueEvent(event.Action, FileWatcherEvent::s_ResolvedPath, event.Path, event.Error, event.IsDirectory);
+        }
+    });
 
-    if(m_InternalState && m_InternalState->InotifyInstance != -1)
-        close(m_InternalState->InotifyInstance);
+    return true;
 }
 
-bool FileWatcher::IsWatching() const noexcept
+void FileWatcher::DiffSnapshotThreadWork(FileWatcherSnapshotCatchUp& catchUp) noexcept
 {
-    return m_IsWatching.load();
+    FileWatcherSnapshotDiff diff{ .Buffer{ std::unique_ptr<std::byte[]>(new(std::nothrow) std::byte[s_CrawlBufferSize]) }, .RacyPeriod{ catchUp.RacyPeriod } };
+    std::unique_lock lock(catchUp.Mutex);
+
+    while(diff.Buffer && !m_InternalState->Snapshot.IsCancelled.load(std::memory_order_relaxed))
+    {
+        if(catchUp.PendingDirectories.empty())
+        {
+            // Nothing is left once no thread might find more directories
+            if(catchUp.BusyThreads == 0U)
+                break;
+
+            catchUp.Condition.wait(lock);
+            continue;
+        }
+
+        const auto [index, path]{ std::move(catchUp.PendingDirectories.back()) };
+        catchUp.PendingDirectories.pop_back();
+        ++catchUp.BusyThreads;
+
+        lock.unlock();
+        DiffSnapshotDirectory(catchUp.Snapshot, diff, index, path);
+        lock.lock();
+
+        --catchUp.BusyThreads;
+        if(!diff.PendingDirectories.empty() || catchUp.BusyThreads == 0U)
+            catchUp.Condition.notify_all();
+
+        std::move(diff.PendingDirectories.begin(), diff.PendingDirectories.end(), std::back_inserter(catchUp.PendingDirectories));
+        diff.PendingDirectories.clear();
+    }
+
+    FileWatcherSnapshotDiff& result{ catchUp.Result };
+    std::move(diff.Deleted.begin(), diff.Deleted.end(), std::back_inserter(result.Deleted));
+    std::move(diff.Created.begin(), diff.Created.end(), std::back_inserter(result.Created));
+    std::move(diff.Events.begin(), diff.Events.end(), std::back_inserter(result.Events));
+    std::move(diff.Listings.begin(), diff.Listings.end(), std::back_inserter(result.Listings));
 }
 
-void FileWatcher::SetupWatcher(const bool useAsbolutePath, std::error_code& error) noexcept
+void FileWatcher::DiffSnapshotDirectory(const FileWatcherTreeSnapshotView& snapshot, FileWatcherSnapshotDiff& diff, const uint32_t index, const std::string& path) const noexcept
 {
-    if (!std::filesystem::exists(m_ObservedPath))
-	{
-		if (m_ObservedPath.has_parent_path() && m_ObservedPath.has_filename())
-		{
-			m_ObservedFile = m_ObservedPath.filename();
-			m_ObservedPath = m_ObservedPath.parent_path();
-		}
-		else
-		{
-			error.assign(static_cast<int>(EFileWatcherError::SpecifiedFileDoesntExist), FileWatcherCategory());
+    const FileWatcherTreeSnapshotRecord& record{ snapshot[index] };
 
-			return;
-		}
-	}
+    // Nothing is known about the entries of a directory which wasn't listed, and nothing is reported from an excluded one
+    if(!record.IsListed || IsExcludedDirectory(path))
+        return;
 
-	if (std::filesystem::is_regular_file(m_ObservedPath))
-	{
-		if (m_ObservedPath.has_parent_path())
-		{
-			if (m_ObservedPath.has_filename())
-			{
-				m_ObservedFile = m_ObservedPath.filename();
-				m_ObservedPath = m_ObservedPath.parent_path();
-			}
-			else
-			{
-                error.assign(static_cast<int>(EFileWatcherError::InvalidFile), FileWatcherCategory());
-				return;
-			}
-		}
-		else
-		{
-            error.assign(static_cast<int>(EFileWatcherError::RegularFileHasNoParentDirectory), FileWatcherCategory());
-			return;
-		}
-	}
-	if (useAsbolutePath)
-	{
-		m_ObservedPath = std::filesystem::absolute(m_ObservedPath, error);
-		if (error)
-			return;
-	}
+    // Removed meanwhile, which the events tell
+    const int directory{ m_InternalState->OwnAccesses.Open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) };
+    if(directory == -1)
+        return;
 
-    const int inotifyInstance{ inotify_init1(IN_NONBLOCK) };
-    if(inotifyInstance == -1)
+    // Adding, removing or renaming an entry updates the modification time of the directory. Unless that's too close to the snapshot to tell,
+    // an unchanged directory still has the recorded entries, which then only have to be stat'ed rather than listed.
+    struct stat status;
+    const bool isUnchanged{ fstat(directory, &status) == 0 && static_cast<uint64_t>(status.st_ino) == record.Inode &&
+        static_cast<int64_t>(status.st_mtim.tv_sec) * 1'000'000'000 + status.st_mtim.tv_nsec == record.ModificationTime &&
+        record.ModificationTime < snapshot.GetListedAt() - diff.RacyPeriod };
+
+    diff.Entries.clear();
+    if(isUnchanged)
     {
-        error.assign(errno, std::system_category());
-		return;
+        for(uint32_t child{ record.FirstChild }; child < record.FirstChild + record.ChildCount; ++child)
+        {
+            std::string name{ snapshot.GetName(child) };
+            if(const std::optional<FileWatcherSnapshotEntry> entry{ StatSnapshotEntry(directory, name.c_str()) })
+                diff.Entries.emplace_back(std::move(name), *entry);
+        }
     }
-
-    const std::string path{ m_ObservedPath.string() };
-    const int watcherHandle{ inotify_add_watch(inotifyInstance, path.c_str(), s_RootWatcherFlags) }; 
-     
-    if(watcherHandle == -1)
+    else
     {
-        error.assign(errno, std::system_category());
-        close(inotifyInstance);
-		return;
+        const std::error_code error{ ListDirectoryEntries(directory, diff.Buffer.get(), [directory, &diff](const std::string_view name, const bool) noexcept
+        {
+            if(const std::optional<FileWatcherSnapshotEntry> entry{ StatSnapshotEntry(directory, name.data()) })
+                diff.Entries.emplace_back(name, *entry);
+
+            return true;
+        }) };
+
+        if(error)
+        {
+            close(directory);
+            diff.Events.push_back(FileWatcherCaughtUpEvent{ .Action{ EFileAction::Error }, .Path{ path }, .Error{ error } });
+            return;
+        }
+
+        std::sort(diff.Entries.begin(), diff.Entries.end(), [](const auto& left, const auto& right) noexcept { return left.first < right.first; });
     }
 
-    m_InternalState = std::make_unique<FileWatcherInternalState>();
-    m_InternalState->InotifyInstance = inotifyInstance;
-    m_InternalState->RootWatchDescriptor = watcherHandle;
-    m_IsWatching = true;
+    close(directory);
+
+    // Saving the snapshot starts from this listing rather than listing the directory again
+    diff.Listings.emplace_back(GetRelativePath(m_ObservedPath.native(), path), FileWatcherSnapshotListing{ .Inode{ record.Inode }, .CreationTime{ record.CreationTime }, .Entries{ diff.Entries } });
 
-    if(m_ObservedFile.empty())
+    // Both sides are sorted by name, so they're merged in a single pass
+    uint32_t child{ record.FirstChild };
+    const uint32_t lastChild{ record.FirstChild + record.ChildCount };
+    auto current{ diff.Entries.begin() };
+    std::string file;
+
+    while(child < lastChild || current != diff.Entries.end())
     {
-        for(const auto& file : std::filesystem::recursive_directory_iterator(m_ObservedPath))
+        const std::string_view recordedName{ child < lastChild ? snapshot.GetName(child) : std::string_view{} };
+        const int order{ child == lastChild ? 1 : current == diff.Entries.end() ? -1 : recordedName.compare(current->first) };
+
+        file.assign(path);
+        file.push_back('/');
+        file.append(order > 0 ? std::string_view(current->first) : recordedName);
+
+        if(order < 0)
+            diff.Deleted.push_back(FileWatcherSnapshotCandidate{ .Path{ file }, .Index{ child++ }, .Entry{} });
+        else if(order > 0)
+            diff.Created.push_back(FileWatcherSnapshotCandidate{ .Path{ file }, .Index{ 0U }, .Entry{ (current++)->second } });
+        else
         {
-            if(file.is_directory())
+            const FileWatcherTreeSnapshotRecord& recorded{ snapshot[child] };
+            const FileWatcherSnapshotEntry& entry{ current->second };
+
+            // A directory replaced by another one, or anything replaced by an entry of another type, might have been renamed from elsewhere
+            if(static_cast<bool>(recorded.IsDirectory) != entry.IsDirectory || (recorded.IsDirectory && (recorded.Inode != entry.Inode || recorded.CreationTime != entry.CreationTime)))
             {
-                const int subdirectoryWatchHandle{ inotify_add_watch(m_InternalState->InotifyInstance, std::filesystem::path(file).string().c_str(), s_RootWatcherFlags) };     
-                if(subdirectoryWatchHandle != -1)
-                    m_InternalState->SubdirectoryWatchDescriptors[subdirectoryWatchHandle] = file;
-                else
-                {
-                    m_IsWatching = false;
-                    error.assign(errno, std::system_category());
-                    break;
-                }
+                diff.Deleted.push_back(FileWatcherSnapshotCandidate{ .Path{ file }, .Index{ child }, .Entry{} });
+                diff.Created.push_back(FileWatcherSnapshotCandidate{ .Path{ file }, .Index{ 0U }, .Entry{ entry } });
             }
+            else if(recorded.IsDirectory)
+                diff.PendingDirectories.emplace_back(child, file);
+            else if(HasChangedSince(recorded, entry, snapshot.GetListedAt(), diff.RacyPeriod))
+                diff.Events.push_back(FileWatcherCaughtUpEvent{ .Action{ EFileAction::Modified }, .Path{ file } });
+
+            ++child;
+            ++current;
         }
     }
+}
 
-    m_WatcherThread = std::thread(&FileWatcher::WatcherThreadWork, this);
+FileWatcherStringView FileWatcher::GetDirectoryPath(const uint32_t directoryId) const noexcept
+{
+    const std::optional<std::string_view> directory{ m_InternalState->Directories.Find(static_cast<int>(directoryId)) };
+    assert(directory.has_value());
+    return directory.value_or(std::string_view{});
 }
 
-void FileWatcher::WatcherThreadWork() const noexcept
+[[nodiscard]] static std::filesystem::file_type GetFileType(const mode_t mode) noexcept
 {
-    std::byte* watchBuffer{ reinterpret_cast<std::byte*>(malloc(static_cast<int>(s_WatchBufferSize))) };  
-    
-    // cookie -> old file name
-    std::unordered_map<uint32_t, std::filesystem::path> renamedFiles;
+    switch(mode & S_IFMT)
+    {
+    case S_IFREG: return std::filesystem::file_type::regular;
+    case S_IFDIR: return std::filesystem::file_type::directory;
+    case S_IFLNK: return std::filesystem::file_type::symlink;
+    case S_IFBLK: return std::filesystem::file_type::block;
+    case S_IFCHR: return std::filesystem::file_type::character;
+    case S_IFIFO: return std::filesystem::file_type::fifo;
+    case S_IFSOCK: return std::filesystem::file_type::socket;
+    default: return std::filesystem::file_type::unknown;
+    }
+}
 
-    if(!watchBuffer)
-        goto quitMonitoring;
+void FileWatcher::CollectFileStatus() noexcept
+{
+    FileWatcherInternalState& state{ *m_InternalState };
+    const std::string_view names{ m_BatchNames };
+    m_BatchStatuses.assign(m_QueuedEvents.size(), FileWatcherFileStatus{});
 
-    while(m_IsWatching) [[likely]]
+    for(size_t i{ 0U }; i < m_QueuedEvents.size(); ++i)
     {
-        pollfd fileEventReadPoll
+        const QueuedEvent& queuedEvent{ m_QueuedEvents[i] };
+        FileWatcherFileStatus& status{ m_BatchStatuses[i] };
+        if(queuedEvent.Error || queuedEvent.DirectoryId == FileWatcherEvent::s_NoDirectory)
+            continue;
+
+        // Nothing left to look up
+        if(queuedEvent.Action == EFileAction::Deleted)
         {
-           .fd{ m_InternalState->InotifyInstance },
-           .events{ POLLRDNORM },
-           .revents{}
-        };
+            status.Type = std::filesystem::file_type::not_found;
+            continue;
+        }
 
-        // Polling avoids thread exhaustion
-        switch(poll(&fileEventReadPoll, 1, -1))
+        // Looked up relative to the directory, so only the name is resolved. Retired directories aren't kept open, as their ids might be reused.
+        int directory{ AT_FDCWD };
+        bool isTemporary{ false };
+        if(queuedEvent.DirectoryId != FileWatcherEvent::s_ResolvedPath)
         {
-            case -1:
+            directory = state.DirectoryHandles.Find(queuedEvent.DirectoryId);
+            if(directory == -1)
             {
-                m_Callback({}, std::nullopt, EFileAction::Error, std::error_code(errno, std::system_category()));
-                goto quitMonitoring;
-            } break;
-            
-            default:
+                state.PathBuffer.assign(GetDirectoryPath(queuedEvent.DirectoryId));
+                isTemporary = !state.Directories.IsWatched(static_cast<int>(queuedEvent.DirectoryId));
+                directory = isTemporary ? open(state.PathBuffer.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC) : state.DirectoryHandles.Open(queuedEvent.DirectoryId, state.PathBuffer.c_str());
+            }
+
+            if(directory == -1)
             {
-                const bool readAvailable{ static_cast<bool>(fileEventReadPoll.revents & POLLRDNORM) };
-                
-                [[unlikely]]
-                if(!readAvailable) // Should never happen
-                    continue;
-            } break;
-        }       
+                status.Type = errno == ENOENT || errno == ENOTDIR ? std::filesystem::file_type::not_found : std::filesystem::file_type::unknown;
+                continue;
+            }
+        }
 
-        usleep(500); // Sleep 500 microseconds to reinforce IN_MOVED_FROM + IN_MOVED_TO pair as they are not atomic
-        const int length{ static_cast<int>(read(m_InternalState->InotifyInstance, watchBuffer, s_WatchBufferSize)) };
-        if(length == -1)
+        state.PathBuffer.assign(names.substr(queuedEvent.NameOffset, queuedEvent.NameLength));
+        const int flags{ AT_SYMLINK_NOFOLLOW | (state.PathBuffer.empty() ? AT_EMPTY_PATH : 0) };
+
+        struct statx result;
+        if(statx(directory, state.PathBuffer.c_str(), flags, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &result) == -1)
+        {
+            status.Type = errno == ENOENT || errno == ENOTDIR ? std::filesystem::file_type::not_found : std::filesystem::file_type::unknown;
+        }
+        else
+        {
+            status.Type = GetFileType(result.stx_mode);
+            status.Size = result.stx_size;
+            status.ModificationTime = static_cast<int64_t>(result.stx_mtime.tv_sec) * 1'000'000'000 + result.stx_mtime.tv_nsec;
+            status.Inode = result.stx_ino;
+        }
+
+        if(isTemporary)
+            close(directory);
+    }
+}
+
+bool FileWatcher::ReadFingerprint(const FileWatcherPathBuffer& path, FileWatcherFingerprint& fingerprint) const noexcept
+{
+    // Non-blocking, as the path might be a FIFO by now
+    const int file{ m_InternalState->OwnAccesses.Open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC) };
+    if(file == -1)
+        return false;
+
+    struct stat status;
+    if(fstat(file, &status) == -1 || !S_ISREG(status.st_mode) || !m_Fingerprints->ConsumeBudget(static_cast<uint64_t>(status.st_size)))
+    {
+        close(file);
+        return false;
+    }
+
+    // Read rather than mapped, as a file truncated by it's writer while mapped would raise SIGBUS
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::array<std::byte, FileWatcherFingerprintCache::s_ChunkSize> chunk;
+    FileWatcherContentHash hash;
+    ssize_t length;
+    while((length = read(file, chunk.data(), chunk.size())) > 0)
+        hash.Update(chunk.data(), static_cast<size_t>(length));
+
+    close(file);
+    if(length == -1)
+        return false;
+
+    fingerprint.Size = hash.GetSize();
+    fingerprint.Hash = hash.Finish();
+    return true;
+}
+
+void FileWatcher::SetupFanotify(std::error_code& error) noexcept
+{
+    FileWatcherFanotify& fanotify{ m_InternalState->Fanotify };
+    const std::string path{ m_ObservedPath.string() };
+
+    fanotify.Instance = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if(fanotify.Instance == -1)
+    {
+        error.assign(errno, std::system_category());
+        return;
+    }
+
+    fanotify.RootPath = std::filesystem::canonical(m_ObservedPath, error).native();
+    if(error)
+        return;
+
+    alignas(file_handle) std::array<std::byte, sizeof(file_handle) + MAX_HANDLE_SZ> rootHandle;
+    file_handle* handle{ reinterpret_cast<file_handle*>(rootHandle.data()) };
+    handle->handle_bytes = MAX_HANDLE_SZ;
+
+    int mountId;
+    fanotify.MountDirectory = OpenMountPoint(fanotify.RootPath);
+    if(fanotify.MountDirectory == -1 || name_to_handle_at(AT_FDCWD, path.c_str(), handle, &mountId, 0) == -1)
+    {
+        error.assign(errno, std::system_category());
+        return;
+    }
+
+    fanotify.RootHandle.assign(reinterpret_cast<const char*>(rootHandle.data()), sizeof(file_handle) + handle->handle_bytes);
+
+    // Paths are joined with the names of the subdirectories, so a trailing separator would be doubled
+    fanotify.ObservedPath = path;
+    while(fanotify.ObservedPath.size() > 1U && fanotify.ObservedPath.back() == '/')
+        fanotify.ObservedPath.pop_back();
+
+    // Mount marks can't report directory entry events, so the whole file system is marked.
+    fanotify.HasRenameEvents = fanotify_mark(fanotify.Instance, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, GetFanotifyFlags(m_Options) | FAN_RENAME, AT_FDCWD, path.c_str()) == 0;
+    if(
+        (!fanotify.HasRenameEvents && fanotify_mark(fanotify.Instance, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, GetFanotifyFlags(m_Options) | FAN_MOVED_FROM | FAN_MOVED_TO, AT_FDCWD, path.c_str()) == -1) ||
+        fanotify_mark(fanotify.Instance, FAN_MARK_ADD, s_FanotifyRootFlags, AT_FDCWD, path.c_str()) == -1)
+    {
+        error.assign(errno, std::system_category());
+        return;
+    }
+
+    m_InternalState->Reactor->ReserveWatchBuffer(std::max(m_Options.WatchBufferSize, s_MaxFanotifyEventSize), m_Options.MaxWatchBufferSize);
+
+    const auto lock{ m_InternalState->Reactor->Lock() };
+    m_InternalState->Reactor->Register(this);
+    m_InternalState->Reactor->AddSource(this, fanotify.Instance, error);
+    if(error)
+    {
+        m_InternalState->Reactor->Unregister(this);
+        return;
+    }
+
+    SetIsWatching(true);
+}
+
+bool FileWatcher::ProcessFanotifyEvents(const std::byte* buffer, const size_t length) noexcept
+{
+    FileWatcherFanotify& fanotify{ m_InternalState->Fanotify };
+
+    const auto isObserved{ [this, &fanotify](const uint32_t directoryId, const std::string_view name) noexcept
+    {
+        return directoryId != FileWatcherEvent::s_NoDirectory && (m_ObservedFile.empty() || (directoryId == fanotify.RootDirectoryId && m_ObservedFile.native() == name));
+    } };
+
+    return ForEachFanotifyEvent(buffer, length, [this, &isObserved](const fanotify_event_metadata& event, const std::byte* eventData) noexcept
+    {
+        if(event.vers != FANOTIFY_METADATA_VERSION)
+        {
+            SetIsWatching(false);
+            QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, std::make_error_code(std::errc::protocol_not_supported));
+            return false;
+        }
+
+        // Events are reported by file handle, there's no descriptor to close unless the kernel couldn't create one
+        if(event.fd >= 0)
+            close(event.fd);
+
+        if(event.mask & FAN_Q_OVERFLOW)
+        {
+            ProcessOverflow();
+            return true;
+        }
+
+        // Only the observed directory is marked for these
+        if(event.mask & (FAN_DELETE_SELF | FAN_MOVE_SELF))
         {
-            m_Callback({}, std::nullopt, EFileAction::Error, std::error_code(errno, std::system_category()));
-            goto quitMonitoring;
+            SetIsWatching(false);
+            QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, std::error_code(static_cast<int>(EFileWatcherError::WatchedDirectoryWasDeleted), FileWatcherCategory()));
+            return false;
         }
 
-        int i{ 0 };
-        while(i < length)
+        // The parent directory and name of the entry, and where it was moved from for renames
+        std::string_view directory, name, oldDirectory, oldName;
+        for(size_t offset{ event.metadata_len }; offset + sizeof(fanotify_event_info_fid) + sizeof(file_handle) <= event.event_len;)
         {
-            const inotify_event* const event{ reinterpret_cast<inotify_event*>(&watchBuffer[i]) };
-            i += (sizeof(inotify_event) + event->len);
+            const fanotify_event_info_header header{ ReadRecord<fanotify_event_info_header>(eventData + offset) };
+            if(header.len == 0U || offset + header.len > event.event_len)
+                break;
 
-            if(
-                event->mask & IN_IGNORED        || 
-                event->mask & IN_DELETE_SELF    || 
-                event->mask & IN_MOVE_SELF)     // Watched directory was deleted, renamed or the filesystem was unmounted.
+            const std::byte* handleData{ eventData + offset + offsetof(fanotify_event_info_fid, handle) };
+            const std::string_view handle{ reinterpret_cast<const char*>(handleData), sizeof(file_handle) + ReadRecord<file_handle>(handleData).handle_bytes };
+            const std::string_view recordName{ handle.data() + handle.size() };
+            offset += header.len;
+
+            if(header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || header.info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
             {
-                if(m_InternalState->RootWatchDescriptor == event->wd && m_IsWatching)
-                {
-                    m_Callback({}, std::nullopt, EFileAction::Error, std::error_code(static_cast<int>(EFileWatcherError::WatchedDirectoryWasDeleted), FileWatcherCategory()));
-                    goto quitMonitoring;
-                }
-                else if (m_InternalState->SubdirectoryWatchDescriptors.contains(event->wd)) 
-                {
-                    inotify_rm_watch(m_InternalState->RootWatchDescriptor, event->wd);
-                    m_InternalState->SubdirectoryWatchDescriptors.erase(event->wd);
-                }
+                directory = handle;
+                name = recordName;
+            }
+            else if(header.info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME)
+            {
+                oldDirectory = handle;
+                oldName = recordName;
             }
+        }
+
+        const uint32_t oldDirectoryId{ oldDirectory.empty() ? FileWatcherEvent::s_NoDirectory : ResolveFanotifyDirectory(oldDirectory) };
+        const uint32_t directoryId{ directory.empty() ? FileWatcherEvent::s_NoDirectory : ResolveFanotifyDirectory(directory) };
+        const bool isDirectory{ (event.mask & FAN_ONDIR) != 0U };
+
+        if(event.mask & FAN_RENAME)
+        {
+            const bool isOldObserved{ isObserved(oldDirectoryId, oldName) };
+            const bool isNewObserved{ isObserved(directoryId, name) };
+
+            // Moves across the boundary of the tree are a creation or a deletion as far as the tree is concerned
+            if(isOldObserved && isNewObserved)
+                QueueRename(oldDirectoryId, oldName, directoryId, name, isDirectory);
+            else if(isOldObserved)
+                QueueEvent(EFileAction::Deleted, oldDirectoryId, oldName, {}, isDirectory);
+            else if(isNewObserved)
+                QueueEvent(EFileAction::Created, directoryId, name, {}, isDirectory);
+        }
+        // Opening, reading or changing the attributes of a directory itself is reported by it's own handle and "." as the name
+        else if(name != "." && isObserved(directoryId, name))
+        {
+            // The watcher's own accesses aren't news. The kernel merges events of the same process, so an access is usually a single event.
+            FileWatcherOwnAccesses& ownAccesses{ m_InternalState->OwnAccesses };
+            const bool isOwnAccess{ event.mask & (FAN_OPEN | FAN_ACCESS | FAN_CLOSE_NOWRITE) && !ownAccesses.IsEmpty()
+                && ownAccesses.IsOwn(ResolvePath(directoryId, name, m_InternalState->PathBuffer), (event.mask & FAN_CLOSE_NOWRITE) != 0U) };
 
-            if(event->len) // Length will be 0 if watch was removed.
+            // Identical events are merged by the kernel, which loses their order. The file tells whether it was deleted last.
+            bool isDeletedLast{ true };
+            if(event.mask & (FAN_CREATE | FAN_MOVED_TO) && event.mask & (FAN_DELETE | FAN_MOVED_FROM))
             {
-                // A file was created. If the subject is a directory, we add a watch to keep track of it's contents.
-                if(event->mask & IN_CREATE)
-                {
-                    std::filesystem::path file{ ConstructReturnPath((struct FilewatcherCharacterType*)event->name, event->wd) };
-                    
-                    if(event->mask & IN_ISDIR)
-                    {
-                        const int subdirectoryWatchHandle{ inotify_add_watch(m_InternalState->InotifyInstance, file.string().c_str(), s_RootWatcherFlags) };     
-                        
-                        if(subdirectoryWatchHandle != -1)
-                            m_InternalState->SubdirectoryWatchDescriptors[subdirectoryWatchHandle] = file;
-                        else
-                            m_Callback(file, std::nullopt, EFileAction::Error, std::error_code(errno, std::system_category()));
-                    }
+                struct stat status;
+                ResolvePath(directoryId, name, m_InternalState->PathBuffer);
+                isDeletedLast = fstatat(AT_FDCWD, m_InternalState->PathBuffer.c_str(), &status, AT_SYMLINK_NOFOLLOW) == -1;
+            }
 
-                    if(m_ObservedFile.empty() || m_ObservedFile == file.filename())
-                        m_Callback(std::move(file), std::nullopt, EFileAction::Created, std::error_code{});
-                }
+            if(!isDeletedLast)
+                QueueEvent(EFileAction::Deleted, directoryId, name, {}, isDirectory);
 
-                if(event->mask & IN_DELETE)
-                {
-                    std::filesystem::path file{ ConstructReturnPath((struct FilewatcherCharacterType*)event->name, event->wd) };
-                    
-                    if(m_ObservedFile.empty() || m_ObservedFile == file.filename())
-                       m_Callback(std::move(file), std::nullopt, EFileAction::Deleted, std::error_code{});
-                }
+            if(event.mask & (FAN_CREATE | FAN_MOVED_TO))
+                QueueEvent(EFileAction::Created, directoryId, name, {}, isDirectory);
 
-                if(event->mask & IN_MODIFY)
-                {
-                    std::filesystem::path file{ ConstructReturnPath((struct FilewatcherCharacterType*)event->name, event->wd) };
-                    if(m_ObservedFile.empty() || m_ObservedFile == file.filename())
-                        m_Callback(std::move(file), std::nullopt, EFileAction::Modified, std::error_code{});
-                }
+            // The order a file is usually opened, read or written, and closed in
+            if(event.mask & FAN_OPEN && !isOwnAccess)
+                QueueEvent(EFileAction::Opened, directoryId, name, {}, isDirectory);
 
-                if(event->mask & IN_MOVED_FROM)
-                    renamedFiles[event->cookie] = ConstructReturnPath((struct FilewatcherCharacterType*)event->name, event->wd);
+            if(event.mask & FAN_ACCESS && !isOwnAccess)
+                QueueEvent(EFileAction::Accessed, directoryId, name, {}, isDirectory);
 
-                if(event->mask & IN_MOVED_TO)
-                {
-                    std::filesystem::path file{ ConstructReturnPath((struct FilewatcherCharacterType*)event->name, event->wd) };
-                    if(m_ObservedFile.empty() || m_ObservedFile == file.filename() || renamedFiles.contains(event->cookie))
-                    {
-                        m_Callback(renamedFiles[event->cookie], std::move(file), EFileAction::Renamed, std::error_code{});
-                        renamedFiles.erase(event->cookie);
-                    }
-                }
-            }
+            if(event.mask & FAN_MODIFY)
+                QueueEvent(EFileAction::Modified, directoryId, name, {}, isDirectory);
+
+            if(event.mask & FAN_ATTRIB)
+                QueueEvent(EFileAction::AttributeChanged, directoryId, name, {}, isDirectory);
+
+            if(event.mask & FAN_CLOSE_WRITE)
+                QueueEvent(EFileAction::CloseWrite, directoryId, name, {}, isDirectory);
+
+            if(isDeletedLast && event.mask & (FAN_DELETE | FAN_MOVED_FROM))
+                QueueEvent(EFileAction::Deleted, directoryId, name, {}, isDirectory);
         }
-    }
 
-quitMonitoring:
-    assert(renamedFiles.empty());
+        // Every directory below a moved one has a new path now
+        if(isDirectory && event.mask & (FAN_RENAME | FAN_MOVED_FROM | FAN_MOVED_TO))
+            InvalidateFanotifyDirectories();
+
+        return true;
+    });
+}
+
+uint32_t FileWatcher::ResolveFanotifyDirectory(const std::string_view handle) noexcept
+{
+    FileWatcherFanotify& fanotify{ m_InternalState->Fanotify };
+
+    if(const auto directory{ fanotify.DirectoryIds.find(handle) }; directory != fanotify.DirectoryIds.end())
+        return directory->second;
+
+    if(fanotify.DirectoryIds.size() >= s_MaxFanotifyDirectories)
+        InvalidateFanotifyDirectories();
+
+    // Removed meanwhile, there's no telling where it was
+    std::string& path{ m_InternalState->PathBuffer };
+    if(!ReadHandlePath(fanotify.MountDirectory, handle, path))
+        return FileWatcherEvent::s_NoDirectory;
+
+    const std::string_view rootPath{ fanotify.RootPath };
+    const bool isRoot{ path == rootPath };
+    const bool isInside{ isRoot || (m_ObservedFile.empty() && path.starts_with(rootPath) && (rootPath.back() == '/' || path[rootPath.size()] == '/')) };
 
-    for(auto&& [watcherDescriptor, _] : m_InternalState->SubdirectoryWatchDescriptors)
+    uint32_t directoryId{ FileWatcherEvent::s_NoDirectory };
+    if(isInside)
     {
-        assert(watcherDescriptor != -1);
-        inotify_rm_watch(m_InternalState->InotifyInstance, watcherDescriptor);    
-    }
+        directoryId = fanotify.NextDirectoryId++;
+        if(fanotify.NextDirectoryId == s_FanotifyDirectoryIdCount)
+            fanotify.NextDirectoryId = 0U;
 
-    m_InternalState->SubdirectoryWatchDescriptors.clear();
-    m_IsWatching = false;
+        std::string_view relativePath{ std::string_view(path).substr(rootPath.size()) };
+        while(relativePath.starts_with('/'))
+            relativePath.remove_prefix(1U);
 
-    [[likely]]
-    if(watchBuffer)
-        free(watchBuffer);
-}
+        std::string directoryPath{ fanotify.ObservedPath };
+        if(!relativePath.empty())
+        {
+            if(!directoryPath.empty() && directoryPath.back() != '/')
+                directoryPath.push_back('/');
+
+            directoryPath.append(relativePath);
+        }
+
+        m_InternalState->Directories.Insert(static_cast<int>(directoryId), directoryPath);
+        if(isRoot)
+            fanotify.RootDirectoryId = directoryId;
+    }
 
-struct alignas(alignof(char)) FilewatcherCharacterType { char Character; };
-static_assert(sizeof(FilewatcherCharacterType) == sizeof(char) && alignof(FilewatcherCharacterType) == alignof(char));
+    fanotify.DirectoryIds.emplace(handle, directoryId);
+    return directoryId;
+}
 
-std::filesystem::path FileWatcher::ConstructReturnPath(struct FilewatcherCharacterType* fileNameBuffer, const size_t watcherDescriptor) const noexcept
+void FileWatcher::InvalidateFanotifyDirectories() noexcept
 {
-    const std::string fileName(reinterpret_cast<char*>(fileNameBuffer));
-    if(m_InternalState->RootWatchDescriptor != static_cast<int>(watcherDescriptor))
-        return m_InternalState->SubdirectoryWatchDescriptors[static_cast<int>(watcherDescriptor)] / fileName;
-    else
-        return m_ObservedPath / fileName;
-}
\ No newline at end of file
+    FileWatcherFanotify& fanotify{ m_InternalState->Fanotify };
+
+    m_InternalState->Directories.RetireAll();
+    m_InternalState->DirectoryHandles.Clear();
+    fanotify.DirectoryIds.clear();
+    fanotify.RootDirectoryId = FileWatcherEvent::s_NoDirectory;
+
+    // A directory above the observed one might have been moved as well
+    if(ReadHandlePath(fanotify.MountDirectory, fanotify.RootHandle, m_InternalState->PathBuffer))
+        fanotify.RootPath = m_InternalState->PathBuffer;
+}
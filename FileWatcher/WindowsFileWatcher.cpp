@@ -1,4 +1,8 @@
 #include "FileWatcher.hpp"
+#include "FileWatcherEventQueue.hpp"
+#include "FileWatcherFilter.hpp"
+#include "FileWatcherFingerprints.hpp"
+#include "FileWatcherMetrics.hpp"
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -18,35 +22,81 @@ struct FileWatcherInternalState
 	HANDLE ObservedFileHandle;
 	OVERLAPPED OverlappedBuffer;
 	HANDLE QuitWatchingEvent;
+
+	// Only written by the watcher thread
+	FileWatcherCounter Reads{};
+	FileWatcherCounter ReadBytes{};
+	FileWatcherCounter Events{};
+	FileWatcherHistogramRecorder BytesPerRead{};
+	FileWatcherHistogramRecorder EventsPerRead{};
 };
 
-FileWatcher::FileWatcher(const std::filesystem::path& observedPath, FileWatcherCallback&& callback, const bool returnAbsolutePath, std::error_code& error) noexcept
+/* Every change is reported relative to the observed directory */
+static constexpr uint32_t s_ObservedDirectoryId{ 0U };
+
+/**
+ * Changes the notifications are requested for. Every kind of change is reported as a modification, so the
+ * modifications stand in for the attribute changes and accesses subscribed to along with them.
+ */
+[[nodiscard]] static DWORD GetNotifyFilter(const EFileWatcherEventMask eventMask) noexcept
+{
+	const auto isSubscribed{ [eventMask](const EFileWatcherEventMask subscription) noexcept { return (eventMask & subscription) != EFileWatcherEventMask::None; } };
+
+	DWORD notifyFilter{ FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME };
+	if (isSubscribed(EFileWatcherEventMask::Modified))
+		notifyFilter |= FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+	if (isSubscribed(EFileWatcherEventMask::AttributeChanged))
+		notifyFilter |= FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SECURITY;
+
+	if (isSubscribed(EFileWatcherEventMask::Accessed))
+		notifyFilter |= FILE_NOTIFY_CHANGE_LAST_ACCESS;
+
+	return notifyFilter;
+}
+
+[[nodiscard]] static FileWatcherStringView GetFileName(const FileWatcherStringView name) noexcept
+{
+	// The names are relative to the observed directory, npos wraps around to the beginning
+	return name.substr(name.find_last_of(L'\\') + 1U);
+}
+
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, FileWatcherBatchCallback&& callback, const FileWatcherOptions& options, std::error_code& error) noexcept
 	:
 	m_IsWatching(false),
 	m_ObservedPath(observedPath),
 	m_Callback(std::move(callback)),
+	m_Options(options),
 	m_WatcherThread{},
 	m_InternalState(nullptr)
 {
 	assert(m_Callback);
-	SetupWatcher(returnAbsolutePath, error);
+	CompileFilter();
+	StartDelivery();
+	SetupWatcher(error);
 }
 
-FileWatcher::FileWatcher(const std::filesystem::path& observedPath, const FileWatcherCallback& callback, const bool returnAbsolutePath, std::error_code& error) noexcept
+FileWatcher::FileWatcher(const std::filesystem::path& observedPath, const FileWatcherBatchCallback& callback, const FileWatcherOptions& options, std::error_code& error) noexcept
 	:
 	m_IsWatching(false),
 	m_ObservedPath(observedPath),
 	m_Callback(callback),
+	m_Options(options),
 	m_WatcherThread{},
 	m_InternalState(nullptr)
 {
 	assert(m_Callback);
-	SetupWatcher(returnAbsolutePath, error);
+	CompileFilter();
+	StartDelivery();
+	SetupWatcher(error);
 }
 
 FileWatcher::~FileWatcher() noexcept
 {
-	m_IsWatching = false;
+	SetIsWatching(false);
+
+	// The watcher thread might be waiting for room in the delivery queue
+	StopDelivery();
 	
 	if (m_InternalState)
 		if (m_InternalState->QuitWatchingEvent)
@@ -67,8 +117,88 @@ bool FileWatcher::IsWatching() const noexcept
 	return m_IsWatching.load();
 }
 
-void FileWatcher::SetupWatcher(const bool returnAbsolutePath, std::error_code& error) noexcept
+void FileWatcher::Stop() noexcept
 {
+	SetIsWatching(false);
+
+	// Releases the watcher thread if it waits for room, events still queued are discarded
+	if (m_DeliveryLanes)
+		m_DeliveryLanes->Close();
+
+	// The watcher thread returns as soon as it's woken, it's joined by the destructor
+	if (m_InternalState && m_InternalState->QuitWatchingEvent)
+		SetEvent(m_InternalState->QuitWatchingEvent);
+}
+
+FileWatcherStats FileWatcher::GetStats() const noexcept
+{
+	if (!m_InternalState)
+		return FileWatcherStats{};
+
+	// Every completed overlapped read is a separate wakeup.
+	const uint64_t reads{ m_InternalState->Reads.Load() };
+	FileWatcherStats stats
+	{
+		.WatchBufferSize{ m_InternalState->WatchBuffer.size() },
+		.Wakeups{ reads },
+		.Reads{ reads },
+		.ReadBytes{ m_InternalState->ReadBytes.Load() },
+		// Neither is measured, a completed read isn't followed by another until the events are handled
+		.LongestDrain{ 0U },
+		.BufferGrowths{ 0U },
+		.Syscalls{ 0U },
+		.IsUsingIoUring{ false },
+		.Events{ m_InternalState->Events.Load() },
+		.Callbacks{ m_Callbacks.load(std::memory_order_relaxed) },
+		.CoalescedEvents{ m_CoalescedEventCount.load(std::memory_order_relaxed) },
+		.QueueDepth{ m_DeliveryLanes ? m_DeliveryLanes->GetSize() : 0U },
+		.QueueHighWaterMark{ m_QueueHighWaterMark.load(std::memory_order_relaxed) },
+		.DroppedEvents{ m_DroppedEvents.load(std::memory_order_relaxed) },
+		.UnchangedModifications{ m_UnchangedModifications.load(std::memory_order_relaxed) },
+		// A single handle watches the whole tree, and renames arrive as adjacent pairs
+		.WatchedDirectories{ 1U },
+		.PendingRenames{ 0U },
+		.PendingRenamesHighWaterMark{ 0U },
+	};
+
+	m_InternalState->BytesPerRead.AddTo(stats.BytesPerRead);
+	m_InternalState->EventsPerRead.AddTo(stats.EventsPerRead);
+	for (size_t i{ 0U }; i < m_CallbackDurationCount; ++i)
+		m_CallbackDurations[i].AddTo(stats.CallbackNanoseconds);
+
+	return stats;
+}
+
+void FileWatcher::AddTarget(const std::filesystem::path&, std::error_code& error) noexcept
+{
+	error.assign(static_cast<int>(EFileWatcherError::TargetsNotSupported), FileWatcherCategory());
+}
+
+void FileWatcher::RemoveTarget(const std::filesystem::path&, std::error_code& error) noexcept
+{
+	error.assign(static_cast<int>(EFileWatcherError::TargetsNotSupported), FileWatcherCategory());
+}
+
+void FileWatcher::SaveSnapshot(std::error_code& error) const noexcept
+{
+	error.assign(static_cast<int>(EFileWatcherError::SnapshotNotSupported), FileWatcherCategory());
+}
+
+void FileWatcher::SetupWatcher(std::error_code& error) noexcept
+{
+	if (m_Options.Backend != EFileWatcherBackend::Default)
+	{
+		error.assign(static_cast<int>(EFileWatcherError::BackendNotSupported), FileWatcherCategory());
+		return;
+	}
+
+	// A single recursive read per watcher, which can't cover targets spread over many directories
+	if (m_ObservedPath.empty())
+	{
+		error.assign(static_cast<int>(EFileWatcherError::TargetsNotSupported), FileWatcherCategory());
+		return;
+	}
+
 	if (!std::filesystem::exists(m_ObservedPath))
 	{
 		if (m_ObservedPath.has_parent_path() && m_ObservedPath.has_filename())
@@ -78,7 +208,7 @@ void FileWatcher::SetupWatcher(const bool returnAbsolutePath, std::error_code& e
 		}
 		else
 		{
-			error.assign(static_cast<int>(EFileWatcherError::SpecifiedFileDoesntExist), FileWatcherErrorCategory());
+			error.assign(static_cast<int>(EFileWatcherError::SpecifiedFileDoesntExist), FileWatcherCategory());
 			return;
 		}
 	}
@@ -94,18 +224,18 @@ void FileWatcher::SetupWatcher(const bool returnAbsolutePath, std::error_code& e
 			}
 			else
 			{
-				error.assign(static_cast<int>(EFileWatcherError::InvalidFile), FileWatcherErrorCategory());
+				error.assign(static_cast<int>(EFileWatcherError::InvalidFile), FileWatcherCategory());
 				return;
 			}
 		}
 		else
 		{
-			error.assign(static_cast<int>(EFileWatcherError::RegularFileHasNoParentDirectory), FileWatcherErrorCategory());
+			error.assign(static_cast<int>(EFileWatcherError::RegularFileHasNoParentDirectory), FileWatcherCategory());
 			return;
 		}
 	}
 
-	if (returnAbsolutePath)
+	if (m_Options.ReturnAbsolutePath)
 	{
 		std::error_code errorCode;
 		m_ObservedPath = std::filesystem::absolute(m_ObservedPath, errorCode);
@@ -135,10 +265,10 @@ void FileWatcher::SetupWatcher(const bool returnAbsolutePath, std::error_code& e
 		return;
 	}
 
-	m_InternalState = std::make_unique<FileWatcherInternalState>(s_WatchBufferSize, observedFileHandle);
+	m_InternalState = std::make_unique<FileWatcherInternalState>(m_Options.WatchBufferSize, observedFileHandle);
 	if (!m_InternalState)
 	{
-		error.assign(static_cast<int>(EFileWatcherError::InternalStateCreationFailed), FileWatcherErrorCategory());
+		error.assign(static_cast<int>(EFileWatcherError::InternalStateCreationFailed), FileWatcherCategory());
 		return;
 	}
 
@@ -157,41 +287,65 @@ void FileWatcher::SetupWatcher(const bool returnAbsolutePath, std::error_code& e
 		return;
 	}
 
-	m_IsWatching = true;
+	// The whole tree is covered by a single recursive read
+	SetIsWatching(true);
+	m_IsReady = true;
 	m_WatcherThread = std::move(std::thread(&FileWatcher::WatcherThreadWork, this));
 }
 
-void FileWatcher::WatcherThreadWork() const noexcept
+void FileWatcher::WatcherThreadWork() noexcept
 {
 	/* Used later for managing callbacks */
-	std::filesystem::path renamedOld;
-	std::filesystem::path previouslyCreatedFile;
+	std::wstring renamedOld;
+	std::wstring previouslyCreatedFile;
 	EFileAction previousFileAction{ EFileAction::Error };
+	/* A wait might time out to deliver coalesced events, the read stays pending meanwhile */
+	bool isReadPending{ false };
+
+	if (m_Options.AsynchronousSetup)
+	{
+		QueueEvent(EFileAction::Ready, FileWatcherEvent::s_NoDirectory, {});
+		FlushEvents();
+	}
 
 	beginWork:
 	[[likely]]
 	while (m_IsWatching)
 	{
-		const BOOL success
+		if (!isReadPending)
 		{
-			ReadDirectoryChangesW
-			(
-				m_InternalState->ObservedFileHandle,
-				static_cast<LPVOID>(m_InternalState->WatchBuffer.data()),
-				static_cast<DWORD>(m_InternalState->WatchBuffer.size()),
-				m_ObservedFile.empty() ? TRUE : FALSE, /* Recursive only if observing a directory */
-				FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME,
-				0,
-				&m_InternalState->OverlappedBuffer,
-				0
-			)
-		};
-
-		// If the function succeeds, the return value is nonzero. For synchronous calls, this means that the operation succeeded
-		if(!success)
+			const BOOL success
+			{
+				ReadDirectoryChangesW
+				(
+					m_InternalState->ObservedFileHandle,
+					static_cast<LPVOID>(m_InternalState->WatchBuffer.data()),
+					static_cast<DWORD>(m_InternalState->WatchBuffer.size()),
+					m_ObservedFile.empty() ? TRUE : FALSE, /* Recursive only if observing a directory */
+					GetNotifyFilter(m_Options.EventMask),
+					0,
+					&m_InternalState->OverlappedBuffer,
+					0
+				)
+			};
+
+			// If the function succeeds, the return value is nonzero. For synchronous calls, this means that the operation succeeded
+			if(!success)
+			{
+				QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, std::error_code{ static_cast<int>(GetLastError()), std::system_category() });
+				FlushEvents();
+				goto beginWork;
+			}
+
+			isReadPending = true;
+		}
+
+		/* Wake up once the earliest coalesced event is due */
+		DWORD timeout{ INFINITE };
+		if (!m_CoalescingQueue.empty())
 		{
-			m_Callback(std::filesystem::path{}, std::nullopt, EFileAction::Error, std::error_code{ static_cast<int>(GetLastError()), std::system_category() });
-			goto beginWork;
+			const int64_t remaining{ std::chrono::ceil<std::chrono::milliseconds>(m_CoalescingQueue.front()->second.Deadline - std::chrono::steady_clock::now()).count() };
+			timeout = remaining > 0 ? static_cast<DWORD>(remaining) : 0U;
 		}
 
 		const HANDLE synchronizationObjects[2U]{ m_InternalState->OverlappedBuffer.hEvent, m_InternalState->QuitWatchingEvent };
@@ -200,12 +354,13 @@ void FileWatcher::WatcherThreadWork() const noexcept
 			sizeof(synchronizationObjects) / sizeof(synchronizationObjects[0U]),
 			synchronizationObjects,
 			FALSE, // Proceed if an overlapped event had happened or file watcher was suspended
-			INFINITE
+			timeout
 		))
 		{
 			/* Overlapped event */
 			case WAIT_OBJECT_0:
 			{
+				isReadPending = false;
 				DWORD readBytes{ 0U };
 				const BOOL result
 				{
@@ -221,58 +376,75 @@ void FileWatcher::WatcherThreadWork() const noexcept
 				// If the function succeeds, the return value is nonzero. If the function fails, the return value is zero.
 				if (!result)
 				{
-					m_Callback(std::filesystem::path{}, std::nullopt, EFileAction::Error, std::error_code(static_cast<int>(GetLastError()), std::system_category()));
+					QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, std::error_code(static_cast<int>(GetLastError()), std::system_category()));
+					FlushEvents();
+					goto beginWork;
+				}
+
+				m_InternalState->Reads.Add(1U);
+				m_InternalState->ReadBytes.Add(readBytes);
+				m_InternalState->BytesPerRead.Record(readBytes);
+
+				// Nothing was written, the buffer was too small to hold all the changes
+				if (readBytes == 0U)
+				{
+					QueueEvent(EFileAction::Overflow, FileWatcherEvent::s_NoDirectory, {}, std::error_code(static_cast<int>(EFileWatcherError::EventQueueOverflow), FileWatcherCategory()));
+					FlushEvents();
 					goto beginWork;
 				}
 
 				const FILE_NOTIFY_INFORMATION* event{ reinterpret_cast<FILE_NOTIFY_INFORMATION*>(m_InternalState->WatchBuffer.data()) };
+				uint64_t events{ 0U };
 				do
 				{
+					// The names are copied into the batch when queued, the watch buffer is reused by the next read
+					const FileWatcherStringView name{ event->FileName, event->FileNameLength / sizeof(wchar_t) };
+					const FileWatcherStringView fileName{ GetFileName(name) };
+					++events;
 					switch (event->Action)
 					{
 						case FILE_ACTION_ADDED:
 						{
-							std::filesystem::path file(ConstructReturnPath(reinterpret_cast<struct FilewatcherCharacterType*>(const_cast<wchar_t*>((event->FileName))), event->FileNameLength));
-							if (m_ObservedFile.empty() || m_ObservedFile == file.filename())
-								m_Callback(std::move(file), std::nullopt, EFileAction::Created, std::error_code{});
+							if (m_ObservedFile.empty() || m_ObservedFile.native() == fileName)
+								QueueEvent(EFileAction::Created, s_ObservedDirectoryId, name);
 
 							previousFileAction = EFileAction::Created;
 						} break;
 
 						case FILE_ACTION_REMOVED:
 						{
-							std::filesystem::path file = previouslyCreatedFile = (ConstructReturnPath(reinterpret_cast<struct FilewatcherCharacterType*>(const_cast<wchar_t*>((event->FileName))), event->FileNameLength));
-							if (m_ObservedFile.empty() || m_ObservedFile == file.filename())
-								m_Callback(std::move(file), std::nullopt, EFileAction::Deleted, std::error_code{});
+							previouslyCreatedFile = name;
+							if (m_ObservedFile.empty() || m_ObservedFile.native() == fileName)
+								QueueEvent(EFileAction::Deleted, s_ObservedDirectoryId, name);
 
 						} break;
 
 						case FILE_ACTION_MODIFIED:
 						{
 							/* Skip "modification" if file was just created */
-							std::filesystem::path file(ConstructReturnPath(reinterpret_cast<struct FilewatcherCharacterType*>(const_cast<wchar_t*>((event->FileName))), event->FileNameLength));
-							if (previouslyCreatedFile == file && previousFileAction == EFileAction::Created)
+							if (previouslyCreatedFile == name && previousFileAction == EFileAction::Created)
 							{
 								previousFileAction = EFileAction::Modified;
 								break;
 							}
 
-							if (m_ObservedFile.empty() || m_ObservedFile == file.filename())
-								m_Callback(std::move(file), std::nullopt, EFileAction::Modified, std::error_code{});
+							// The notification doesn't tell what changed, the most telling action subscribed to is reported
+							const EFileAction action{ IsSubscribed(EFileAction::Modified) ? EFileAction::Modified : IsSubscribed(EFileAction::AttributeChanged) ? EFileAction::AttributeChanged : EFileAction::Accessed };
+							if (m_ObservedFile.empty() || m_ObservedFile.native() == fileName)
+								QueueEvent(action, s_ObservedDirectoryId, name);
 
 						} break;
 
 						case FILE_ACTION_RENAMED_OLD_NAME:
 						{
-							renamedOld = ConstructReturnPath(reinterpret_cast<struct FilewatcherCharacterType*>(const_cast<wchar_t*>((event->FileName))), event->FileNameLength);
+							renamedOld = name;
 							previousFileAction = EFileAction::Renamed;
 						} break;
 
 						case FILE_ACTION_RENAMED_NEW_NAME:
 						{
-							std::filesystem::path file(ConstructReturnPath(reinterpret_cast<struct FilewatcherCharacterType*>(const_cast<wchar_t*>((event->FileName))), event->FileNameLength));
-							if (m_ObservedFile.empty() || m_ObservedFile == file.filename() || m_ObservedFile == renamedOld.filename())
-								m_Callback(renamedOld, std::move(file), EFileAction::Renamed, std::error_code{});
+							if (m_ObservedFile.empty() || m_ObservedFile.native() == fileName || m_ObservedFile.native() == GetFileName(renamedOld))
+								QueueRename(s_ObservedDirectoryId, renamedOld, s_ObservedDirectoryId, name);
 
 						} break;
 					}
@@ -282,6 +454,18 @@ void FileWatcher::WatcherThreadWork() const noexcept
 					else
 						event = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(reinterpret_cast<BYTE*>(const_cast<FILE_NOTIFY_INFORMATION*>(event)) + event->NextEntryOffset);
 				} while (true);
+
+				m_InternalState->Events.Add(events);
+				m_InternalState->EventsPerRead.Record(events);
+				ExpireCoalescedEvents(std::chrono::steady_clock::now());
+				FlushEvents();
+			} break;
+
+			case WAIT_TIMEOUT:
+			{
+				/* Coalesced events are due */
+				ExpireCoalescedEvents(std::chrono::steady_clock::now());
+				FlushEvents();
 			} break;
 
 			case WAIT_OBJECT_0 + 1U:
@@ -293,7 +477,8 @@ void FileWatcher::WatcherThreadWork() const noexcept
 			case WAIT_FAILED:
 			{
 				/* Should not have happened */
-				m_Callback(std::filesystem::path{}, std::nullopt, EFileAction::Error, std::error_code{ static_cast<int>(GetLastError()), std::system_category() });
+				QueueEvent(EFileAction::Error, FileWatcherEvent::s_NoDirectory, {}, std::error_code{ static_cast<int>(GetLastError()), std::system_category() });
+				FlushEvents();
 			} break;
 		}
 	}
@@ -302,23 +487,86 @@ quitMonitoring:
 	return;
 }
 
-struct alignas(alignof(wchar_t)) FilewatcherCharacterType { wchar_t Character; };
-static_assert(sizeof(FilewatcherCharacterType) == sizeof(wchar_t) && alignof(FilewatcherCharacterType) == alignof(wchar_t));
+bool FileWatcher::ReadFingerprint(const FileWatcherPathBuffer& path, FileWatcherFingerprint& fingerprint) const noexcept
+{
+	// Read rather than mapped, as a mapped file can't be truncated by it's writer. Directories fail to open without backup semantics.
+	const HANDLE file{ CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr) };
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
 
-std::filesystem::path FileWatcher::ConstructReturnPath(struct FilewatcherCharacterType* fileName, const size_t fileNameLength) const noexcept
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size) || !m_Fingerprints->ConsumeBudget(static_cast<uint64_t>(size.QuadPart)))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	std::array<std::byte, FileWatcherFingerprintCache::s_ChunkSize> chunk;
+	FileWatcherContentHash hash;
+	DWORD readBytes{ 0U };
+	BOOL success{ FALSE };
+	while ((success = ReadFile(file, chunk.data(), static_cast<DWORD>(chunk.size()), &readBytes, nullptr)) && readBytes > 0U)
+		hash.Update(chunk.data(), readBytes);
+
+	CloseHandle(file);
+	if (!success)
+		return false;
+
+	fingerprint.Size = hash.GetSize();
+	fingerprint.Hash = hash.Finish();
+	return true;
+}
+
+void FileWatcher::CollectFileStatus() noexcept
 {
-	const size_t bufferSize{ fileNameLength + sizeof(wchar_t) };
-	wchar_t* buffer{ reinterpret_cast<wchar_t*>(calloc(bufferSize / 2U, sizeof(wchar_t))) };
+	// FILETIME counts 100 nanosecond intervals since 1601
+	constexpr int64_t unixEpoch{ 116444736000000000LL };
 
-	[[likely]]
-	if (buffer)
+	const FileWatcherStringView names{ m_BatchNames };
+	FileWatcherPathBuffer path;
+	m_BatchStatuses.assign(m_QueuedEvents.size(), FileWatcherFileStatus{});
+
+	for (size_t i{ 0U }; i < m_QueuedEvents.size(); ++i)
 	{
-		memcpy(buffer, fileName, fileNameLength);
-		auto observedPath{ m_ObservedPath };
-		observedPath.append(buffer);
-		free(buffer);
-		return observedPath;
+		QueuedEvent& queuedEvent{ m_QueuedEvents[i] };
+		FileWatcherFileStatus& status{ m_BatchStatuses[i] };
+		if (queuedEvent.Error || queuedEvent.DirectoryId == FileWatcherEvent::s_NoDirectory)
+			continue;
+
+		// Nothing left to look up
+		if (queuedEvent.Action == EFileAction::Deleted)
+		{
+			status.Type = std::filesystem::file_type::not_found;
+			continue;
+		}
+
+		ResolvePath(queuedEvent.DirectoryId, names.substr(queuedEvent.NameOffset, queuedEvent.NameLength), path);
+
+		WIN32_FILE_ATTRIBUTE_DATA attributes{};
+		if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes))
+		{
+			const DWORD error{ GetLastError() };
+			status.Type = error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND ? std::filesystem::file_type::not_found : std::filesystem::file_type::unknown;
+			continue;
+		}
+
+		if (attributes.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+			status.Type = std::filesystem::file_type::symlink;
+		else if (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			status.Type = std::filesystem::file_type::directory;
+		else
+			status.Type = std::filesystem::file_type::regular;
+
+		const int64_t modificationTime{ static_cast<int64_t>(static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32U | attributes.ftLastWriteTime.dwLowDateTime) };
+		status.Size = static_cast<uint64_t>(attributes.nFileSizeHigh) << 32U | attributes.nFileSizeLow;
+		status.ModificationTime = (modificationTime - unixEpoch) * 100;
+
+		// The notifications don't tell directories apart, the attributes do
+		queuedEvent.IsDirectory = (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0U;
 	}
+}
 
-	return m_ObservedPath;
-}
\ No newline at end of file
+FileWatcherStringView FileWatcher::GetDirectoryPath(const uint32_t) const noexcept
+{
+	return m_ObservedPath.native();
+}
@@ -67,6 +67,19 @@ int main(const int argc, const char** argv) noexcept(true)
 						std::wcout << L"Renamed: " << filepath << L" to " << renamedNew.value() << L'\n';
 					} break;
 
+					case EFileAction::CloseWrite:
+					case EFileAction::AttributeChanged:
+					case EFileAction::Opened:
+					case EFileAction::Accessed:
+					{
+						std::wcout << FileActionToString(fileAction) << L": " << filepath << L'\n';
+					} break;
+
+					case EFileAction::Ready:
+					{
+					} break;
+
+					case EFileAction::Overflow:
 					case EFileAction::Error:
 					{
 						if (!ec)
@@ -82,9 +95,8 @@ int main(const int argc, const char** argv) noexcept(true)
 		return -1;
 	}
 
-	while (fileWatcher.IsWatching())
-	{
-	}
+	// Sleeps until watching fails, such as when the observed directory is deleted
+	fileWatcher.Wait();
 
 	if (error)
 		std::cout << error.message() << '\n';
@@ -0,0 +1,505 @@
+#include "FileWatcher.hpp"
+#include <filesystem>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/**
+ * Benchmarks the watcher's hot paths on a tree it builds itself, by default in a tmpfs:
+ * - throughput: files are created, modified, renamed and deleted as fast as possible, the events are counted as they're delivered.
+ * - latency: files are created at fixed rates, the delay until their creation is delivered is sampled.
+ * - setup: trees of growing directory counts are watched, the time the constructor takes and the memory the watcher holds are measured.
+ * The results are written as JSON, so runs can be compared over time.
+ */
+
+// Heap allocations, counted on every thread but the ones performing the file operations, as those belong to the benchmark rather than the watcher
+static std::atomic<uint64_t> s_Allocations{ 0U };
+static thread_local bool t_IsAllocationCounted{ true };
+
+void* operator new(const size_t size)
+{
+	if (t_IsAllocationCounted)
+		s_Allocations.fetch_add(1U, std::memory_order_relaxed);
+
+	if (void* const memory{ std::malloc(size ? size : 1U) })
+		return memory;
+
+	throw std::bad_alloc();
+}
+
+void* operator new(const size_t size, const std::nothrow_t&) noexcept
+{
+	if (t_IsAllocationCounted)
+		s_Allocations.fetch_add(1U, std::memory_order_relaxed);
+
+	return std::malloc(size ? size : 1U);
+}
+
+void operator delete(void* const memory) noexcept { std::free(memory); }
+void operator delete(void* const memory, const size_t) noexcept { std::free(memory); }
+void operator delete(void* const memory, const std::nothrow_t&) noexcept { std::free(memory); }
+
+struct BenchmarkOptions
+{
+	std::filesystem::path Root{};
+	std::filesystem::path Output{};
+	std::string Scenario{ "all" };
+	size_t ThroughputFiles{ 50000U };
+	size_t MaxDirectories{ 1000000U };
+	std::chrono::milliseconds LatencyDuration{ 1000 };
+	std::vector<size_t> LatencyRates{ 1000U, 10000U, 100000U };
+};
+
+// Counts the events delivered to the callback, which may run on several delivery threads at once
+struct EventCounter
+{
+	std::atomic<uint64_t> Events{ 0U };
+	std::atomic<uint64_t> Overflows{ 0U };
+	std::atomic<int64_t> LastEventTime{ 0 };
+};
+
+[[nodiscard]] static int64_t Now() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+[[nodiscard]] static FileWatcherBatchCallback MakeCountingCallback(EventCounter& counter) noexcept
+{
+	return [&counter](const FileWatcher&, const std::span<const FileWatcherEvent> events)
+	{
+		uint64_t delivered{ 0U };
+		for (const FileWatcherEvent& event : events)
+		{
+			if (event.Action == EFileAction::Overflow)
+				counter.Overflows.fetch_add(1U, std::memory_order_relaxed);
+			else if (event.Action != EFileAction::Error && event.Action != EFileAction::Ready)
+				++delivered;
+		}
+
+		counter.Events.fetch_add(delivered, std::memory_order_relaxed);
+		counter.LastEventTime.store(Now(), std::memory_order_relaxed);
+	};
+}
+
+/**
+ * Waits until the expected events were delivered, or none were for the idle period, as lost events never arrive.
+ */
+static void WaitForEvents(const EventCounter& counter, const uint64_t expectedEvents, const std::chrono::milliseconds idlePeriod) noexcept
+{
+	uint64_t events{ counter.Events.load(std::memory_order_relaxed) };
+	std::chrono::steady_clock::time_point lastProgress{ std::chrono::steady_clock::now() };
+
+	while (events < expectedEvents && std::chrono::steady_clock::now() - lastProgress < idlePeriod)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if (const uint64_t current{ counter.Events.load(std::memory_order_relaxed) }; current != events)
+		{
+			events = current;
+			lastProgress = std::chrono::steady_clock::now();
+		}
+	}
+}
+
+static bool CreateFile(const char* path) noexcept
+{
+	std::FILE* const file{ std::fopen(path, "wb") };
+	if (!file)
+		return false;
+
+	std::fclose(file);
+	return true;
+}
+
+static bool AppendToFile(const char* path) noexcept
+{
+	std::FILE* const file{ std::fopen(path, "ab") };
+	if (!file)
+		return false;
+
+	std::fputc('x', file);
+	std::fclose(file);
+	return true;
+}
+
+/**
+ * Returns the heap memory the process has allocated and not freed yet, including the blocks large enough to be mapped on their own.
+ * Zero where the allocator can't tell.
+ */
+[[nodiscard]] static uint64_t GetHeapBytes() noexcept
+{
+#if defined(__GLIBC__)
+	const struct mallinfo2 info{ mallinfo2() };
+	return info.uordblks + info.hblkhd;
+#else
+	return 0U;
+#endif
+}
+
+/**
+ * Returns the resident memory of the process, or zero where it can't be read.
+ */
+[[nodiscard]] static uint64_t GetResidentBytes() noexcept
+{
+	std::ifstream status("/proc/self/status");
+	for (std::string line; std::getline(status, line);)
+		if (line.starts_with("VmRSS:"))
+			return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024U;
+
+	return 0U;
+}
+
+/**
+ * Summarizes a histogram of the watcher's statistics, the percentiles are the upper bounds of their buckets.
+ */
+[[nodiscard]] static std::string FormatHistogram(const FileWatcherHistogram& histogram) noexcept
+{
+	std::ostringstream json;
+	json << "{ \"count\": " << histogram.Count << ", \"mean\": " << histogram.GetMean() << ", \"p50\": " << histogram.GetPercentile(0.5)
+		<< ", \"p99\": " << histogram.GetPercentile(0.99) << " }";
+
+	return json.str();
+}
+
+[[nodiscard]] static std::string EscapeJson(const std::string_view text) noexcept
+{
+	std::string escaped;
+	escaped.reserve(text.size());
+	for (const char character : text)
+	{
+		if (character == '"' || character == '\\')
+			escaped.push_back('\\');
+
+		if (static_cast<unsigned char>(character) < 0x20U)
+			escaped.append("?");
+		else
+			escaped.push_back(character);
+	}
+
+	return escaped;
+}
+
+/**
+ * Every file goes through a creation, a modification, a rename and a deletion, so four events are expected per file.
+ */
+[[nodiscard]] static std::string RunThroughput(const BenchmarkOptions& benchmarkOptions, const std::string_view delivery, const FileWatcherOptions& watcherOptions) noexcept
+{
+	constexpr size_t directoryCount{ 16U };
+	const std::filesystem::path root{ benchmarkOptions.Root / "throughput" };
+
+	std::error_code error;
+	std::filesystem::remove_all(root, error);
+	for (size_t i{ 0U }; i < directoryCount; ++i)
+		std::filesystem::create_directories(root / std::to_string(i), error);
+
+	EventCounter counter;
+	std::optional<FileWatcher> watcher;
+	watcher.emplace(root, MakeCountingCallback(counter), watcherOptions, error);
+	if (error)
+		return "{ \"delivery\": \"" + std::string(delivery) + "\", \"error\": \"" + EscapeJson(error.message()) + "\" }";
+
+	const std::string rootPath{ root.string() };
+	char path[4096];
+	char renamedPath[4096];
+
+	t_IsAllocationCounted = false;
+	const uint64_t allocations{ s_Allocations.load(std::memory_order_relaxed) };
+	const int64_t start{ Now() };
+
+	size_t operations{ 0U };
+	for (size_t i{ 0U }; i < benchmarkOptions.ThroughputFiles; ++i)
+	{
+		std::snprintf(path, sizeof(path), "%s/%zu/f%zu", rootPath.c_str(), i % directoryCount, i);
+		std::snprintf(renamedPath, sizeof(renamedPath), "%s/%zu/r%zu", rootPath.c_str(), i % directoryCount, i);
+
+		operations += CreateFile(path);
+		operations += AppendToFile(path);
+		operations += std::rename(path, renamedPath) == 0;
+		operations += std::remove(renamedPath) == 0;
+	}
+
+	WaitForEvents(counter, operations, std::chrono::milliseconds(2000));
+	const uint64_t events{ counter.Events.load() };
+	const double seconds{ static_cast<double>(std::max(counter.LastEventTime.load(), start + 1) - start) / 1e9 };
+	const double allocationsPerEvent{ events ? static_cast<double>(s_Allocations.load(std::memory_order_relaxed) - allocations) / static_cast<double>(events) : 0.0 };
+	t_IsAllocationCounted = true;
+
+	const FileWatcherStats stats{ watcher->GetStats() };
+	watcher.reset();
+	std::filesystem::remove_all(root, error);
+
+	std::ostringstream json;
+	json << "{ \"delivery\": \"" << delivery << "\", \"operations\": " << operations << ", \"events\": " << events
+		<< ", \"seconds\": " << seconds << ", \"eventsPerSecond\": " << static_cast<double>(events) / seconds
+		<< ", \"overflows\": " << counter.Overflows.load() << ", \"droppedEvents\": " << stats.DroppedEvents
+		<< ", \"queueHighWaterMark\": " << stats.QueueHighWaterMark << ", \"wakeups\": " << stats.Wakeups
+		<< ", \"syscallsPerEvent\": " << (events ? static_cast<double>(stats.Syscalls) / static_cast<double>(events) : 0.0)
+		<< ", \"isUsingIoUring\": " << (stats.IsUsingIoUring ? "true" : "false") << ", \"allocationsPerEvent\": " << allocationsPerEvent << ", \"bytesPerRead\": " << FormatHistogram(stats.BytesPerRead)
+		<< ", \"eventsPerRead\": " << FormatHistogram(stats.EventsPerRead) << ", \"callbackNanoseconds\": " << FormatHistogram(stats.CallbackNanoseconds) << " }";
+
+	return json.str();
+}
+
+/**
+ * Files are created at a fixed rate, the delay from before creating each one until it's Created event is delivered is sampled.
+ */
+[[nodiscard]] static std::string RunLatency(const BenchmarkOptions& benchmarkOptions, const size_t rate) noexcept
+{
+	const std::filesystem::path root{ benchmarkOptions.Root / "latency" };
+	const size_t fileCount{ std::max<size_t>(rate * static_cast<size_t>(benchmarkOptions.LatencyDuration.count()) / 1000U, 1U) };
+
+	std::error_code error;
+	std::filesystem::remove_all(root, error);
+	std::filesystem::create_directories(root, error);
+
+	// Written before each file is created, read once it's event is delivered
+	std::unique_ptr<std::atomic<int64_t>[]> creationTimes{ std::make_unique<std::atomic<int64_t>[]>(fileCount) };
+	std::vector<int64_t> latencies;
+	latencies.reserve(fileCount);
+	EventCounter counter;
+
+	const auto callback{ [&](const FileWatcher&, const std::span<const FileWatcherEvent> events)
+	{
+		const int64_t now{ Now() };
+		for (const FileWatcherEvent& event : events)
+		{
+			if (event.Action == EFileAction::Overflow)
+				counter.Overflows.fetch_add(1U, std::memory_order_relaxed);
+
+			if (event.Action != EFileAction::Created || event.Name.empty() || event.Name.front() != 'l')
+				continue;
+
+			size_t index{ 0U };
+			for (const auto character : event.Name.substr(1U))
+				index = index * 10U + static_cast<size_t>(character - '0');
+
+			if (index < fileCount)
+				latencies.push_back(now - creationTimes[index].load(std::memory_order_acquire));
+		}
+
+		counter.Events.store(latencies.size(), std::memory_order_relaxed);
+	} };
+
+	std::optional<FileWatcher> watcher;
+	watcher.emplace(root, FileWatcherBatchCallback(callback), FileWatcherOptions{}, error);
+	if (error)
+		return "{ \"rate\": " + std::to_string(rate) + ", \"error\": \"" + EscapeJson(error.message()) + "\" }";
+
+	const std::string rootPath{ root.string() };
+	char path[4096];
+
+	// Paced by the schedule rather than by sleeping between files, so oversleeping is caught up on
+	const std::chrono::steady_clock::time_point start{ std::chrono::steady_clock::now() };
+	for (size_t i{ 0U }; i < fileCount; ++i)
+	{
+		const std::chrono::steady_clock::time_point scheduled{ start + std::chrono::nanoseconds(static_cast<int64_t>(i) * 1'000'000'000 / static_cast<int64_t>(rate)) };
+		if (scheduled > std::chrono::steady_clock::now())
+			std::this_thread::sleep_until(scheduled);
+
+		std::snprintf(path, sizeof(path), "%s/l%zu", rootPath.c_str(), i);
+		creationTimes[i].store(Now(), std::memory_order_release);
+		CreateFile(path);
+	}
+
+	const double achievedRate{ static_cast<double>(fileCount) / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() };
+	WaitForEvents(counter, fileCount, std::chrono::milliseconds(1000));
+
+	// Destroyed first, so the samples aren't written to anymore
+	const FileWatcherStats stats{ watcher->GetStats() };
+	watcher.reset();
+	std::filesystem::remove_all(root, error);
+
+	std::sort(latencies.begin(), latencies.end());
+	const auto percentile{ [&latencies](const double fraction) noexcept
+	{
+		return latencies.empty() ? 0.0 : static_cast<double>(latencies[std::min(static_cast<size_t>(fraction * static_cast<double>(latencies.size())), latencies.size() - 1U)]) / 1e3;
+	} };
+
+	std::ostringstream json;
+	json << "{ \"rate\": " << rate << ", \"achievedRate\": " << achievedRate << ", \"files\": " << fileCount << ", \"samples\": " << latencies.size()
+		<< ", \"p50Microseconds\": " << percentile(0.5) << ", \"p99Microseconds\": " << percentile(0.99) << ", \"p999Microseconds\": " << percentile(0.999)
+		<< ", \"maxMicroseconds\": " << percentile(1.0) << ", \"overflows\": " << counter.Overflows.load() << ", \"droppedEvents\": " << stats.DroppedEvents << " }";
+
+	return json.str();
+}
+
+/**
+ * Builds a tree of the given number of directories, a hundred per parent, and measures watching it and stopping again.
+ */
+[[nodiscard]] static std::string RunSetup(const BenchmarkOptions& benchmarkOptions, const size_t directoryCount) noexcept
+{
+	constexpr size_t fanOut{ 100U };
+	const std::filesystem::path root{ benchmarkOptions.Root / "setup" };
+
+	std::error_code error;
+	std::filesystem::remove_all(root, error);
+	std::filesystem::create_directories(root, error);
+
+	// Directory i is a child of directory (i - 1) / fanOut, the root being directory zero
+	std::vector<std::filesystem::path> paths;
+	paths.reserve(directoryCount + 1U);
+	paths.push_back(root);
+	for (size_t i{ 1U }; i <= directoryCount && !error; ++i)
+	{
+		paths.push_back(paths[(i - 1U) / fanOut] / std::to_string(i));
+		std::filesystem::create_directory(paths.back(), error);
+	}
+
+	if (error)
+	{
+		std::error_code removeError;
+		std::filesystem::remove_all(root, removeError);
+		return "{ \"directories\": " + std::to_string(directoryCount) + ", \"error\": \"" + EscapeJson(error.message()) + "\" }";
+	}
+
+	paths.clear();
+	paths.shrink_to_fit();
+
+	const auto callback{ [](const FileWatcher&, const std::span<const FileWatcherEvent>) {} };
+	const uint64_t heapBefore{ GetHeapBytes() };
+	const uint64_t residentBefore{ GetResidentBytes() };
+	const std::chrono::steady_clock::time_point start{ std::chrono::steady_clock::now() };
+	std::optional<FileWatcher> watcher;
+	watcher.emplace(root, FileWatcherBatchCallback(callback), FileWatcherOptions{}, error);
+	const std::chrono::steady_clock::time_point watched{ std::chrono::steady_clock::now() };
+	const uint64_t heapWatching{ GetHeapBytes() };
+	const uint64_t residentWatching{ GetResidentBytes() };
+	watcher.reset();
+	const std::chrono::steady_clock::time_point stopped{ std::chrono::steady_clock::now() };
+
+	std::error_code removeError;
+	std::filesystem::remove_all(root, removeError);
+
+	std::ostringstream json;
+	json << "{ \"directories\": " << directoryCount << ", \"setupMilliseconds\": " << std::chrono::duration<double, std::milli>(watched - start).count()
+		<< ", \"teardownMilliseconds\": " << std::chrono::duration<double, std::milli>(stopped - watched).count();
+
+	// Memory the kernel holds for the watches isn't in the process, so these are the watcher's own bookkeeping. The resident
+	// memory only grows once the heap outgrows what earlier runs left behind, the heap in use is exact.
+	if (heapBefore && heapWatching >= heapBefore)
+		json << ", \"heapBytes\": " << heapWatching - heapBefore
+			<< ", \"heapBytesPerDirectory\": " << static_cast<double>(heapWatching - heapBefore) / static_cast<double>(directoryCount);
+
+	if (residentBefore && residentWatching >= residentBefore)
+		json << ", \"residentBytes\": " << residentWatching - residentBefore
+			<< ", \"residentBytesPerDirectory\": " << static_cast<double>(residentWatching - residentBefore) / static_cast<double>(directoryCount);
+
+	if (error)
+		json << ", \"error\": \"" << EscapeJson(error.message()) << '"';
+
+	json << " }";
+	return json.str();
+}
+
+[[nodiscard]] static std::string JoinJson(const std::vector<std::string>& results) noexcept
+{
+	std::string joined{ "[" };
+	for (size_t i{ 0U }; i < results.size(); ++i)
+		joined.append(i ? ",\n    " : "\n    ").append(results[i]);
+
+	joined.append(results.empty() ? "]" : "\n  ]");
+	return joined;
+}
+
+[[nodiscard]] static bool ParseOptions(const int argc, const char** argv, BenchmarkOptions& options) noexcept
+{
+	for (int i{ 1 }; i < argc; ++i)
+	{
+		const std::string_view argument{ argv[i] };
+		const char* const value{ i + 1 < argc ? argv[i + 1] : nullptr };
+		if (!value)
+			return false;
+
+		const auto parseNumber{ [value](size_t& number) noexcept { return std::from_chars(value, value + std::strlen(value), number).ec == std::errc{}; } };
+		size_t number{ 0U };
+
+		if (argument == "--root")
+			options.Root = value;
+		else if (argument == "--output")
+			options.Output = value;
+		else if (argument == "--scenario")
+			options.Scenario = value;
+		else if (argument == "--throughput-files" && parseNumber(number))
+			options.ThroughputFiles = number;
+		else if (argument == "--max-directories" && parseNumber(number))
+			options.MaxDirectories = number;
+		else if (argument == "--latency-duration-ms" && parseNumber(number))
+			options.LatencyDuration = std::chrono::milliseconds(number);
+		else
+			return false;
+
+		++i;
+	}
+
+	return true;
+}
+
+int main(const int argc, const char** argv) noexcept(true)
+{
+	BenchmarkOptions options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: FileWatcherBenchmark [--root <directory>] [--output <file.json>] [--scenario all|throughput|latency|setup]\n"
+			"                           [--throughput-files <count>] [--max-directories <count>] [--latency-duration-ms <milliseconds>]\n";
+		return -1;
+	}
+
+	// A tmpfs keeps the file system itself out of the measurements
+	std::error_code error;
+	if (options.Root.empty())
+		options.Root = std::filesystem::is_directory("/dev/shm", error) ? std::filesystem::path("/dev/shm") : std::filesystem::temp_directory_path(error);
+
+	options.Root /= "FileWatcherBenchmark-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+	std::filesystem::create_directories(options.Root, error);
+	if (error)
+	{
+		std::cerr << "Failed creating " << options.Root << ": " << error.message() << '\n';
+		return -1;
+	}
+
+	const bool isAll{ options.Scenario == "all" };
+	std::vector<std::string> throughput;
+	std::vector<std::string> latency;
+	std::vector<std::string> setup;
+
+	if (isAll || options.Scenario == "throughput")
+	{
+		throughput.push_back(RunThroughput(options, "inline", FileWatcherOptions{}));
+		throughput.push_back(RunThroughput(options, "queued", FileWatcherOptions{ .DeliveryQueueCapacity{ 65536U }, .DeliveryThreads{ 2U } }));
+		throughput.push_back(RunThroughput(options, "queuedPerCore", FileWatcherOptions{ .DeliveryQueueCapacity{ 65536U }, .DeliveryThreads{ std::max(std::thread::hardware_concurrency(), 1U) } }));
+		throughput.push_back(RunThroughput(options, "queuedDropOldest", FileWatcherOptions{ .DeliveryQueueCapacity{ 256U }, .DeliveryThreads{ 1U }, .QueueFullPolicy{ EFileWatcherQueueFullPolicy::DropOldest } }));
+	}
+
+	if (isAll || options.Scenario == "latency")
+		for (const size_t rate : options.LatencyRates)
+			latency.push_back(RunLatency(options, rate));
+
+	if (isAll || options.Scenario == "setup")
+		for (size_t directories{ 1000U }; directories <= options.MaxDirectories; directories *= 10U)
+			setup.push_back(RunSetup(options, directories));
+
+	std::filesystem::remove_all(options.Root, error);
+
+	std::ostringstream json;
+	json << "{\n  \"timestamp\": " << std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()
+		<< ",\n  \"hardwareThreads\": " << std::thread::hardware_concurrency()
+		<< ",\n  \"throughput\": " << JoinJson(throughput)
+		<< ",\n  \"latency\": " << JoinJson(latency)
+		<< ",\n  \"setup\": " << JoinJson(setup) << "\n}\n";
+
+	if (options.Output.empty())
+		std::cout << json.str();
+	else
+		std::ofstream(options.Output) << json.str();
+
+	return 0;
+}
@@ -26,6 +26,11 @@ workspace("FileWatcher")
 		optimize "Off"				
 		runtime "Debug"				
 		staticruntime "on"		
+
+	filter "configurations:Release"
+		optimize "Speed"
+		runtime "Release"
+		staticruntime "on"
 		
 project("FileWatcher")
 	location "FileWatcher"
@@ -43,6 +48,13 @@ project("FileWatcher")
 	files 
 	{ 
 		"%{prj.name}/FileWatcher.hpp",
+		"%{prj.name}/FileWatcherEventQueue.hpp",
+		"%{prj.name}/FileWatcherFilter.hpp",
+		"%{prj.name}/FileWatcherFingerprints.hpp",
+		"%{prj.name}/FileWatcherMetrics.hpp",
+		"%{prj.name}/FileWatcherTreeSnapshot.hpp",
+		"%{prj.name}/FileWatcherStream.hpp",
+		"%{prj.name}/FileWatcher.cpp",
 		"%{prj.name}/main.cpp",
 	}
 	
@@ -62,4 +74,47 @@ project("FileWatcher")
 		{ 
 			"%{prj.name}/LinuxFileWatcher.cpp",
 		}
-		
\ No newline at end of file
+
+project("FileWatcherBenchmark")
+	location "FileWatcherBenchmark"
+	language "C++"
+	cppdialect "C++20"
+	kind "ConsoleApp"
+	warnings "Extra"
+
+	local ProjectOutputDirectory = "binaries/bin/" .. (OutputDirectory) .. "/%{prj.name}";
+	local ProjectIntermediateOutputDirectory = "binaries/bin-int/" .. (OutputDirectory) .. "/%{prj.name}";
+
+	targetdir (ProjectOutputDirectory)
+	objdir (ProjectIntermediateOutputDirectory)
+
+	-- Built from the watcher's sources rather than linked, as the watcher isn't a library project
+	files
+	{
+		"FileWatcher/FileWatcher.hpp",
+		"FileWatcher/FileWatcherEventQueue.hpp",
+		"FileWatcher/FileWatcherFilter.hpp",
+		"FileWatcher/FileWatcherFingerprints.hpp",
+		"FileWatcher/FileWatcherMetrics.hpp",
+		"FileWatcher/FileWatcherTreeSnapshot.hpp",
+		"FileWatcher/FileWatcherStream.hpp",
+		"FileWatcher/FileWatcher.cpp",
+		"%{prj.name}/Benchmark.cpp",
+	}
+
+	includedirs
+	{
+		"FileWatcher/",
+	}
+
+	filter "system:windows"
+		files
+		{
+			"FileWatcher/WindowsFileWatcher.cpp",
+		}
+
+	filter "system:linux"
+		files
+		{
+			"FileWatcher/LinuxFileWatcher.cpp",
+		}